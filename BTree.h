@@ -0,0 +1,431 @@
+#ifndef BTREEINDEX_BTREE_H
+#define BTREEINDEX_BTREE_H
+
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <type_traits>
+using namespace std;
+
+// In-memory B+ tree with the order fixed at compile time. It follows the same rules as the file
+// index: an internal entry is (largest key below the child, child), every record lives in a leaf
+// and the leaves are linked in key order.
+// A node is one cache-line aligned POD block: M keys, then M values or M child ids. Nodes live in a
+// single vector and refer to each other by index, so inserts and deletes do not allocate except
+// when the tree grows past the nodes reserved so far. Unused key slots hold the largest Key, so a
+// node is searched by counting keys below the probe over a fixed number of slots, a loop the
+// compiler unrolls and vectorizes.
+template<class Key, class Value, int M>
+class BTree {
+    static_assert(M >= 4, "a node needs room for at least four entries");
+    static_assert(numeric_limits<Key>::is_specialized, "keys must be arithmetic");
+    static_assert(is_trivially_copyable<Key>::value && is_trivially_copyable<Value>::value,
+                  "keys and values are copied as raw node memory");
+
+public:
+    typedef uint32_t NodeId;
+    static const NodeId None = numeric_limits<NodeId>::max();
+    static const int Order = M;
+    static const int MinEntries = M / 2; // below this a non-root node borrows or merges
+
+    struct alignas(64) Node {
+        Key keys[M];
+        union {
+            Value values[M];    // leaves
+            NodeId children[M]; // internal nodes
+        };
+        NodeId next; // leaves only: the next leaf in key order
+        int32_t count;
+        bool leaf;
+    };
+
+    // Forward iterator over (key, value) pairs in key order. It stays valid until the tree changes.
+    class const_iterator {
+    public:
+        const_iterator() = default;
+        const Key &key() const { return tree->nodes[leaf].keys[slot]; }
+        const Value &value() const { return tree->nodes[leaf].values[slot]; }
+        const_iterator &operator++() {
+            const Node &node = tree->nodes[leaf];
+            if (++slot == node.count) {
+                leaf = node.next;
+                slot = 0;
+            }
+            return *this;
+        }
+        bool operator==(const const_iterator &other) const { return leaf == other.leaf && slot == other.slot; }
+        bool operator!=(const const_iterator &other) const { return !(*this == other); }
+
+    private:
+        friend class BTree;
+        const BTree *tree = nullptr;
+        NodeId leaf = None;
+        int slot = 0;
+        const_iterator(const BTree *tree, NodeId leaf, int slot) : tree(tree), leaf(leaf), slot(slot) {}
+    };
+
+    BTree() = default;
+
+    size_t size() const { return records; }
+    bool empty() const { return records == 0; }
+    int height() const { return levels; }
+    size_t nodeCount() const { return nodes.size() - freeNodes.size(); }
+    size_t memoryBytes() const { return nodes.capacity() * sizeof(Node); }
+    void reserve(size_t count) { nodes.reserve(count); }
+
+    void clear() {
+        nodes.clear();
+        freeNodes.clear();
+        root = None;
+        records = 0;
+        levels = 0;
+    }
+
+    const Value *find(const Key &key) const {
+        if (root == None) {
+            return nullptr;
+        }
+        NodeId id = root;
+        for (;;) {
+            const Node &node = nodes[id];
+            int slot = lowerBound(node, key);
+            if (slot == node.count) {
+                return nullptr;
+            }
+            if (node.leaf) {
+                return node.keys[slot] == key ? &node.values[slot] : nullptr;
+            }
+            id = node.children[slot];
+        }
+    }
+
+    const_iterator begin() const {
+        if (root == None) {
+            return end();
+        }
+        NodeId id = root;
+        while (!nodes[id].leaf) {
+            id = nodes[id].children[0];
+        }
+        return const_iterator(this, id, 0);
+    }
+
+    const_iterator end() const { return const_iterator(this, None, 0); }
+
+    // first record whose key is not below `key`
+    const_iterator lowerBound(const Key &key) const {
+        if (root == None) {
+            return end();
+        }
+        NodeId id = root;
+        for (;;) {
+            const Node &node = nodes[id];
+            int slot = lowerBound(node, key);
+            if (slot == node.count) {
+                return end();
+            }
+            if (node.leaf) {
+                return const_iterator(this, id, slot);
+            }
+            id = node.children[slot];
+        }
+    }
+
+    // false if the key is already present; its value is left as it was
+    bool insert(const Key &key, const Value &value) {
+        if (root == None) {
+            root = allocate(true);
+            nodes[root].keys[0] = key;
+            nodes[root].values[0] = value;
+            nodes[root].count = 1;
+            records = 1;
+            levels = 1;
+            return true;
+        }
+
+        // descend, remembering the path; a key above every separator goes to the last child
+        NodeId path[MaxHeight];
+        int slots[MaxHeight];
+        int depth = 0;
+        NodeId id = root;
+        while (!nodes[id].leaf) {
+            const Node &node = nodes[id];
+            int slot = min(lowerBound(node, key), node.count - 1);
+            path[depth] = id;
+            slots[depth++] = slot;
+            id = node.children[slot];
+        }
+        int slot = lowerBound(nodes[id], key);
+        if (slot < nodes[id].count && nodes[id].keys[slot] == key) {
+            return false;
+        }
+
+        NodeId sibling = None, target = id;
+        if (nodes[id].count == M) {
+            sibling = split(id);
+            if (slot > nodes[id].count) {
+                slot -= nodes[id].count;
+                target = sibling;
+            }
+        }
+        openSlot(nodes[target], slot, key);
+        nodes[target].values[slot] = value;
+        records++;
+
+        // refresh the separator of the changed child and hand a split sibling to the parent, level by level
+        NodeId child = id;
+        while (depth > 0) {
+            NodeId parentId = path[--depth];
+            int at = slots[depth];
+            Key childMax = maxKey(child);
+            bool changed = nodes[parentId].keys[at] != childMax;
+            nodes[parentId].keys[at] = childMax;
+            if (sibling == None) {
+                if (!changed) {
+                    return true;
+                }
+                child = parentId;
+                continue;
+            }
+            NodeId next = None, into = parentId;
+            int position = at + 1;
+            if (nodes[parentId].count == M) {
+                next = split(parentId);
+                if (at >= nodes[parentId].count) {
+                    position -= nodes[parentId].count;
+                    into = next;
+                }
+            }
+            openSlot(nodes[into], position, maxKey(sibling));
+            nodes[into].children[position] = sibling;
+            sibling = next;
+            child = parentId;
+        }
+        if (sibling != None) {
+            NodeId newRoot = allocate(false);
+            Node &top = nodes[newRoot];
+            top.keys[0] = maxKey(child);
+            top.children[0] = child;
+            top.keys[1] = maxKey(sibling);
+            top.children[1] = sibling;
+            top.count = 2;
+            root = newRoot;
+            levels++;
+        }
+        return true;
+    }
+
+    // false if the key is not present
+    bool erase(const Key &key) {
+        if (root == None) {
+            return false;
+        }
+        NodeId path[MaxHeight];
+        int slots[MaxHeight];
+        int depth = 0;
+        NodeId id = root;
+        while (!nodes[id].leaf) {
+            const Node &node = nodes[id];
+            int slot = lowerBound(node, key);
+            if (slot == node.count) {
+                return false;
+            }
+            path[depth] = id;
+            slots[depth++] = slot;
+            id = node.children[slot];
+        }
+        int slot = lowerBound(nodes[id], key);
+        if (slot == nodes[id].count || nodes[id].keys[slot] != key) {
+            return false;
+        }
+        removeAt(nodes[id], slot);
+        records--;
+
+        // walk back up the path: refresh separators, and borrow or merge where a node fell under MinEntries
+        NodeId child = id;
+        while (depth > 0) {
+            NodeId parentId = path[--depth];
+            int at = slots[depth];
+            if (nodes[child].count > 0) {
+                nodes[parentId].keys[at] = maxKey(child);
+            }
+            if (nodes[child].count < MinEntries) {
+                rebalance(parentId, at);
+            }
+            child = parentId;
+        }
+
+        // a root with a single child hands the root over to it, an empty root leaf empties the tree
+        while (!nodes[root].leaf && nodes[root].count == 1) {
+            NodeId only = nodes[root].children[0];
+            release(root);
+            root = only;
+            levels--;
+        }
+        if (nodes[root].count == 0) {
+            release(root);
+            root = None;
+            levels = 0;
+        }
+        return true;
+    }
+
+private:
+    static const int MaxHeight = 64;
+    static const int Window = 32; // wide nodes are narrowed to this many slots before counting
+
+    vector<Node> nodes;
+    vector<NodeId> freeNodes;
+    NodeId root = None;
+    size_t records = 0;
+    int levels = 0;
+
+    static int lowerBound(const Node &node, const Key &key) {
+        int low = 0;
+        if (M > 2 * Window) {
+            int high = node.count;
+            while (high - low > Window) {
+                int mid = (low + high) / 2;
+                if (node.keys[mid] < key) {
+                    low = mid + 1;
+                } else {
+                    high = mid;
+                }
+            }
+            low = min(low, M - Window);
+        }
+        // keys before low are below key, and the padding after count never is
+        const int width = M > 2 * Window ? Window : M;
+        int below = 0;
+        for (int i = 0; i < width; ++i) {
+            below += node.keys[low + i] < key;
+        }
+        return low + below;
+    }
+
+    Key maxKey(NodeId id) const {
+        const Node &node = nodes[id];
+        return node.keys[node.count - 1];
+    }
+
+    NodeId allocate(bool leaf) {
+        NodeId id;
+        if (!freeNodes.empty()) {
+            id = freeNodes.back();
+            freeNodes.pop_back();
+        } else {
+            id = (NodeId) nodes.size();
+            nodes.emplace_back();
+        }
+        Node &node = nodes[id];
+        fill(node.keys, node.keys + M, numeric_limits<Key>::max());
+        node.next = None;
+        node.count = 0;
+        node.leaf = leaf;
+        return id;
+    }
+
+    void release(NodeId id) {
+        freeNodes.push_back(id);
+    }
+
+    // shifts the entries from `slot` on one place right and puts `key` at `slot`; the caller fills in
+    // the value or child
+    static void openSlot(Node &node, int slot, const Key &key) {
+        copy_backward(node.keys + slot, node.keys + node.count, node.keys + node.count + 1);
+        if (node.leaf) {
+            copy_backward(node.values + slot, node.values + node.count, node.values + node.count + 1);
+        } else {
+            copy_backward(node.children + slot, node.children + node.count, node.children + node.count + 1);
+        }
+        node.keys[slot] = key;
+        node.count++;
+    }
+
+    static void removeAt(Node &node, int slot) {
+        copy(node.keys + slot + 1, node.keys + node.count, node.keys + slot);
+        if (node.leaf) {
+            copy(node.values + slot + 1, node.values + node.count, node.values + slot);
+        } else {
+            copy(node.children + slot + 1, node.children + node.count, node.children + slot);
+        }
+        node.keys[--node.count] = numeric_limits<Key>::max();
+    }
+
+    // copies `count` entries starting at from[first] over to[into]; both nodes are on the same level
+    static void copyEntries(const Node &from, int first, int count, Node &to, int into) {
+        copy(from.keys + first, from.keys + first + count, to.keys + into);
+        if (from.leaf) {
+            copy(from.values + first, from.values + first + count, to.values + into);
+        } else {
+            copy(from.children + first, from.children + first + count, to.children + into);
+        }
+    }
+
+    // moves the last `count` entries of `from` to the front of `to`
+    static void moveBack(Node &from, Node &to, int count) {
+        copy_backward(to.keys, to.keys + to.count, to.keys + to.count + count);
+        if (to.leaf) {
+            copy_backward(to.values, to.values + to.count, to.values + to.count + count);
+        } else {
+            copy_backward(to.children, to.children + to.count, to.children + to.count + count);
+        }
+        copyEntries(from, from.count - count, count, to, 0);
+        to.count += count;
+        from.count -= count;
+        fill(from.keys + from.count, from.keys + M, numeric_limits<Key>::max());
+    }
+
+    // moves the first `count` entries of `from` to the back of `to`
+    static void moveFront(Node &from, Node &to, int count) {
+        copyEntries(from, 0, count, to, to.count);
+        to.count += count;
+        copyEntries(from, count, from.count - count, from, 0);
+        from.count -= count;
+        fill(from.keys + from.count, from.keys + M, numeric_limits<Key>::max());
+    }
+
+    // moves the upper half of a full node into a new sibling placed after it
+    NodeId split(NodeId id) {
+        NodeId sibling = allocate(nodes[id].leaf);
+        Node &node = nodes[id], &right = nodes[sibling];
+        moveBack(node, right, node.count - node.count / 2);
+        if (node.leaf) {
+            right.next = node.next;
+            node.next = sibling;
+        }
+        return sibling;
+    }
+
+    // the child at `at` has fewer than MinEntries: borrow from a sibling that can spare one, or merge
+    void rebalance(NodeId parentId, int at) {
+        Node &parent = nodes[parentId];
+        NodeId id = parent.children[at];
+        NodeId left = at > 0 ? parent.children[at - 1] : None;
+        NodeId right = at + 1 < parent.count ? parent.children[at + 1] : None;
+        if (left != None && nodes[left].count > MinEntries) {
+            moveBack(nodes[left], nodes[id], 1);
+            parent.keys[at - 1] = maxKey(left);
+        } else if (right != None && nodes[right].count > MinEntries) {
+            moveFront(nodes[right], nodes[id], 1);
+            parent.keys[at] = maxKey(id);
+        } else if (left != None) {
+            moveFront(nodes[id], nodes[left], nodes[id].count);
+            nodes[left].next = nodes[id].next;
+            parent.keys[at - 1] = maxKey(left);
+            removeAt(parent, at);
+            release(id);
+        } else if (right != None) {
+            moveFront(nodes[right], nodes[id], nodes[right].count);
+            nodes[id].next = nodes[right].next;
+            parent.keys[at] = maxKey(id);
+            removeAt(parent, at + 1);
+            release(right);
+        }
+    }
+
+};
+
+#endif // BTREEINDEX_BTREE_H
@@ -1,639 +1,3867 @@
-#include "BTreeIndex.h"
-
-using namespace std;
-
-void BTreeIndex::CreateIndexFile(const char *filename, int numberOfRecords, int m) {
-    BTreeFile.open(BTreeFileName, ios::in | ios::out | ios::binary);
-    this->numberOfRecords = numberOfRecords;
-    this->m = m;
-    /////////////////////////////////////////////////////////
-    ofstream outfile(filename, ios::binary);
-    outfile.clear();
-    int i = 1;
-    for (int j = 0; j < numberOfRecords; ++j) {
-        if (i == numberOfRecords) {
-            i = -1;
-        }
-        outfile << -1 << "  " << i << "  ";
-        for (int k = 0; k < numberOfRecords - 1; ++k) {
-            outfile << "-1" << "  ";
-        }
-        i++;
-        outfile << "\n";
-    }
-    readFile(filename);
-    outfile.close();
-    ///////////////////////////////////////////////////////////////
-}
-
-int BTreeIndex::InsertNewRecordAtIndex(int RecordID, int Reference) {
-    vector<BTreeNode> bTree = readFile(BTreeFileName);
-    if (bTree[0].count == 0) {
-        head = bTree[0].node[0].first;
-        bTree[0].node[0].first = RecordID;
-        bTree[0].node[0].second = Reference;
-        bTree[0].isLeaf = 0;
-        bTree[0].count++;
-        savefile(BTreeFileName, bTree, m);
-        return 1;
-    }
-    stack<int> visited;
-    int i = 0;
-    bool found = false;
-    while (bTree[i].isLeaf) {
-        visited.push(i);
-        found = false;
-        for (int j = 0; j < bTree[i].node.size(); ++j) {
-            if (bTree[i].node[j].first >= RecordID) {
-                i = bTree[i].node[j].second - 1;
-                found = true;
-                break;
-            }
-        }
-
-        if (!found) {
-            i = bTree[i].node[bTree[i].count - 1].second - 1;
-        }
-    }
-    bTree[i].node.push_back(make_pair(RecordID, Reference));
-    sort(bTree[i].node.begin(), bTree[i].node.end(), [](const std::pair<int, int> &a, const std::pair<int, int> &b) {
-        if (a.first != -1 && b.first != -1) {
-            return a.first < b.first;
-        }
-        return a.first != -1;
-    });
-
-    bTree[i].count++;
-    int newFromSplitIndex = -1;
-    if (bTree[i].count > m) {
-        newFromSplitIndex = split(i, bTree);
-    } else {
-        bTree[i].node.pop_back();
-        savefile(BTreeFileName, bTree, m);
-    }
-
-    if (i == 0) {
-        return 1;
-    }
-
-    while (!visited.empty()) {
-        int lastVisitedIndex = visited.top();
-        visited.pop();
-        newFromSplitIndex = updateAfterInsert(lastVisitedIndex, newFromSplitIndex);
-    }
-
-    return -1;
-}
-
-void BTreeIndex::DeleteCase2(const char *filename, vector<BTreeNode> &bTree, BTreeNode &find, int RecordID, int &count,
-                             int &temp) {
-    for (int i = 0; i < find.node.size(); ++i) { // case 2
-        if (find.node[i].first == RecordID) {
-            find.node[i].first = -1;
-            find.node[i].second = -1;
-        }
-        sort(find.node.begin(), find.node.end(), [](const std::pair<int, int> &a, const std::pair<int, int> &b) {
-            if (a.first != -1 && b.first != -1) {
-                return a.first < b.first;
-            }
-            return a.first != -1;
-        });
-    }
-    temp = find.node[count - 2].first;
-    bTree[(find.place - 1)].node = find.node;
-    for (auto &i: bTree) {
-        for (auto &k: i.node) {
-            if (k.first == RecordID) {
-                k.first = temp;
-            }
-        }
-    }
-    find.count--;
-    savefile(filename, bTree, m);
-}
-
-void BTreeIndex::DeleteCase1(const char *filename, vector<BTreeNode> &bTree, BTreeNode &find, int RecordID) {
-    for (int i = 0; i < find.node.size(); ++i) { // case 1
-        if (find.node[i].first == RecordID) {
-            find.node[i].first = -1;
-            find.node[i].second = -1;
-        }
-        sort(find.node.begin(), find.node.end(), [](const std::pair<int, int> &a, const std::pair<int, int> &b) {
-            if (a.first != -1 && b.first != -1) {
-                return a.first < b.first;
-            }
-            return a.first != -1;
-        });
-    }
-    find.count--;
-    bTree[(find.place - 1)].node = find.node;
-    savefile(filename, bTree, m);
-}
-
-void BTreeIndex::DeleteRecordFromIndex(const char *filename, int RecordID, int m) {
-    vector<BTreeNode> bTree;
-    bTree = readFile(filename);
-    int balance = m / 2;
-    int count = 0;
-    int temp;
-    BTreeNode find; // to find the node
-    for (auto &i: bTree) {
-        if (i.isLeaf == 0) {
-            for (int k = 0; k < i.node.size(); ++k) {
-                if (i.node[k].first == RecordID) {
-                    find = i;
-                    break;
-                }
-            }
-        }
-    }
-    if (find.place == 1) { // if the node is the root
-        DeleteCase1(filename, bTree, find, RecordID);
-        bTree = readFile(filename);
-        if (bTree[0].count == 0) {
-            bTree[0].node[0].first = 2;
-            head = 1;
-            bTree[0].isLeaf = -1;
-        }
-        savefile(filename, bTree, m);
-        return;
-    }
-    for (auto &i: find.node) { // get the node balance
-        if (i.first != -1) {
-            count++;
-        }
-    }
-    if ((count - 1) >= balance) {
-        if (find.node[count - 1].first == RecordID) {
-            DeleteCase2(filename, bTree, find, RecordID, count, temp);
-        } else {
-            DeleteCase1(filename, bTree, find, RecordID);
-        }
-    } else {
-        // case 3 or 4
-        BTreeNode parent;
-        BTreeNode siblings;
-        bool flag = 0;
-        for (size_t i = 0; i < bTree.size(); i++) {
-            if (bTree[i].isLeaf == 1) {
-                for (size_t j = 0; j < bTree[i].node.size(); j++) {
-                    if (bTree[i].node[j].second == find.place) {
-                        parent = bTree[i];
-                        break;
-                    }
-                }
-            }
-        }
-
-        for (size_t i = 0; i < parent.children.size(); i++) {
-            int ct = 0;
-            for (size_t j = 0; j < parent.children[i].node.size(); j++) {
-                if (parent.children[i].node[j].first != -1) {
-                    ct++;
-                }
-            }
-            parent.children[i].count = ct;
-        }
-
-        for (size_t i = 0; i < parent.children.size(); i++) {
-            if (parent.children[i].place == find.place) {
-                break;
-            }
-            if ((parent.children[i].count > balance) && (parent.children[i + 1].place == find.place)) {
-                siblings = parent.children[i];
-                flag = 1;
-                break;
-            }
-
-        }
-        if (flag) {
-            // case 3
-            auto tmp = siblings.node[siblings.count - 1];/// the big one in the left
-            DeleteCase2(filename, bTree, siblings, siblings.node[siblings.count - 1].first, siblings.count, temp);
-            find.node[find.count] = tmp;
-            find.count++;
-            sort(find.node.begin(), find.node.end(), [](const std::pair<int, int> &a, const std::pair<int, int> &b) {
-                if (a.first != -1 && b.first != -1) {
-                    return a.first < b.first;
-                }
-                return a.first != -1;
-            });
-            if (find.node[find.count - 1].first == RecordID) {
-                DeleteCase2(filename, bTree, find, RecordID, find.count, temp);
-            } else {
-                DeleteCase1(filename, bTree, find, RecordID);
-            }
-
-        } else {
-            if (find.node[find.count - 1].first == RecordID) {
-                DeleteCase2(filename, bTree, find, RecordID, find.count, temp);
-            } else {
-                DeleteCase1(filename, bTree, find, RecordID);
-            }
-            bTree = readFile(filename);
-            int headTree = head;
-            head = find.place;
-            pair<int, int> temp = make_pair(bTree[find.place - 1].node[0].first, bTree[find.place - 1].node[0].second);
-            for (int i = 0; i < parent.children.size(); ++i) {
-                if (parent.node[i].second == find.place) {
-                    parent.node[i].second = -1;
-                    parent.node[i].first = -1;
-                    sort(parent.node.begin(), parent.node.end(),
-                         [](const std::pair<int, int> &a, const std::pair<int, int> &b) {
-                             if (a.first != -1 && b.first != -1) {
-                                 return a.first < b.first;
-                             }
-                             return a.first != -1;
-                         });
-                    break;
-                }
-            }
-            bTree[parent.place - 1] = parent;
-            int pl = find.place;
-            find = bTree[pl - 1];
-            find.isLeaf = -1;
-            find.node[0].first = headTree;
-            find.node[0].second = -1;
-            bTree[pl - 1] = find;
-            savefile(filename, bTree, m);
-            InsertNewRecordAtIndex(temp.first, temp.second);
-
-        }
-    }
-}
-
-void BTreeIndex::DisplayIndexFileContent(const char *filename) {
-    ifstream inputFile(filename, ios::in | ios::binary);
-    vector<BTreeNode> Tree = readFile(filename);
-    cout << "<---------------------Head--------------------->\n ";
-    cout << "Empty Place: " << head << endl;
-    for (int i = 0; i < Tree.size(); ++i) {
-        cout << " Place: " << Tree[i].place << " | HasLeaf: " << Tree[i].isLeaf << " | Node: ";
-        for (const auto &pair: Tree[i].node) {
-            cout << "(" << pair.first << ", " << pair.second << ") ";
-        }
-
-        cout << endl;
-    }
-}
-
-//////////////////////////////////////Functions for searching//////////////////////////////////////
-
-bool BTreeIndex::isEmpty(int recordNumber) {
-    return read_val(recordNumber, 0) == -1;
-}
-
-bool BTreeIndex::isLeaf(int recordNumber) {
-    return read_val(recordNumber, 0) == 0;
-}
-
-bool BTreeIndex::record_valid(int recordNumber) const {
-    if (recordNumber <= 0 || recordNumber > numberOfRecords)
-        return false;
-
-    return true;
-}
-
-int BTreeIndex::read_val(int rowIndex, int columnIndex) {
-    BTreeFile.seekg(0, std::ios::beg);
-    int x;
-    for (int i = 0; i < rowIndex * (2 * m + 1) + columnIndex + 1; i++) {
-        BTreeFile >> x;
-    }
-
-    return x;
-}
-
-vector<pair<int, int>> BTreeIndex::read_node_values(int recordNumber) {
-    if (record_valid(recordNumber)) {
-
-        vector<pair<int, int>> theNode;
-
-        for (int i = 1; i <= numberOfRecords; i += 2) {
-            int key = read_val(recordNumber, i);
-            int value = read_val(recordNumber, i + 1);
-            theNode.emplace_back(key, value);
-        }
-        return theNode;
-    } else {
-        return {};
-    }
-}
-
-int BTreeIndex::SearchARecord(const char *filename, int RecordID) {
-    if (isEmpty(1))
-        return -1;
-    std::vector<std::pair<int, int>> current;
-
-    int i = 1;
-    bool found;
-    while (!isLeaf(i)) {
-        current = read_node_values(i);
-        found = false;
-        for (auto p: current) {
-            if (p.first >= RecordID) {
-                i = p.second;
-                found = true;
-                break;
-            }
-        }
-
-        if (!found)
-            return -1;
-    }
-
-    current = read_node_values(i);
-
-    for (auto pair: current)
-        if (pair.first == RecordID)
-            return pair.second;
-
-    return -1;
-}
-
-vector<BTreeNode> BTreeIndex::readFile(const char *filename) {
-    ifstream File(filename);
-    vector<BTreeNode> Btree;
-    string line;
-    int i = 1;
-    File >> head >> head;
-    getline(File, line);
-    while (getline(File, line)) {
-        istringstream iss(line);
-        BTreeNode Node;
-        iss >> Node.isLeaf;
-        Node.place = i;
-        int key, value;
-        while ((iss >> key >> value)) {
-            Node.node.emplace_back(key, value);
-        }
-        Btree.push_back(Node);
-        i++;
-    }
-    int count = 0;
-    for (size_t i = 0; i < Btree.size(); i++) {
-        for (size_t j = 0; j < Btree[i].node.size(); j++) {
-            if ((Btree[i].node[j].first != -1) && (Btree[i].node[j].second != -1)) {
-                count++;
-            }
-        }
-        Btree[i].count = count;
-        count = 0;
-    }
-    for (int j = (Btree.size() - 1); j >= 0; --j) {
-        if (Btree[j].isLeaf == 1) {
-            for (int k = 0; k < Btree[j].node.size(); ++k) {
-                if (Btree[j].node[k].second != -1) {
-                    Btree[j].children.push_back(Btree[Btree[j].node[k].second - 1]);
-                }
-            }
-        }
-    }
-    File.close();
-
-
-    return Btree;
-}
-
-void BTreeIndex::savefile(const char *filename, vector<BTreeNode> bTree, int m) {
-    ofstream outFile(filename, ios::binary);
-    outFile << -1 << "  " << head << "  ";
-    for (int i = 0; i < (m * 2) - 1; ++i) {
-        outFile << -1 << "  ";
-    }
-    outFile << "\n";
-    for (const auto &node: bTree) {
-        outFile << node.isLeaf << "  ";
-
-        for (const auto &pair: node.node) {
-            outFile << pair.first << "  ";
-            outFile << pair.second << "  ";
-        }
-        outFile << "\n";
-    }
-
-    outFile.close();
-}
-
-int BTreeIndex::split(int i, vector<BTreeNode> bTree) {
-    int newRecordNumber = head - 1;
-    if (i == 0) {
-        return split_root(bTree);
-    }
-    if (head == -1) {
-        return -1;
-    }
-    head = bTree[head - 1].node[0].first;
-    vector<pair<int, int>> firstNode, secondNode;
-    tie(firstNode, secondNode) = splitOriginalNode(bTree[i].node);
-    int size = firstNode.size();
-    int size2 = secondNode.size();
-
-    bTree[i].isLeaf = 0;
-    bTree[i].count = size;
-    for (int j = size; j < m; ++j) {
-        firstNode.push_back(make_pair(-1, -1));
-    }
-    for (int j = 0; j < m; ++j) {
-        bTree[i].node[j] = firstNode[j];
-    }
-    bTree[i].node.pop_back();
-    bTree[newRecordNumber].isLeaf = 0;
-    bTree[newRecordNumber].count = size2;
-    for (int j = size; j < m; ++j) {
-        secondNode.push_back(make_pair(-1, -1));
-    }
-    for (int j = 0; j < m; ++j) {
-        bTree[newRecordNumber].node[j] = secondNode[j];
-    }
-    savefile(BTreeFileName, bTree, m);
-    return newRecordNumber;
-}
-
-bool BTreeIndex::split_root(vector<BTreeNode> bTree) {
-    int firstNodeIndex = head;
-    int secondNodeIndex = bTree[head - 1].node[0].first;
-    if (firstNodeIndex == -1) {
-        return false;
-    }
-    if (secondNodeIndex == -1) {
-        return false;
-    }
-    head = bTree[head].node[0].first;
-    vector<pair<int, int>> firstNode, secondNode, root;
-    tie(firstNode, secondNode) = splitOriginalNode(bTree[0].node);
-    int size = firstNode.size();
-    int size2 = secondNode.size();
-    bTree[firstNodeIndex - 1].isLeaf = 0;
-    bTree[firstNodeIndex - 1].count = size;
-    for (int i = 0; i < size; ++i) {
-        bTree[firstNodeIndex - 1].node[i] = firstNode[i];
-    }
-    bTree[secondNodeIndex - 1].isLeaf = 0;
-    bTree[secondNodeIndex - 1].count = size2;
-    for (int i = 0; i < size2; ++i) {
-        bTree[secondNodeIndex - 1].node[i] = secondNode[i];
-    }
-    root.push_back(firstNode[size - 1]);
-    root[0].second = firstNodeIndex;
-    root.push_back(secondNode[size2 - 1]);
-    root[1].second = secondNodeIndex;
-    for (int i = root.size(); i < m; ++i) {
-        root.push_back(make_pair(-1, -1));
-    }
-    if (firstNodeIndex > 2 && secondNodeIndex > 3) {
-        bTree[firstNodeIndex - 1].isLeaf = 1;
-        bTree[secondNodeIndex - 1].isLeaf = 1;
-    }
-    bTree[0].node = root;
-    bTree[0].isLeaf = 1;
-    bTree[0].count = 2;
-    savefile(BTreeFileName, bTree, m);
-
-
-    return true;
-}
-
-pair<vector<pair<int, int>>, vector<pair<int, int>>>
-BTreeIndex::splitOriginalNode(const vector<pair<int, int>> &originalNode) {
-    vector<pair<int, int>> firstNode, secondNode;
-
-    auto middle = originalNode.begin() + originalNode.size() / 2;
-
-    for (auto it = originalNode.begin(); it != originalNode.end(); ++it) {
-        if (distance(it, middle) > 0) {
-            firstNode.push_back(*it);
-        } else {
-            secondNode.push_back(*it);
-        }
-    }
-
-    return make_pair(firstNode, secondNode);
-}
-
-int BTreeIndex::updateAfterInsert(int parentRecordNumber, int newChildRecordNumber) {
-    vector<pair<int, int>> newParent;
-    vector<BTreeNode> bTree = readFile(BTreeFileName);
-    for (int i = 0; i < bTree[parentRecordNumber].children.size(); ++i) {
-        newParent.push_back(make_pair(
-                bTree[parentRecordNumber].children[i].node[bTree[parentRecordNumber].children[i].count - 1].first,
-                bTree[parentRecordNumber].children[i].place));
-    }
-
-    if (newChildRecordNumber != -1) {
-        newParent.push_back(make_pair(bTree[newChildRecordNumber].node[bTree[newChildRecordNumber].count - 1].first,
-                                      newChildRecordNumber + 1));
-    }
-    sort(newParent.begin(), newParent.end(), [](const std::pair<int, int> &a, const std::pair<int, int> &b) {
-        if (a.first != -1 && b.first != -1) {
-            return a.first < b.first;
-        }
-        return a.first != -1;
-    });
-    int size = newParent.size();
-    bTree[parentRecordNumber].count = size;
-
-    for (int i = newParent.size(); i < m; ++i) {
-        newParent.push_back(make_pair(-1, -1));
-    }
-    bTree[parentRecordNumber].node = newParent;
-
-
-    int newFromSplitIndex = -1;
-
-    if (size > m) {
-        newFromSplitIndex = split(parentRecordNumber, bTree);
-    } else {
-        savefile(BTreeFileName, bTree, m);
-    }
-
-    return newFromSplitIndex;
-}
-
-void BTreeIndex::run() {
-    int choice, recordID, reference;
-
-    do {
-        cout << "\n============================================\n";
-        cout << "            B-Tree Index Menu               \n";
-        cout << "============================================\n";
-        cout << "1. Insert New Record\n";
-        cout << "2. Delete Record\n";
-        cout << "3. Display Index File Content\n";
-        cout << "4. Search for a Record\n";
-        cout << "5. Exit\n";
-        cout << "============================================\n";
-        cout << "Enter your choice: ";
-        cin >> choice;
-
-        switch (choice) {
-            case 1: {
-                cout << "\n=== Insert New Record ===\n";
-                cout << "Enter RecordID: ";
-                cin >> recordID;
-                cout << "Enter Reference: ";
-                cin >> reference;
-
-                int referenceValue = SearchARecord("BTreeIndex.txt", recordID);
-                if (referenceValue == -1) {
-                    InsertNewRecordAtIndex(recordID, reference);
-                    cout << "\n✔ Record inserted successfully.\n";
-                } else {
-                    cout << "\n❌ Error: RecordID already exists. Cannot insert duplicate records.\n";
-                }
-                break;
-            }
-
-            case 2: {
-                cout << "\n=== Delete Record ===\n";
-                cout << "Enter RecordID to delete: ";
-                cin >> recordID;
-
-                int referenceValue = SearchARecord("BTreeIndex.txt", recordID);
-                if (referenceValue == -1) {
-                    cout << "\n❌ Error: Record not found in the index.\n";
-                } else {
-                    DeleteRecordFromIndex("BTreeIndex.txt", recordID, m);
-                    cout << "\n✔ Record deleted successfully.\n";
-                }
-                break;
-            }
-
-            case 3: {
-                cout << "\n=== Displaying Index File Content ===\n";
-                DisplayIndexFileContent("BTreeIndex.txt");
-                break;
-            }
-
-            case 4: {
-                cout << "\n=== Search for a Record ===\n";
-                cout << "Enter RecordID to search: ";
-                cin >> recordID;
-
-                int referenceValue = SearchARecord("BTreeIndex.txt", recordID);
-                if (referenceValue == -1) {
-                    cout << "\n❌ Record not found in the index.\n";
-                } else {
-                    cout << "\n✔ Record found! Reference: " << referenceValue << "\n";
-                }
-                break;
-            }
-
-            case 5: {
-                cout << "\nExiting program...\n";
-                break;
-            }
-
-            default: {
-                cout << "\n❌ Invalid choice. Please enter a number between 1 and 5.\n";
-            }
-        }
-
-        if (choice != 5) {
-            cout << "\nPress Enter to continue...";
-            cin.ignore();
-            cin.get();
-        }
-
-    } while (choice != 5);
+#include "BTreeIndex.h"
+#include "PosixIO.h"
+#include <queue>
+#include <climits>
+#include <numeric>
+
+using namespace std;
+
+BTreeIndex::~BTreeIndex() {
+    closeIndexFile();
+}
+
+void BTreeIndex::CreateIndexFile(const char *filename, int numberOfRecords, int m) {
+    closeIndexFile();
+    BTreeFileName = filename;
+    remove(logFileName().c_str());
+    // numberOfRecords is only the starting size; the file grows by extents once the free list runs out
+    this->numberOfRecords = 1;
+    this->m = m;
+    pageSize = PageSizeFor(m);
+    head = -1;
+    /////////////////////////////////////////////////////////
+    ofstream outfile(filename, ios::binary | ios::trunc);
+    writeHeader(outfile);
+    outfile.close();
+    BTreeFile = open(BTreeFileName.c_str(), O_RDWR | O_BINARY);
+    bufferPool.attach(BTreeFile, pageSize);
+    appendFreePages(max(numberOfRecords, 2) - 1);
+    bufferPool.flush();
+    resetLatches();
+    if (walEnabled) {
+        fsync(BTreeFile);
+        attachLog();
+    }
+    ///////////////////////////////////////////////////////////////
+}
+
+bool BTreeIndex::OpenIndexFile(const char *filename) {
+    closeIndexFile();
+    ifstream in(filename, ios::in | ios::binary);
+    if (!in || !readHeader(in)) {
+        return false;
+    }
+    in.close();
+    BTreeFileName = filename;
+    BTreeFile = open(BTreeFileName.c_str(), O_RDWR | O_BINARY);
+    if (BTreeFile == -1) {
+        return false;
+    }
+    bufferPool.attach(BTreeFile, pageSize);
+    resetLatches();
+    if (!recoverFromLog()) {
+        cerr << "Could not replay the write-ahead log " << logFileName() << "\n";
+        // closing would checkpoint and empty the log, so the half-replayed pages are dropped and the log is
+        // kept for the next open
+        bufferPool.discardFrom(0);
+        wal.close();
+        bufferPool.setNoSteal(false);
+        closeIndexFile();
+        return false;
+    }
+    if (savedRoot != -1 && !(normalizeTree(savedRoot) && bufferPool.flush())) {
+        closeIndexFile();
+        return false;
+    }
+    if (savedBuffers != -1 && !(drainBuffers() && bufferPool.flush())) {
+        closeIndexFile();
+        return false;
+    }
+    return !walEnabled || attachLog();
+}
+
+bool BTreeIndex::OpenIndexFileReadOnly(const char *filename) {
+    closeIndexFile();
+    ifstream in(filename, ios::in | ios::binary);
+    if (!in || !readHeader(in)) {
+        return false;
+    }
+    in.close();
+    if (savedBuffers != -1) {
+        cerr << "The index still holds buffered changes; open it for writing once to apply them\n";
+        return false;
+    }
+    BTreeFileName = filename;
+    BTreeFile = open(BTreeFileName.c_str(), O_RDONLY | O_BINARY);
+    if (BTreeFile == -1) {
+        return false;
+    }
+    readOnly = true;
+    resetLatches();
+    if (savedRoot != -1) {
+        // saved in copy-on-write mode: lookups start from the saved root and scans do not follow leaf links
+        rootPlace = savedRoot;
+        copyOnWrite = true;
+    }
+#ifdef _WIN32
+    // no mmap here, so lookups go through the buffer pool instead
+    bufferPool.attach(BTreeFile, pageSize);
+#else
+    if (!RemapIndexFile()) {
+        closeIndexFile();
+        return false;
+    }
+#endif
+    return true;
+}
+
+bool BTreeIndex::OpenIndexFileInMemory(const char *filename, int snapshotMillis) {
+    // a log left behind by a logging instance is replayed into the file by a normal open first
+    ifstream log(string(filename) + ".wal", ios::binary | ios::ate);
+    if (log && log.tellg() > 0) {
+        log.close();
+        if (!OpenIndexFile(filename)) {
+            return false;
+        }
+    }
+    closeIndexFile();
+    ifstream in(filename, ios::in | ios::binary);
+    if (!in || !readHeader(in)) {
+        return false;
+    }
+    in.close();
+    int file = open(filename, O_RDONLY | O_BINARY);
+    if (file == -1) {
+        return false;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    arena.reset(pageSize);
+    bool loaded = arena.load(file, numberOfRecords);
+    close(file);
+    if (!loaded) {
+        arena.reset();
+        return false;
+    }
+    BTreeFileName = filename;
+    resetLatches();
+    if ((savedRoot != -1 && !normalizeTree(savedRoot)) || (savedBuffers != -1 && !drainBuffers())) {
+        closeIndexFile();
+        return false;
+    }
+    stopSnapshots = false;
+    if (snapshotMillis > 0) {
+        snapshotter = thread(&BTreeIndex::snapshotLoop, this, snapshotMillis);
+    }
+    return true;
+}
+
+bool BTreeIndex::RemapIndexFile() {
+#ifdef _WIN32
+    return readOnly;
+#else
+    if (!readOnly) {
+        return false;
+    }
+    struct stat info{};
+    if (fstat(BTreeFile, &info) != 0 || info.st_size < pageSize) {
+        return false;
+    }
+    lock_guard<mutex> guard(remapLatch);
+    const Mapping *current = mapping.load();
+    if (current != nullptr && (size_t) info.st_size == current->bytes) {
+        return true;
+    }
+    // MAP_SHARED + PROT_READ, so any number of read-only instances share the same page cache pages
+    void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, BTreeFile, 0);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    madvise(mapped, info.st_size, MADV_RANDOM);
+    // lookups may still be reading the old mapping, so it stays mapped until the file is closed
+    mappings.emplace_back(new Mapping{static_cast<const int32_t *>(mapped), (size_t) info.st_size});
+    mapping.store(mappings.back().get());
+    adviseTopLevels(mappings.back().get());
+    return true;
+#endif
+}
+
+void BTreeIndex::unmapIndexFile() {
+    mapping.store(nullptr);
+#ifndef _WIN32
+    for (const auto &old: mappings) {
+        munmap(const_cast<int32_t *>(old->pages), old->bytes);
+    }
+#endif
+    mappings.clear();
+}
+
+void BTreeIndex::adviseTopLevels(const Mapping *mapped) {
+#ifndef _WIN32
+    // every lookup goes through the root and its children, so ask for them to be paged in up front
+    long systemPage = sysconf(_SC_PAGESIZE);
+    vector<int> level{1};
+    for (int depth = 0; depth < AdvisedLevels && !level.empty(); ++depth) {
+        vector<int> next;
+        for (int place: level) {
+            size_t offset = (size_t) place * pageSize;
+            if (offset + pageSize > mapped->bytes) {
+                continue;
+            }
+            size_t start = offset - offset % systemPage;
+            madvise((char *) mapped->pages + start, offset + pageSize - start, MADV_WILLNEED);
+            const int32_t *page = mapped->pages + offset / sizeof(int32_t);
+            if (page[0] == 1) {
+                for (int i = 0; i < page[1] && i < m; ++i) {
+                    next.push_back(pageRefs(page)[i]);
+                }
+            }
+        }
+        level.swap(next);
+    }
+#endif
+}
+
+void BTreeIndex::closeIndexFile() {
+    stopSnapshotter();
+    if (copyOnWrite && !readOnly) {
+        leaveCopyOnWrite();
+    }
+    if (buffered && !readOnly) {
+        // if the buffers cannot be applied, the header still asks the next open to
+        buffered = false;
+        drainBuffers();
+    }
+    copyOnWrite = false;
+    buffered = false;
+    messagesPending = false;
+    rootPlace = 1;
+    savedRoot = -1;
+    savedBuffers = -1;
+    retired.clear();
+    if (arena.active()) {
+        Snapshot();
+        arena.reset();
+    }
+    unmapIndexFile();
+    readOnly = false;
+    if (wal.isOpen()) {
+        checkpointLocked();
+        wal.close();
+        bufferPool.setNoSteal(false);
+    }
+    if (BTreeFile != -1) {
+        bufferPool.detach();
+        close(BTreeFile);
+        BTreeFile = -1;
+    }
+    latches.reset();
+    latchCount = 0;
+}
+
+bool BTreeIndex::ConvertTextIndexFile(const char *textFilename, const char *binaryFilename) {
+    ifstream File(textFilename);
+    if (!File) {
+        return false;
+    }
+    vector<BTreeNode> bTree;
+    string line;
+    int textHead = -1, ignored;
+    if (!(File >> ignored >> textHead)) {
+        return false;
+    }
+    getline(File, line);
+    int order = 0;
+    while (getline(File, line)) {
+        istringstream iss(line);
+        BTreeNode Node;
+        if (!(iss >> Node.isLeaf)) {
+            continue;
+        }
+        Node.place = bTree.size() + 1;
+        int key, value;
+        while ((iss >> key >> value)) {
+            Node.node.emplace_back(key, value);
+        }
+        order = max(order, (int) Node.node.size());
+        bTree.push_back(Node);
+    }
+    if (order == 0) {
+        return false;
+    }
+    closeIndexFile();
+    BTreeFileName = binaryFilename;
+    numberOfRecords = bTree.size() + 1;
+    m = order;
+    pageSize = PageSizeFor(m);
+    head = textHead;
+    remove(logFileName().c_str());
+    savefile(binaryFilename, bTree, m);
+    BTreeFile = open(BTreeFileName.c_str(), O_RDWR | O_BINARY);
+    if (BTreeFile == -1) {
+        return false;
+    }
+    bufferPool.attach(BTreeFile, pageSize);
+    resetLatches();
+    // the text format has no sibling links, so chain the leaves in key order now
+    if (!isEmpty(1)) {
+        int previous = -1;
+        linkLeaves(1, previous);
+        if (previous != -1) {
+            BTreeNode last = readNode(previous);
+            last.next = -1;
+            writeNode(previous, last);
+        }
+    }
+    if (!flushLocked()) {
+        return false;
+    }
+    return !walEnabled || (fsync(BTreeFile) == 0 && attachLog());
+}
+
+void BTreeIndex::linkLeaves(int place, int &previous) {
+    BTreeNode Node = readNode(place);
+    if (Node.isLeaf == 1) {
+        for (int i = 0; i < Node.count; ++i) {
+            linkLeaves(Node.node[i].second, previous);
+        }
+        return;
+    }
+    if (previous != -1) {
+        BTreeNode before = readNode(previous);
+        before.next = place;
+        writeNode(previous, before);
+    }
+    previous = place;
+}
+
+int BTreeIndex::InsertNewRecordAtIndex(int RecordID, int Reference) {
+    Metrics::Timer timer(metrics, Metrics::Insert);
+    if (buffered) {
+        int taken = changeBuffered({BatchOp::Insert, RecordID, Reference});
+        if (taken != -2) {
+            afterOperation();
+            return taken == -1 ? -1 : 1;
+        }
+    }
+    int place;
+    {
+        shared_lock<shared_mutex> frozen(snapshotGate);
+        shared_lock<shared_mutex> tree(treeLatch);
+        if (readOnly || !isOpen()) {
+            return -1;
+        }
+        if (copyOnWrite) {
+            place = insertVersioned(RecordID, Reference);
+        } else {
+            place = insertOptimistic(RecordID, Reference, true);
+            if (place == -2) {
+                place = insertRecord(RecordID, Reference, true);
+            }
+        }
+    }
+    if (place == -3) {
+        // out of free nodes: grow the file while no other operation holds a latch, then try again
+        shared_lock<shared_mutex> frozen(snapshotGate);
+        unique_lock<shared_mutex> tree(treeLatch);
+        auto insert = [&] {
+            return copyOnWrite ? insertVersioned(RecordID, Reference) : insertRecord(RecordID, Reference, true);
+        };
+        place = insert();
+        if (place == -3) {
+            place = growFile() ? insert() : -1;
+        }
+    }
+    afterOperation();
+    return place;
+}
+
+int BTreeIndex::insertOptimistic(int RecordID, int Reference, bool log) {
+    // most inserts only change one leaf: descend with shared latches and latch just that leaf exclusively.
+    // -2 means the insert may split a node or raise a separator, so it has to take the pessimistic path.
+    // Internal nodes are searched in place on their pages; only the leaf is decoded.
+    int parent = 1;
+    latchShared(parent);
+    const int32_t *page = readPage(parent);
+    if (page == nullptr || page[0] != 1) {
+        if (page != nullptr)
+            releasePage(parent);
+        unlatchShared(parent);
+        return -2;
+    }
+    for (;;) {
+        int count = page[1];
+        int child = -1;
+        if (count > 0 && pageKeys(page)[count - 1] >= RecordID)
+            child = pageRefs(page)[lowerBound(page, RecordID)];
+        releasePage(parent);
+        if (child == -1) {
+            unlatchShared(parent);
+            return -2;
+        }
+        latchShared(child);
+        page = readPage(child);
+        if (page != nullptr && page[0] == 1) {
+            unlatchShared(parent);
+            parent = child;
+            continue;
+        }
+        if (page != nullptr)
+            releasePage(child);
+        // the parent stays latched while the leaf latch is upgraded, so the leaf cannot be split meanwhile.
+        // The leaf page is then changed in place in the pool, so the common insert decodes no node at all.
+        unlatchShared(child);
+        latchExclusive(child);
+        int place = -2;
+        int32_t *leaf = pinPage(child);
+        metrics.add(Metrics::NodeReads);
+        if (leaf != nullptr) {
+            int count = leaf[1];
+            bool changed = false;
+            if (leaf[0] == 0 && count > 0 && count < m && pageKeys(leaf)[count - 1] >= RecordID) {
+                int slot = lowerBound(leaf, RecordID);
+                place = -1;
+                if (pageKeys(leaf)[slot] != RecordID) {
+                    if (log) {
+                        logOperation(WriteAheadLog::Insert, RecordID, Reference);
+                    }
+                    insertIntoPage(leaf, slot, RecordID, Reference);
+                    changed = true;
+                    place = child;
+                }
+            }
+            releasePage(child, changed);
+        }
+        unlatchExclusive(child);
+        unlatchShared(parent);
+        return place;
+    }
+}
+
+int BTreeIndex::insertRecord(int RecordID, int Reference, bool log) {
+    LatchedPath held(*this);
+    held.lock(1);
+    if (isEmpty(1)) {
+        // an empty tree keeps its root on the free list, so take it back first
+        lock_guard<mutex> guard(allocatorLatch);
+        if (!takeFreeNode(1)) {
+            return -3;
+        }
+        if (log) {
+            logOperation(WriteAheadLog::Insert, RecordID, Reference);
+        }
+        BTreeNode root = emptyNode(1, 0);
+        root.node[0] = make_pair(RecordID, Reference);
+        root.count = 1;
+        writeNode(1, root);
+        return 1;
+    }
+    // only the root-to-leaf path is read, and only pages that change are written back. A node that has
+    // room and already covers RecordID absorbs the insert, so the path above it is let go.
+    // Decoded nodes are moved along the path, never copied, so an insert allocates O(depth) times at most.
+    vector<BTreeNode> visited;
+    visited.reserve(8);
+    BTreeNode leaf;
+    readNode(1, leaf);
+    while (leaf.isLeaf == 1) {
+        int child = childFor(leaf, RecordID);
+        visited.push_back(move(leaf));
+        held.lock(child);
+        readNode(child, leaf);
+        if (leaf.count < m && leaf.count > 0 && leaf.node[leaf.count - 1].first >= RecordID) {
+            held.keepOnly(child);
+            visited.clear();
+        }
+    }
+    if (findEntry(leaf, RecordID) != -1) {
+        return -1;
+    }
+
+    // make sure every split this insert causes can get a node, so an insert is never half applied
+    int needed = 0;
+    if (leaf.count == m) {
+        needed = leaf.place == 1 ? 2 : 1;
+        for (int k = (int) visited.size() - 1; k >= 0 && visited[k].count == m; --k) {
+            needed += visited[k].place == 1 ? 2 : 1;
+        }
+    }
+    if (!reserveNodes(needed)) {
+        return -3; // the caller grows the file and inserts again
+    }
+    if (log) {
+        logOperation(WriteAheadLog::Insert, RecordID, Reference);
+    }
+
+    insertEntry(leaf, make_pair(RecordID, Reference));
+    if (leaf.count <= m) {
+        writeNode(leaf.place, leaf);
+    } else if (leaf.place == 1) {
+        BTreeNode first, second;
+        split_root(leaf, first, second);
+        return findEntry(first, RecordID) != -1 ? first.place : second.place;
+    }
+
+    BTreeNode newChild;
+    newChild.place = -1;
+    int insertedAt = leaf.place;
+    if (leaf.count > m) {
+        split(leaf, newChild);
+        if (findEntry(newChild, RecordID) != -1) {
+            insertedAt = newChild.place;
+        }
+    }
+
+    BTreeNode child = move(leaf);
+    while (!visited.empty()) {
+        BTreeNode parent = move(visited.back());
+        visited.pop_back();
+        if (!updateAfterInsert(parent, child, newChild)) {
+            break;
+        }
+        child = move(parent);
+    }
+
+    return insertedAt;
+}
+
+void BTreeIndex::DeleteRecordFromIndex(const char *filename, int RecordID, int m) {
+    Metrics::Timer timer(metrics, Metrics::Delete);
+    if (!ensureOpen(filename)) {
+        return;
+    }
+    if (buffered && changeBuffered({BatchOp::Delete, RecordID, -1}) != -2) {
+        afterOperation();
+        return;
+    }
+    {
+        shared_lock<shared_mutex> frozen(snapshotGate);
+        bool done = false;
+        {
+            // a versioned delete only writes new pages, so it runs beside lookups like an insert
+            shared_lock<shared_mutex> tree(treeLatch);
+            if (readOnly) {
+                return;
+            }
+            done = copyOnWrite && deleteVersioned(RecordID) != -3;
+        }
+        if (!done) {
+            // deletes can merge and move entries across the whole path, so they run alone
+            unique_lock<shared_mutex> tree(treeLatch);
+            if (copyOnWrite) {
+                if (deleteVersioned(RecordID) == -3 && growFile()) {
+                    deleteVersioned(RecordID);
+                }
+            } else {
+                logOperation(WriteAheadLog::Delete, RecordID, -1);
+                deleteRecord(RecordID);
+            }
+        }
+    }
+    afterOperation();
+}
+
+void BTreeIndex::deleteRecord(int RecordID) {
+    if (isEmpty(1)) {
+        return;
+    }
+    // one descent; the slot taken at each level is kept so the way back up needs no searching
+    vector<BTreeNode> visited;
+    vector<int> slots;
+    BTreeNode find;
+    readNode(1, find);
+    while (find.isLeaf == 1) {
+        int slot = childSlot(find, RecordID);
+        if (slot == find.count) {
+            return;
+        }
+        slots.push_back(slot);
+        int next = find.node[slot].second;
+        visited.push_back(move(find));
+        readNode(next, find);
+    }
+    if (findEntry(find, RecordID) == -1) {
+        return;
+    }
+    removeEntry(find, RecordID);
+    writeNode(find.place, find);
+
+    // back up the path: refresh the separator of the changed child and fix an underflow by borrowing
+    // from or merging with a sibling; once a parent is left as it was, nothing above it changes either
+    BTreeNode child = move(find);
+    while (!visited.empty()) {
+        BTreeNode parent = move(visited.back());
+        visited.pop_back();
+        int at = slots.back();
+        slots.pop_back();
+        bool changed = false;
+        if (child.count > 0 && parent.node[at].first != child.node[child.count - 1].first) {
+            parent.node[at].first = child.node[child.count - 1].first;
+            changed = true;
+        }
+        if (child.count < minimumEntries() && rebalance(parent, at, child)) {
+            changed = true;
+        }
+        if (!changed) {
+            return;
+        }
+        writeNode(parent.place, parent);
+        child = move(parent);
+    }
+
+    // the root stays at place 1: a root left with one child takes that child's entries over, and an
+    // empty root goes back on the free list
+    BTreeNode root = move(child);
+    while (root.isLeaf == 1 && root.count == 1) {
+        int only = root.node[0].second;
+        readNode(only, root);
+        root.place = 1;
+        writeNode(1, root);
+        freeNode(only);
+    }
+    if (root.count == 0) {
+        freeNode(1);
+    }
+}
+
+bool BTreeIndex::rebalance(BTreeNode &parent, int at, BTreeNode &child) {
+    int minimum = minimumEntries();
+    BTreeNode left, right;
+    if (at > 0) {
+        readNode(parent.node[at - 1].second, left);
+        if (left.count > minimum) {
+            // borrow the largest entry of the left sibling; the child's largest key stays the same
+            metrics.add(Metrics::Borrows);
+            pair<int, int> moved = left.node[left.count - 1];
+            removeAt(left, left.count - 1);
+            insertEntry(child, moved);
+            parent.node[at - 1].first = left.node[left.count - 1].first;
+            writeNode(left.place, left);
+            writeNode(child.place, child);
+            return true;
+        }
+    }
+    if (at + 1 < parent.count) {
+        readNode(parent.node[at + 1].second, right);
+        if (right.count > minimum) {
+            // borrow the smallest entry of the right sibling, which becomes the child's largest key
+            metrics.add(Metrics::Borrows);
+            pair<int, int> moved = right.node[0];
+            removeAt(right, 0);
+            insertEntry(child, moved);
+            parent.node[at].first = moved.first;
+            writeNode(right.place, right);
+            writeNode(child.place, child);
+            return true;
+        }
+    }
+    // neither sibling can spare an entry, so the child and one of them fit in a single node
+    if (at > 0) {
+        metrics.add(Metrics::Merges);
+        mergeInto(left, child);
+        parent.node[at - 1].first = left.node[left.count - 1].first;
+        removeAt(parent, at);
+        writeNode(left.place, left);
+        freeNode(child.place);
+        return true;
+    }
+    if (at + 1 < parent.count) {
+        metrics.add(Metrics::Merges);
+        mergeInto(child, right);
+        parent.node[at].first = child.node[child.count - 1].first;
+        removeAt(parent, at + 1);
+        writeNode(child.place, child);
+        freeNode(right.place);
+        return true;
+    }
+    return false;
+}
+
+void BTreeIndex::mergeInto(BTreeNode &node, const BTreeNode &next) {
+    // `next` is the node just after `node` on the same level, so its entries and its sibling link follow on
+    vector<pair<int, int>> entries(node.node.begin(), node.node.begin() + node.count);
+    entries.insert(entries.end(), next.node.begin(), next.node.begin() + next.count);
+    setEntries(node, entries);
+    node.next = next.next;
+}
+
+void BTreeIndex::DisplayIndexFileContent(const char *filename) {
+    int freeHead = -1;
+    vector<BTreeNode> Tree = readFile(filename, freeHead);
+    cout << "<---------------------Head--------------------->\n ";
+    cout << "Empty Place: " << freeHead << endl;
+    for (int i = 0; i < Tree.size(); ++i) {
+        cout << " Place: " << Tree[i].place << " | HasLeaf: " << Tree[i].isLeaf << " | Node: ";
+        for (const auto &pair: Tree[i].node) {
+            cout << "(" << pair.first << ", " << pair.second << ") ";
+        }
+        if (Tree[i].isLeaf == 0) {
+            cout << "| Next: " << Tree[i].next;
+        }
+
+        cout << endl;
+    }
+}
+
+/////////////////////////////////////Bulk loading///////////////////////////////////////////////
+
+bool BTreeIndex::BulkLoad(const char *filename, const char *inputFilename, int m, double fillFactor, int spareNodes,
+                          size_t runRecords) {
+    ifstream in(inputFilename);
+    if (!in) {
+        return false;
+    }
+    ThreadPool pool(workerThreads);
+    // read runs of up to runRecords pairs; a single run is sorted in memory, more are spilled and merged
+    vector<pair<int, int>> run;
+    vector<string> runFiles;
+    int key, value;
+    bool more = true;
+    while (more) {
+        more = static_cast<bool>(in >> key >> value);
+        if (more) {
+            run.emplace_back(key, value);
+        }
+        if (run.size() == runRecords || (!more && !runFiles.empty() && !run.empty())) {
+            sortRecords(run, pool);
+            runFiles.push_back(string(filename) + ".run" + to_string(runFiles.size()));
+            ofstream out(runFiles.back(), ios::binary | ios::trunc);
+            out.write(reinterpret_cast<const char *>(run.data()), run.size() * sizeof(run[0]));
+            run.clear();
+        }
+    }
+    in.close();
+
+    if (runFiles.empty()) {
+        sortRecords(run, pool);
+        return bulkBuildSorted(filename, m, fillFactor, spareNodes, run, pool);
+    }
+    run.clear();
+    run.shrink_to_fit();
+
+    // k-way merge; ties go to the earlier run so the first occurrence of a RecordID wins, as in sortRecords
+    vector<ifstream> runs;
+    using Head = tuple<int, int, int>; // key, run, reference
+    priority_queue<Head, vector<Head>, greater<Head>> heads;
+    for (int r = 0; r < (int) runFiles.size(); ++r) {
+        runs.emplace_back(runFiles[r], ios::binary);
+        pair<int, int> record;
+        if (runs[r].read(reinterpret_cast<char *>(&record), sizeof(record))) {
+            heads.emplace(record.first, r, record.second);
+        }
+    }
+    bool haveLast = false;
+    int lastKey = 0;
+    bool built = bulkBuild(filename, m, fillFactor, spareNodes, [&](pair<int, int> &record) {
+        while (!heads.empty()) {
+            int r;
+            tie(record.first, r, record.second) = heads.top();
+            heads.pop();
+            pair<int, int> following;
+            if (runs[r].read(reinterpret_cast<char *>(&following), sizeof(following))) {
+                heads.emplace(following.first, r, following.second);
+            }
+            if (!haveLast || record.first != lastKey) {
+                haveLast = true;
+                lastKey = record.first;
+                return true;
+            }
+        }
+        return false;
+    });
+    runs.clear();
+    for (const auto &runFile: runFiles) {
+        remove(runFile.c_str());
+    }
+    return built;
+}
+
+bool BTreeIndex::bulkLoadRecords(const char *filename, vector<pair<int, int>> &records, int m, double fillFactor,
+                                 int spareNodes) {
+    ThreadPool pool(workerThreads);
+    sortRecords(records, pool);
+    return bulkBuildSorted(filename, m, fillFactor, spareNodes, records, pool);
+}
+
+void BTreeIndex::sortRecords(vector<pair<int, int>> &records, ThreadPool &pool) {
+    // a slice per thread is sorted, then neighbouring slices are merged in pairs, a round at a time. Both
+    // steps are stable, so of equal RecordIDs the first stays first
+    auto byKey = [](const pair<int, int> &a, const pair<int, int> &b) { return a.first < b.first; };
+    size_t slices = pool.size();
+    vector<size_t> bounds(slices + 1);
+    for (size_t s = 0; s <= slices; ++s) {
+        bounds[s] = records.size() * s / slices;
+    }
+    pool.parallelFor(slices, 1, [&](size_t begin, size_t end) {
+        for (size_t s = begin; s < end; ++s) {
+            stable_sort(records.begin() + bounds[s], records.begin() + bounds[s + 1], byKey);
+        }
+    });
+    for (size_t width = 1; width < slices; width *= 2) {
+        pool.parallelFor((slices + 2 * width - 1) / (2 * width), 1, [&](size_t begin, size_t end) {
+            for (size_t join = begin; join < end; ++join) {
+                size_t first = 2 * width * join, middle = min(slices, first + width), last = min(slices, middle + width);
+                inplace_merge(records.begin() + bounds[first], records.begin() + bounds[middle],
+                              records.begin() + bounds[last], byKey);
+            }
+        });
+    }
+    records.erase(unique(records.begin(), records.end(),
+                         [](const pair<int, int> &a, const pair<int, int> &b) { return a.first == b.first; }),
+                  records.end());
+}
+
+bool BTreeIndex::bulkBuild(const char *filename, int m, double fillFactor, int spareNodes,
+                           const function<bool(pair<int, int> &)> &next) {
+    pair<int, int> record;
+    if (!next(record)) {
+        CreateIndexFile(filename, spareNodes + 2, m);
+        return BTreeFile != -1;
+    }
+
+    startBulkBuild(filename, m);
+    int minimum = minimumEntries();
+    int target = min(m, max(minimum, (int) (m * fillFactor + 0.5)));
+
+    ofstream out(filename, ios::binary | ios::trunc);
+    vector<int32_t> page(pageSize / sizeof(int32_t), -1);
+    // header and root are rewritten at the end, every other page is appended in order
+    out.write(reinterpret_cast<const char *>(page.data()), pageSize);
+    out.write(reinterpret_cast<const char *>(page.data()), pageSize);
+    int nextPlace = 2;
+    BTreeNode Node = emptyNode(0, 0);
+    auto writeNodeAt = [&](const vector<pair<int, int>> &entries, int isLeaf, int place, int next) {
+        Node.isLeaf = isLeaf;
+        Node.next = next;
+        setEntries(Node, entries);
+        encodePage(Node, page.data());
+        if (place != nextPlace) {
+            out.seekp((streamoff) place * pageSize);
+        }
+        out.write(reinterpret_cast<const char *>(page.data()), pageSize);
+        if (place != nextPlace) {
+            out.seekp(0, ios::end);
+        } else {
+            nextPlace++;
+        }
+    };
+
+    // packs one level and returns the (largest key, place) pair of each node on it; a level that fits in
+    // one node becomes the root
+    auto packLevel = [&](int isLeaf, const function<bool(pair<int, int> &)> &source) {
+        vector<pair<int, int>> written, pending, current;
+        // leaves are written at consecutive places, so each one links to the place after it
+        auto emit = [&](const vector<pair<int, int>> &entries, bool last) {
+            written.emplace_back(entries.back().first, nextPlace);
+            writeNodeAt(entries, isLeaf, nextPlace, isLeaf == 0 && !last ? nextPlace + 1 : -1);
+        };
+        pair<int, int> entry;
+        while (source(entry)) {
+            current.push_back(entry);
+            if ((int) current.size() == target) {
+                if (!pending.empty()) {
+                    emit(pending, false);
+                }
+                pending.swap(current);
+                current.clear();
+            }
+        }
+        // a short last node is evened out with the one before it so neither falls under m/2
+        if (!current.empty() && !pending.empty() && (int) current.size() < minimum) {
+            pending.insert(pending.end(), current.begin(), current.end());
+            current.clear();
+            if ((int) pending.size() > m) {
+                current.assign(pending.begin() + pending.size() / 2, pending.end());
+                pending.resize(pending.size() / 2);
+            }
+        }
+        if (current.empty()) {
+            pending.swap(current);
+        }
+        if (written.empty() && pending.empty()) {
+            writeNodeAt(current, isLeaf, 1, -1);
+            written.emplace_back(current.back().first, 1);
+            return written;
+        }
+        if (!pending.empty()) {
+            emit(pending, false);
+        }
+        emit(current, true);
+        return written;
+    };
+
+    bool first = true;
+    vector<pair<int, int>> level = packLevel(0, [&](pair<int, int> &entry) {
+        if (first) {
+            first = false;
+            entry = record;
+            return true;
+        }
+        return next(entry);
+    });
+    while (level.size() > 1) {
+        size_t i = 0;
+        vector<pair<int, int>> children;
+        children.swap(level);
+        level = packLevel(1, [&](pair<int, int> &entry) {
+            if (i == children.size()) {
+                return false;
+            }
+            entry = children[i++];
+            return true;
+        });
+    }
+
+    BTreeNode freed = emptyNode(0, -1);
+    for (int i = 0; i < spareNodes; ++i) {
+        freed.node[0].first = i + 1 < spareNodes ? nextPlace + 1 : -1;
+        encodePage(freed, page.data());
+        out.write(reinterpret_cast<const char *>(page.data()), pageSize);
+        nextPlace++;
+    }
+    head = spareNodes > 0 ? nextPlace - spareNodes : -1;
+    numberOfRecords = nextPlace;
+    out.seekp(0);
+    writeHeader(out);
+    out.close();
+    return OpenIndexFile(filename);
+}
+
+void BTreeIndex::startBulkBuild(const char *filename, int m) {
+    closeIndexFile();
+    BTreeFileName = filename;
+    remove(logFileName().c_str());
+    this->m = m;
+    pageSize = PageSizeFor(m);
+}
+
+void BTreeIndex::levelShape(size_t entries, int target, size_t &full, vector<int> &tail) const {
+    // the node sizes bulkBuild's packLevel gives a level of `entries`: `full` nodes of target entries,
+    // then the one or two of tail. A short last node is joined with the one before it, split evenly if
+    // the two do not fit in one
+    full = entries / target;
+    int rest = (int) (entries % target);
+    tail.clear();
+    if (rest == 0) {
+        return;
+    }
+    if (full == 0 || rest >= minimumEntries()) {
+        tail.push_back(rest);
+        return;
+    }
+    full--;
+    int joined = target + rest;
+    if (joined <= m) {
+        tail.push_back(joined);
+    } else {
+        tail.push_back(joined / 2);
+        tail.push_back(joined - joined / 2);
+    }
+}
+
+bool BTreeIndex::bulkBuildSorted(const char *filename, int m, double fillFactor, int spareNodes,
+                                 const vector<pair<int, int>> &records, ThreadPool &pool) {
+    if (records.empty()) {
+        CreateIndexFile(filename, spareNodes + 2, m);
+        return BTreeFile != -1;
+    }
+    startBulkBuild(filename, m);
+    int target = min(m, max(minimumEntries(), (int) (m * fillFactor + 0.5)));
+    int file = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (file == -1) {
+        return false;
+    }
+    size_t words = pageSize / sizeof(int32_t);
+    atomic<bool> written{true};
+    // writes count pages from place first on, page k packed by fill(k, page)
+    auto writePages = [&](int first, size_t count, const function<void(size_t, int32_t *)> &fill) {
+        pool.parallelFor(count, BuildChunkNodes, [&](size_t begin, size_t end) {
+            vector<int32_t> pages((end - begin) * words);
+            for (size_t k = begin; k < end; ++k) {
+                fill(k, pages.data() + (k - begin) * words);
+            }
+            if (!StorageBackend::write(file, pages.data(), pages.size() * sizeof(int32_t),
+                                       (off_t) (first + begin) * pageSize)) {
+                written = false;
+            }
+        });
+    };
+
+    // each level is packed from the (largest key, place) pairs of the level below; a level of one node is
+    // the root, at place 1
+    int nextPlace = 2;
+    int isLeaf = 0;
+    vector<pair<int, int>> level, above;
+    const vector<pair<int, int>> *entries = &records;
+    for (;;) {
+        size_t full;
+        vector<int> tail;
+        levelShape(entries->size(), target, full, tail);
+        size_t nodes = full + tail.size();
+        int first = nodes == 1 ? 1 : nextPlace;
+        above.assign(nodes, make_pair(0, 0));
+        writePages(first, nodes, [&](size_t k, int32_t *page) {
+            size_t start = k < full ? k * target : full * target + (k > full ? tail[0] : 0);
+            int count = k < full ? target : tail[k - full];
+            int place = first + (int) k;
+            encodeEntries(entries->data() + start, count, isLeaf, isLeaf == 0 && k + 1 < nodes ? place + 1 : -1,
+                          page);
+            above[k] = make_pair((*entries)[start + count - 1].first, place);
+        });
+        if (nodes == 1) {
+            break;
+        }
+        nextPlace += (int) nodes;
+        level.swap(above);
+        entries = &level;
+        isLeaf = 1;
+    }
+
+    writePages(nextPlace, spareNodes, [&](size_t k, int32_t *page) {
+        pair<int, int> link(k + 1 < (size_t) spareNodes ? nextPlace + (int) k + 1 : -1, -1);
+        encodeEntries(&link, 1, -1, -1, page);
+    });
+    nextPlace += spareNodes;
+    head = spareNodes > 0 ? nextPlace - spareNodes : -1;
+    numberOfRecords = nextPlace;
+    vector<int32_t> header(words);
+    encodeHeader(header.data());
+    written = written && StorageBackend::write(file, header.data(), pageSize, 0);
+    written = close(file) == 0 && written;
+    return written && OpenIndexFile(filename);
+}
+
+//////////////////////////////////////Functions for searching//////////////////////////////////////
+
+bool BTreeIndex::isEmpty(int recordNumber) {
+    return read_val(recordNumber, 0) == -1;
+}
+
+bool BTreeIndex::isLeaf(int recordNumber) {
+    return read_val(recordNumber, 0) == 0;
+}
+
+bool BTreeIndex::record_valid(int recordNumber) const {
+    // a mapped header is live, so nodes another instance has added since the mapping are valid too
+    const Mapping *mapped = mapping.load();
+    int nodes = mapped != nullptr ? mapped->pages[HeaderNodeCount] : numberOfRecords;
+    if (recordNumber <= 0 || recordNumber >= nodes)
+        return false;
+
+    return true;
+}
+
+int BTreeIndex::read_val(int rowIndex, int columnIndex) {
+    // column 0 is isLeaf, columns 1..2m are key0, ref0, key1, ... as in the text format
+    int word = 0;
+    if (columnIndex > 0) {
+        int entry = (columnIndex - 1) / 2;
+        word = columnIndex % 2 == 1 ? 2 + entry : 2 + m + entry;
+    }
+    int32_t x = -1;
+    const int32_t *page = readPage(rowIndex);
+    if (page != nullptr) {
+        x = page[word];
+        releasePage(rowIndex);
+    }
+
+    return x;
+}
+
+vector<pair<int, int>> BTreeIndex::read_node_values(int recordNumber) {
+    if (record_valid(recordNumber)) {
+
+        vector<pair<int, int>> theNode;
+
+        for (int i = 1; i <= 2 * m; i += 2) {
+            int key = read_val(recordNumber, i);
+            int value = read_val(recordNumber, i + 1);
+            theNode.emplace_back(key, value);
+        }
+        return theNode;
+    } else {
+        return {};
+    }
+}
+
+int BTreeIndex::SearchARecord(const char *filename, int RecordID) {
+    Metrics::Timer timer(metrics, Metrics::Search);
+    if (!ensureOpen(filename))
+        return -1;
+    if (copyOnWrite) {
+        // the mode is checked again once the epoch is announced, so it cannot end under the lookup
+        int slot = enterEpoch();
+        int found = copyOnWrite ? searchVersion(rootPlace.load(), RecordID) : -2;
+        leaveEpoch(slot);
+        if (found != -2)
+            return found;
+    }
+    shared_lock<shared_mutex> tree(treeLatch);
+    if (buffered)
+        return searchBuffered(RecordID);
+
+    // one page read per level, and a binary search over the keys inside each page. The child is latched
+    // before the parent is let go (latch crabbing), so a concurrent split is never seen half done.
+    int i = 1;
+    latchShared(i);
+    while (record_valid(i)) {
+        const int32_t *page = readPage(i);
+        if (page == nullptr)
+            break;
+        int isLeaf = page[0], count = page[1];
+        int slot = lowerBound(page, RecordID);
+        int next = -1;
+        if (isLeaf == 0 && slot < count && pageKeys(page)[slot] == RecordID)
+            next = pageRefs(page)[slot];
+        else if (isLeaf == 1 && slot < count)
+            next = pageRefs(page)[slot];
+        releasePage(i);
+        if (isLeaf != 1 || next == -1) {
+            unlatchShared(i);
+            return next;
+        }
+        latchShared(next);
+        unlatchShared(i);
+        i = next;
+    }
+    unlatchShared(i);
+
+    return -1;
+}
+
+int BTreeIndex::lowerBound(const int32_t *page, int RecordID) {
+    return NodeSearch::lowerBound(page + 2, page[1], RecordID);
+}
+
+vector<int> BTreeIndex::MultiSearch(const char *filename, const int *ids, size_t count) {
+    Metrics::Timer timer(metrics, Metrics::MultiSearch);
+    vector<int> references(count, -1);
+    if (count == 0 || !ensureOpen(filename))
+        return references;
+    shared_lock<shared_mutex> tree(treeLatch);
+    if (buffered) {
+        for (size_t i = 0; i < count; ++i)
+            references[i] = searchBuffered(ids[i]);
+        return references;
+    }
+
+    // probe in key order so every node is read once, however many of the ids fall below it
+    vector<size_t> order(count);
+    for (size_t i = 0; i < count; ++i)
+        order[i] = i;
+    sort(order.begin(), order.end(), [ids](size_t a, size_t b) { return ids[a] < ids[b]; });
+    // when reads can overlap, each window of probes first has its pages fetched a level at a time; the
+    // window keeps what one level fetches well inside the pool
+    bool ahead = !arena.active() && (mapping.load() != nullptr || bufferPool.overlapsIO());
+    size_t window = ahead ? max((size_t) 1, bufferPool.capacity() / 4) : count;
+    shared_ptr<const Version> version = copyOnWrite ? openVersion() : nullptr;
+    int root = version != nullptr ? version->root : 1;
+    for (size_t begin = 0; begin < count; begin += window) {
+        size_t end = min(count, begin + window);
+        if (ahead)
+            prefetchPaths(root, ids, order.data(), begin, end);
+        multiSearchNode(root, ids, order.data(), begin, end, references);
+    }
+    return references;
+}
+
+void BTreeIndex::childRuns(const int32_t *page, const int *ids, const size_t *order, size_t begin, size_t end,
+                           vector<tuple<int, size_t, size_t>> &runs) const {
+    int count = page[1], slot = 0;
+    for (size_t i = begin; i < end;) {
+        while (slot < count && pageKeys(page)[slot] < ids[order[i]])
+            slot++;
+        if (slot == count)
+            break;
+        size_t j = i;
+        while (j < end && ids[order[j]] <= pageKeys(page)[slot])
+            j++;
+        runs.emplace_back(pageRefs(page)[slot], i, j);
+        i = j;
+    }
+}
+
+void BTreeIndex::prefetchPaths(int root, const int *ids, const size_t *order, size_t begin, size_t end) {
+    // reads the internal nodes over the probes a level at a time and fetches all the nodes the next level
+    // needs in one batch. It only warms the pool: a node that splits meanwhile is read on demand later.
+    vector<tuple<int, size_t, size_t>> level{make_tuple(root, begin, end)}, next;
+    while (!level.empty()) {
+        next.clear();
+        for (const auto &run: level) {
+            int place = get<0>(run);
+            if (!record_valid(place))
+                continue;
+            latchShared(place);
+            const int32_t *page = readPage(place);
+            if (page != nullptr && page[0] == 1)
+                childRuns(page, ids, order, get<1>(run), get<2>(run), next);
+            if (page != nullptr)
+                releasePage(place);
+            unlatchShared(place);
+        }
+        vector<int> places;
+        for (const auto &run: next)
+            places.push_back(get<0>(run));
+        if (!places.empty())
+            prefetchPages(places);
+        level.swap(next);
+    }
+}
+
+void BTreeIndex::multiSearchNode(int place, const int *ids, const size_t *order, size_t begin, size_t end,
+                                 vector<int> &references) {
+    if (!record_valid(place))
+        return;
+    // the node stays latched while its subtree is searched, so its runs cannot go stale under a split
+    latchShared(place);
+    const int32_t *page = readPage(place);
+    if (page == nullptr) {
+        unlatchShared(place);
+        return;
+    }
+    int isLeaf = page[0], count = page[1];
+    if (isLeaf != 1) {
+        // the probes are sorted, so the matching slot only ever moves right
+        int slot = 0;
+        for (size_t i = begin; i < end && isLeaf == 0; ++i) {
+            while (slot < count && pageKeys(page)[slot] < ids[order[i]])
+                slot++;
+            if (slot < count && pageKeys(page)[slot] == ids[order[i]])
+                references[order[i]] = pageRefs(page)[slot];
+        }
+        releasePage(place);
+        unlatchShared(place);
+        return;
+    }
+
+    // split the probes into one run per child, then visit each child once with its run
+    vector<tuple<int, size_t, size_t>> runs;
+    childRuns(page, ids, order, begin, end, runs);
+    releasePage(place);
+    for (const auto &run: runs)
+        multiSearchNode(get<0>(run), ids, order, get<1>(run), get<2>(run), references);
+    unlatchShared(place);
+}
+
+BTreeIndex::RangeIterator BTreeIndex::RangeScan(const char *filename, int lo, int hi) {
+    // timed up to the first leaf; the caller decides how far the scan goes after that
+    Metrics::Timer timer(metrics, Metrics::RangeScan);
+    RangeIterator it;
+    if (lo > hi || !ensureOpen(filename))
+        return it;
+    if (copyOnWrite) {
+        ReadView view = OpenReadView();
+        if (view.valid())
+            return view.RangeScan(lo, hi);
+    }
+    if (buffered) {
+        // a scan only follows the leaf links, so what is still buffered is applied first
+        shared_lock<shared_mutex> frozen(snapshotGate);
+        unique_lock<shared_mutex> tree(treeLatch);
+        if (buffered && messagesPending)
+            drainBuffers();
+    }
+    shared_lock<shared_mutex> tree(treeLatch);
+
+    // descend to the leaf that would hold lo, exactly like SearchARecord
+    int i = 1;
+    latchShared(i);
+    while (record_valid(i)) {
+        const int32_t *page = readPage(i);
+        if (page == nullptr)
+            break;
+        int isLeaf = page[0], count = page[1];
+        int slot = lowerBound(page, lo);
+        int next = (isLeaf == 1 && slot < count) ? pageRefs(page)[slot] : -1;
+        releasePage(i);
+        unlatchShared(i);
+        if (isLeaf == 0) {
+            it.index = this;
+            it.hi = hi;
+            tree.unlock();
+            it.load(i, lo);
+            return it;
+        }
+        if (next == -1)
+            return it;
+        latchShared(next);
+        i = next;
+    }
+    unlatchShared(i);
+    return it;
+}
+
+int BTreeIndex::readahead(int from, int hi, int leaves) {
+    // descends to the parent of the leaf holding `from` and fetches that leaf and the siblings after it
+    // that still overlap [from, hi], at most `leaves` of them. Returns the largest key they cover.
+    shared_lock<shared_mutex> tree(treeLatch);
+    if (arena.active()) {
+        return INT32_MAX;
+    }
+    int i = 1;
+    latchShared(i);
+    const int32_t *page = record_valid(i) ? readPage(i) : nullptr;
+    while (page != nullptr && page[0] == 1) {
+        int count = page[1], slot = lowerBound(page, from);
+        if (slot == count)
+            break;
+        int child = pageRefs(page)[slot];
+        if (!record_valid(child))
+            break;
+        latchShared(child);
+        const int32_t *below = readPage(child);
+        if (below != nullptr && below[0] == 0) {
+            vector<int> window;
+            int end = slot;
+            for (int s = slot + 1; s < count && (int) window.size() + 1 < leaves && pageKeys(page)[s - 1] < hi;
+                 ++s) {
+                window.push_back(pageRefs(page)[s]);
+                end = s;
+            }
+            int covered = pageKeys(page)[end] >= hi ? INT32_MAX : pageKeys(page)[end];
+            releasePage(child);
+            unlatchShared(child);
+            releasePage(i);
+            unlatchShared(i);
+            prefetchPages(window);
+            return covered;
+        }
+        releasePage(i);
+        unlatchShared(i);
+        i = child;
+        page = below;
+    }
+    if (page != nullptr)
+        releasePage(i);
+    unlatchShared(i);
+    return INT32_MAX;
+}
+
+void BTreeIndex::RangeIterator::load(int place, int lo) {
+    // copy the entries in [lo, hi] out of the leaf, moving on to its siblings while it has none
+    shared_lock<shared_mutex> tree(index->treeLatch);
+    while (index->record_valid(place)) {
+        index->latchShared(place);
+        const int32_t *page = index->readPage(place);
+        if (page == nullptr || page[0] != 0) {
+            if (page != nullptr)
+                index->releasePage(place);
+            index->unlatchShared(place);
+            break;
+        }
+        int count = page[1];
+        int nextLeaf = page[2 + 2 * index->m];
+        entries.clear();
+        const int32_t *keys = index->pageKeys(page), *refs = index->pageRefs(page);
+        for (int s = lowerBound(page, lo); s < count && keys[s] <= hi; ++s) {
+            entries.emplace_back(keys[s], refs[s]);
+        }
+        bool past = count > 0 && keys[count - 1] >= hi;
+        index->releasePage(place);
+        index->unlatchShared(place);
+        if (!entries.empty()) {
+            leaf = place;
+            slot = 0;
+            return;
+        }
+        if (past)
+            break;
+        place = nextLeaf;
+    }
+    *this = RangeIterator();
+}
+
+BTreeIndex::RangeIterator &BTreeIndex::RangeIterator::operator++() {
+    if (++slot < (int) entries.size())
+        return *this;
+    int last = entries.back().first;
+    if (last >= hi || last == INT32_MAX) {
+        *this = RangeIterator();
+        return *this;
+    }
+    if (version != nullptr) {
+        loadVersion(last + 1);
+        return *this;
+    }
+    // the scan has moved on to another leaf: it is sequential, so fetch the leaves ahead, in a window
+    // that doubles each time the scan runs past the last one
+    int most = index->scanReadahead.load(memory_order_relaxed);
+    if (most > 0 && last >= readaheadKey) {
+        readaheadLeaves = readaheadLeaves == 0 ? min(MinReadaheadLeaves, most) : min(2 * readaheadLeaves, most);
+        readaheadKey = index->readahead(last + 1, hi, readaheadLeaves);
+    }
+    // start again from this leaf rather than the sibling seen when it was copied: a split since then
+    // may have moved the rest of the range into a new sibling in between
+    load(leaf, last + 1);
+    return *this;
+}
+
+BTreeIndex::RangeIterator BTreeIndex::RangeIterator::operator++(int) {
+    RangeIterator before = *this;
+    ++*this;
+    return before;
+}
+
+bool BTreeIndex::RangeIterator::operator==(const RangeIterator &other) const {
+    return leaf == other.leaf && (leaf == -1 || slot == other.slot);
+}
+
+vector<BTreeNode> BTreeIndex::readFile(const char *filename, int &freeHead) {
+    // the file need not be the open index, so its pages are laid out by its own header and the open
+    // index's state is left alone
+    if (isOpen() && BTreeFileName == filename) {
+        Flush();
+    }
+    ifstream File(filename, ios::in | ios::binary);
+    vector<BTreeNode> Btree;
+    int32_t header[HeaderFields];
+    if (!loadHeader(File, header) || header[HeaderOrder] < 1) {
+        return Btree;
+    }
+    int order = header[HeaderOrder], filePageSize = PageSizeFor(order);
+    freeHead = header[HeaderFreeHead];
+    File.seekg(filePageSize, ios::beg);
+    vector<int32_t> page(filePageSize / sizeof(int32_t));
+    for (int i = 1; i < header[HeaderNodeCount]; i++) {
+        if (!File.read(reinterpret_cast<char *>(page.data()), filePageSize)) {
+            break;
+        }
+        Btree.emplace_back();
+        decodePage(page.data(), i, order, Btree.back());
+    }
+    File.close();
+
+    return Btree;
+}
+
+void BTreeIndex::savefile(const char *filename, const vector<BTreeNode> &bTree, int m) {
+    ofstream outFile(filename, ios::binary | ios::trunc);
+    numberOfRecords = bTree.size() + 1;
+    writeHeader(outFile);
+    vector<int32_t> page(pageSize / sizeof(int32_t));
+    for (const auto &node: bTree) {
+        encodePage(node, page.data());
+        outFile.write(reinterpret_cast<const char *>(page.data()), pageSize);
+    }
+
+    outFile.close();
+}
+
+/////////////////////////////////////Binary page format/////////////////////////////////////////
+
+int BTreeIndex::PageSizeFor(int m) {
+    int words = max(3 + 2 * m, (int) HeaderFields);
+    return words * sizeof(int32_t);
+}
+
+bool BTreeIndex::readHeader(istream &in) {
+    int32_t header[HeaderFields];
+    if (!loadHeader(in, header)) {
+        return false;
+    }
+    applyHeader(header);
+    in.seekg(pageSize, ios::beg);
+    return true;
+}
+
+bool BTreeIndex::loadHeader(istream &in, int32_t *header) const {
+    in.seekg(0, ios::beg);
+    if (!in.read(reinterpret_cast<char *>(header), HeaderFields * sizeof(int32_t))) {
+        return false;
+    }
+    if (header[HeaderMagic] != FileMagic) {
+        cerr << "Not a binary B-Tree index file (convert text indexes with ConvertTextIndexFile)\n";
+        return false;
+    }
+    if (header[HeaderVersion] != FormatVersion) {
+        cerr << "Unsupported index format version " << header[HeaderVersion] << " (expected " << FormatVersion
+             << ", rebuild the index with BulkLoad or ConvertTextIndexFile)\n";
+        return false;
+    }
+    return true;
+}
+
+void BTreeIndex::applyHeader(const int32_t *header) {
+    m = header[HeaderOrder];
+    numberOfRecords = header[HeaderNodeCount];
+    head = header[HeaderFreeHead];
+    savedRoot = header[HeaderRoot];
+    savedBuffers = header[HeaderBuffers];
+    pageSize = PageSizeFor(m);
+}
+
+void BTreeIndex::writeHeader(ostream &out) const {
+    vector<int32_t> page(pageSize / sizeof(int32_t));
+    encodeHeader(page.data());
+    out.write(reinterpret_cast<const char *>(page.data()), pageSize);
+}
+
+void BTreeIndex::encodeHeader(int32_t *page) const {
+    fill(page, page + pageSize / sizeof(int32_t), -1);
+    page[HeaderMagic] = FileMagic;
+    page[HeaderVersion] = FormatVersion;
+    page[HeaderOrder] = m;
+    page[HeaderNodeCount] = numberOfRecords;
+    page[HeaderFreeHead] = head;
+    page[HeaderRoot] = copyOnWrite ? rootPlace.load() : -1;
+    page[HeaderBuffers] = buffered ? bufferPages : -1;
+}
+
+void BTreeIndex::encodePage(const BTreeNode &node, int32_t *page) const {
+    encodeEntries(node.node.data(), (int) node.node.size(), node.isLeaf, node.next, page);
+}
+
+void BTreeIndex::encodeEntries(const pair<int, int> *entries, int count, int isLeaf, int next, int32_t *page) const {
+    fill(page, page + pageSize / sizeof(int32_t), -1);
+    page[0] = isLeaf;
+    int filled = 0;
+    int32_t *keys = page + 2, *refs = page + 2 + m;
+    for (int i = 0; i < m && i < count; ++i) {
+        keys[i] = entries[i].first;
+        refs[i] = entries[i].second;
+        if (entries[i].first != -1 && entries[i].second != -1) {
+            filled++;
+        }
+    }
+    page[1] = filled;
+    page[2 + 2 * m] = next;
+}
+
+BTreeNode BTreeIndex::decodePage(const int32_t *page, int place) const {
+    BTreeNode Node;
+    decodePage(page, place, Node);
+    return Node;
+}
+
+void BTreeIndex::decodePage(const int32_t *page, int place, BTreeNode &into) const {
+    decodePage(page, place, m, into);
+}
+
+void BTreeIndex::decodePage(const int32_t *page, int place, int order, BTreeNode &into) {
+    // reuses the entry storage `into` already has, so decoding into a recycled node does not allocate
+    into.isLeaf = page[0];
+    into.count = page[1];
+    into.place = place;
+    into.node.resize(order);
+    for (int i = 0; i < order; ++i) {
+        into.node[i] = make_pair(page[2 + i], page[2 + order + i]);
+    }
+    into.next = page[2 + 2 * order];
+}
+
+int BTreeIndex::split(BTreeNode &node, BTreeNode &sibling) {
+    int newRecordNumber = allocateNode();
+    if (newRecordNumber == -1) {
+        return -1;
+    }
+    metrics.add(Metrics::Splits);
+    vector<pair<int, int>> firstNode, secondNode;
+    tie(firstNode, secondNode) = splitOriginalNode(
+            vector<pair<int, int>>(node.node.begin(), node.node.begin() + node.count));
+
+    setEntries(node, firstNode);
+    sibling = emptyNode(newRecordNumber, node.isLeaf);
+    setEntries(sibling, secondNode);
+    if (node.isLeaf == 0) {
+        sibling.next = node.next;
+        node.next = sibling.place;
+    }
+    writeNode(sibling.place, sibling);
+    writeNode(node.place, node);
+    return newRecordNumber;
+}
+
+bool BTreeIndex::split_root(BTreeNode &root, BTreeNode &first, BTreeNode &second) {
+    int firstNodeIndex = allocateNode();
+    if (firstNodeIndex == -1) {
+        return false;
+    }
+    int secondNodeIndex = allocateNode();
+    if (secondNodeIndex == -1) {
+        freeNode(firstNodeIndex);
+        return false;
+    }
+    metrics.add(Metrics::RootSplits);
+    vector<pair<int, int>> firstNode, secondNode;
+    tie(firstNode, secondNode) = splitOriginalNode(
+            vector<pair<int, int>>(root.node.begin(), root.node.begin() + root.count));
+    // the two halves keep the old root's kind, the root itself becomes an internal node over them
+    first = emptyNode(firstNodeIndex, root.isLeaf);
+    setEntries(first, firstNode);
+    second = emptyNode(secondNodeIndex, root.isLeaf);
+    setEntries(second, secondNode);
+    if (root.isLeaf == 0) {
+        first.next = second.place;
+    }
+    writeNode(first.place, first);
+    writeNode(second.place, second);
+
+    setEntries(root, {make_pair(firstNode.back().first, firstNodeIndex),
+                      make_pair(secondNode.back().first, secondNodeIndex)});
+    root.isLeaf = 1;
+    root.next = -1;
+    writeNode(root.place, root);
+    return true;
+}
+
+pair<vector<pair<int, int>>, vector<pair<int, int>>>
+BTreeIndex::splitOriginalNode(const vector<pair<int, int>> &originalNode) {
+    vector<pair<int, int>> firstNode, secondNode;
+
+    auto middle = originalNode.begin() + originalNode.size() / 2;
+
+    for (auto it = originalNode.begin(); it != originalNode.end(); ++it) {
+        if (distance(it, middle) > 0) {
+            firstNode.push_back(*it);
+        } else {
+            secondNode.push_back(*it);
+        }
+    }
+
+    return make_pair(firstNode, secondNode);
+}
+
+bool BTreeIndex::updateAfterInsert(BTreeNode &parent, const BTreeNode &child, BTreeNode &newChild) {
+    bool changed = false;
+    int slot = findChild(parent, child.place);
+    int childMax = child.node[child.count - 1].first;
+    if (parent.node[slot].first != childMax) {
+        parent.node[slot].first = childMax;
+        changed = true;
+    }
+    if (newChild.place != -1) {
+        insertEntry(parent, make_pair(newChild.node[newChild.count - 1].first, newChild.place));
+        changed = true;
+    }
+    newChild.place = -1;
+    if (!changed) {
+        return false;
+    }
+
+    if (parent.count <= m) {
+        writeNode(parent.place, parent);
+    } else if (parent.place == 1) {
+        BTreeNode first, second;
+        split_root(parent, first, second);
+    } else {
+        split(parent, newChild);
+    }
+    return true;
+}
+
+/////////////////////////////////////Page-level I/O/////////////////////////////////////////////
+
+bool BTreeIndex::ensureOpen(const char *filename) {
+    if (isOpen() && BTreeFileName == filename) {
+        return true;
+    }
+    return OpenIndexFile(filename);
+}
+
+const int32_t *BTreeIndex::readPage(int place) {
+    metrics.add(Metrics::NodeReads);
+    const Mapping *mapped = mapping.load();
+    if (mapped == nullptr) {
+        return pinPage(place);
+    }
+    size_t end = (size_t) (place + 1) * pageSize;
+    if (end > mapped->bytes) {
+        if (!RemapIndexFile() || end > (mapped = mapping.load())->bytes) {
+            return nullptr;
+        }
+    }
+    return mapped->pages + (size_t) place * (pageSize / sizeof(int32_t));
+}
+
+void BTreeIndex::prefetchPages(const vector<int> &places) {
+    const Mapping *mapped = mapping.load();
+    if (arena.active()) {
+        return;
+    }
+    if (mapped == nullptr) {
+        // with reads that cannot overlap, fetching ahead only moves the wait, unless neighbouring pages
+        // can be read in one request
+        bool neighbours = false;
+        for (size_t i = 1; i < places.size() && !neighbours; ++i)
+            neighbours = abs(places[i] - places[i - 1]) == 1;
+        if (neighbours || bufferPool.overlapsIO())
+            bufferPool.prefetch(places.data(), places.size());
+        return;
+    }
+#ifndef _WIN32
+    long systemPage = sysconf(_SC_PAGESIZE);
+    for (int place: places) {
+        size_t offset = (size_t) place * pageSize, start = offset - offset % systemPage;
+        if (offset + pageSize <= mapped->bytes) {
+            madvise((char *) mapped->pages + start, offset + pageSize - start, MADV_WILLNEED);
+        }
+    }
+#endif
+}
+
+void BTreeIndex::releasePage(int place, bool dirty) {
+    if (dirty && place != 0) {
+        metrics.add(Metrics::NodeWrites);
+    }
+    if (arena.active()) {
+        if (dirty) {
+            arena.markDirty(place);
+        }
+    } else if (mapping.load() == nullptr) {
+        bufferPool.unpin(place, dirty);
+    }
+}
+
+int32_t *BTreeIndex::pinPage(int place, bool load) {
+    if (arena.active()) {
+        return place >= 0 && place < arena.capacity() ? arena.page(place) : nullptr;
+    }
+    return bufferPool.pin(place, load);
+}
+
+void BTreeIndex::resetLatches() {
+    latchCount = numberOfRecords;
+    latches.reset(new Latch[latchCount]);
+}
+
+void BTreeIndex::latchShared(int place) {
+    if (place < latchCount) {
+        latches[place].lockShared();
+    }
+}
+
+void BTreeIndex::unlatchShared(int place) {
+    if (place < latchCount) {
+        latches[place].unlockShared();
+    }
+}
+
+void BTreeIndex::latchExclusive(int place) {
+    if (place < latchCount) {
+        latches[place].lock();
+    }
+}
+
+void BTreeIndex::unlatchExclusive(int place) {
+    if (place < latchCount) {
+        latches[place].unlock();
+    }
+}
+
+BTreeIndex::LatchedPath::~LatchedPath() {
+    for (int place: places) {
+        index.unlatchExclusive(place);
+    }
+}
+
+void BTreeIndex::LatchedPath::lock(int place) {
+    index.latchExclusive(place);
+    places.push_back(place);
+}
+
+void BTreeIndex::LatchedPath::keepOnly(int place) {
+    for (int held: places) {
+        if (held != place) {
+            index.unlatchExclusive(held);
+        }
+    }
+    places.assign(1, place);
+}
+
+BTreeNode BTreeIndex::readNode(int place) {
+    BTreeNode Node;
+    readNode(place, Node);
+    return Node;
+}
+
+void BTreeIndex::readNode(int place, BTreeNode &into) {
+    const int32_t *page = readPage(place);
+    if (page == nullptr) {
+        into = emptyNode(place, -1);
+        return;
+    }
+    decodePage(page, place, into);
+    releasePage(place);
+}
+
+void BTreeIndex::insertIntoPage(int32_t *page, int slot, int RecordID, int Reference) const {
+    int count = page[1];
+    int32_t *keys = page + 2, *refs = page + 2 + m;
+    copy_backward(keys + slot, keys + count, keys + count + 1);
+    copy_backward(refs + slot, refs + count, refs + count + 1);
+    keys[slot] = RecordID;
+    refs[slot] = Reference;
+    page[1] = count + 1;
+}
+
+void BTreeIndex::writeNode(int place, const BTreeNode &node) {
+    // the whole page is overwritten, so it is not read in first; the pool writes it back later
+    int32_t *page = pinPage(place, false);
+    if (page == nullptr) {
+        return;
+    }
+    encodePage(node, page);
+    releasePage(place, true);
+}
+
+void BTreeIndex::writeHeaderPage() {
+    int32_t *page = pinPage(0, false);
+    if (page == nullptr) {
+        return;
+    }
+    encodeHeader(page);
+    releasePage(0, true);
+}
+
+void BTreeIndex::ConfigureBufferPool(size_t frames, BufferPool::Policy policy) {
+    unique_lock<shared_mutex> tree(treeLatch);
+    bufferPool.configure(frames, policy);
+}
+
+void BTreeIndex::ConfigureStorage(StorageBackend::Kind kind, unsigned queueDepth) {
+    unique_lock<shared_mutex> tree(treeLatch);
+    bufferPool.setStorage(kind, queueDepth);
+}
+
+bool BTreeIndex::Flush() {
+    if (arena.active()) {
+        return Snapshot();
+    }
+    unique_lock<shared_mutex> tree(treeLatch);
+    return flushLocked();
+}
+
+bool BTreeIndex::flushLocked() {
+    // with a log, changed pages may only reach the index file through a checkpoint
+    return wal.isOpen() ? checkpointLocked() : bufferPool.flush();
+}
+
+BufferPool::Stats BTreeIndex::BufferStats() const {
+    return bufferPool.stats();
+}
+
+int BTreeIndex::allocateNode() {
+    lock_guard<mutex> guard(allocatorLatch);
+    if (head == -1) {
+        return -1;
+    }
+    int place = head;
+    takeFreeNode(place);
+    if (reservedNodes > 0) {
+        reservedNodes--;
+    }
+    return place;
+}
+
+bool BTreeIndex::takeFreeNode(int place) {
+    // callers hold allocatorLatch
+    int previous = -1;
+    int current = head;
+    while (current != -1 && current != place) {
+        previous = current;
+        current = read_val(current, 1);
+    }
+    if (current == -1) {
+        return false;
+    }
+    int next = read_val(place, 1);
+    if (previous == -1) {
+        head = next;
+        writeHeaderPage();
+    } else {
+        BTreeNode before = readNode(previous);
+        before.node[0].first = next;
+        writeNode(previous, before);
+    }
+    return true;
+}
+
+void BTreeIndex::freeNode(int place) {
+    lock_guard<mutex> guard(allocatorLatch);
+    BTreeNode freed = emptyNode(place, -1);
+    freed.node[0].first = head;
+    writeNode(place, freed);
+    head = place;
+    writeHeaderPage();
+}
+
+bool BTreeIndex::appendFreePages(int count) {
+    // callers hold allocatorLatch. The new places are chained in file order in front of the free list
+    // and written straight to the file, a batch at a time: no frame can hold a place past the end.
+    if (count == 0) {
+        return true;
+    }
+    const int Batch = 256;
+    int first = numberOfRecords;
+    size_t words = pageSize / sizeof(int32_t);
+    BTreeNode freed = emptyNode(first, -1);
+    if (arena.active()) {
+        // in memory the new pages are made in the arena and reach the file with the next snapshot
+        if (!arena.grow(first + count)) {
+            return false;
+        }
+        for (int place = first; place < first + count; ++place) {
+            freed.node[0].first = place + 1 < first + count ? place + 1 : head;
+            encodePage(freed, arena.page(place));
+            arena.markDirty(place);
+        }
+    } else {
+        vector<int32_t> pages(min(count, Batch) * words);
+        for (int done = 0; done < count;) {
+            int batch = min(count - done, Batch);
+            for (int i = 0; i < batch; ++i) {
+                int place = first + done + i;
+                freed.node[0].first = place + 1 < first + count ? place + 1 : head;
+                encodePage(freed, pages.data() + i * words);
+            }
+            size_t bytes = (size_t) batch * pageSize;
+            if (pwrite(BTreeFile, pages.data(), bytes, (off_t) (first + done) * pageSize) != (ssize_t) bytes) {
+                return false;
+            }
+            done += batch;
+        }
+        // the log holds no images of these pages, so they must be on disk before a header naming them is
+        if (wal.isOpen() && fsync(BTreeFile) != 0) {
+            return false;
+        }
+    }
+    head = first;
+    numberOfRecords = first + count;
+    writeHeaderPage();
+    return true;
+}
+
+bool BTreeIndex::growFile() {
+    // callers hold treeLatch exclusively, so no node latch is held while the latch array is replaced.
+    // Extents grow with the file, so n inserts append O(log n) times.
+    lock_guard<mutex> guard(allocatorLatch);
+    if (!appendFreePages(max(MinGrowthPages, numberOfRecords / 4))) {
+        return false;
+    }
+    metrics.add(Metrics::FileGrowths);
+    resetLatches();
+    return true;
+}
+
+int BTreeIndex::ShrinkIndexFile() {
+    shared_lock<shared_mutex> frozen(snapshotGate);
+    unique_lock<shared_mutex> tree(treeLatch);
+    if (readOnly || !isOpen() || copyOnWrite || buffered) {
+        return -1;
+    }
+    // place 1 is the root and stays even while the tree is empty
+    int end = numberOfRecords;
+    while (end > 2 && isEmpty(end - 1)) {
+        end--;
+    }
+    int released = numberOfRecords - end;
+    if (released == 0) {
+        return 0;
+    }
+    {
+        lock_guard<mutex> guard(allocatorLatch);
+        int previous = -1;
+        for (int current = head; current != -1;) {
+            int next = read_val(current, 1);
+            if (current < end) {
+                previous = current;
+            } else if (previous == -1) {
+                head = next;
+            } else {
+                BTreeNode before = readNode(previous);
+                before.node[0].first = next;
+                writeNode(previous, before);
+            }
+            current = next;
+        }
+        numberOfRecords = end;
+        writeHeaderPage();
+    }
+    if (arena.active()) {
+        // the next snapshot writes the shorter image; the arena keeps its chunks
+        resetLatches();
+        return released;
+    }
+    // the header naming the shorter file reaches the disk before the file is cut
+    bufferPool.discardFrom(end);
+    if (!flushLocked() || ftruncate(BTreeFile, (off_t) end * pageSize) != 0) {
+        return -1;
+    }
+    resetLatches();
+    return released;
+}
+
+bool BTreeIndex::reserveNodes(int needed) {
+    if (needed == 0) {
+        return true;
+    }
+    // nodes already promised to other inserts that are still splitting are not counted as free
+    lock_guard<mutex> guard(allocatorLatch);
+    int current = head;
+    for (int i = 0; i < reservedNodes + needed; ++i) {
+        if (current == -1) {
+            return false;
+        }
+        current = read_val(current, 1);
+    }
+    reservedNodes += needed;
+    return true;
+}
+
+BTreeNode BTreeIndex::emptyNode(int place, int isLeaf) const {
+    BTreeNode Node;
+    Node.isLeaf = isLeaf;
+    Node.place = place;
+    Node.count = 0;
+    Node.node.assign(m, make_pair(-1, -1));
+    return Node;
+}
+
+void BTreeIndex::setEntries(BTreeNode &node, const vector<pair<int, int>> &entries) const {
+    node.node = entries;
+    node.count = entries.size();
+    node.node.resize(max(m, node.count), make_pair(-1, -1));
+}
+
+void BTreeIndex::insertEntry(BTreeNode &node, pair<int, int> entry) {
+    auto end = node.node.begin() + node.count;
+    auto pos = lower_bound(node.node.begin(), end, entry,
+                           [](const pair<int, int> &a, const pair<int, int> &b) { return a.first < b.first; });
+    node.node.insert(pos, entry);
+    node.count++;
+    if ((int) node.node.size() > max(m, node.count)) {
+        node.node.pop_back();
+    }
+}
+
+void BTreeIndex::removeEntry(BTreeNode &node, int key) {
+    int slot = findEntry(node, key);
+    if (slot != -1) {
+        removeAt(node, slot);
+    }
+}
+
+void BTreeIndex::removeAt(BTreeNode &node, int slot) {
+    node.node.erase(node.node.begin() + slot);
+    node.node.emplace_back(-1, -1);
+    node.count--;
+}
+
+int BTreeIndex::findEntry(const BTreeNode &node, int key) const {
+    auto end = node.node.begin() + node.count;
+    auto it = lower_bound(node.node.begin(), end, key,
+                          [](const pair<int, int> &entry, int k) { return entry.first < k; });
+    return (it != end && it->first == key) ? (int) (it - node.node.begin()) : -1;
+}
+
+int BTreeIndex::findChild(const BTreeNode &node, int place) const {
+    for (int i = 0; i < node.count; ++i) {
+        if (node.node[i].second == place) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int BTreeIndex::childFor(const BTreeNode &node, int RecordID) const {
+    auto end = node.node.begin() + node.count;
+    auto it = lower_bound(node.node.begin(), end, RecordID,
+                          [](const pair<int, int> &entry, int k) { return entry.first < k; });
+    return it != end ? it->second : node.node[node.count - 1].second;
+}
+
+int BTreeIndex::childSlot(const BTreeNode &node, int RecordID) const {
+    auto end = node.node.begin() + node.count;
+    return (int) (lower_bound(node.node.begin(), end, RecordID,
+                              [](const pair<int, int> &entry, int k) { return entry.first < k; }) -
+                  node.node.begin());
+}
+
+/////////////////////////////////////In-memory mode/////////////////////////////////////////////
+
+bool BTreeIndex::Snapshot() {
+    lock_guard<mutex> serial(snapshotLatch);
+    vector<PageArena::Run> runs;
+    {
+        // only the copy of the changed pages keeps inserts and deletes out; lookups go on throughout
+        unique_lock<shared_mutex> frozen(snapshotGate);
+        if (!arena.active()) {
+            return false;
+        }
+        if (arena.capture(numberOfRecords, runs) == 0 && !snapshotPending) {
+            return true;
+        }
+        snapshotPending = true;
+    }
+    // written next to the index and renamed over it, so a crash leaves one whole snapshot or the other
+    string temporary = snapshotFileName();
+    int file = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (file == -1) {
+        return false;
+    }
+    bool ok = true;
+    for (const auto &run: runs) {
+        ok = ok && StorageBackend::write(file, run.pages, run.bytes, run.offset);
+    }
+    ok = ok && fsync(file) == 0;
+    close(file);
+    if (!ok || rename(temporary.c_str(), BTreeFileName.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    snapshotPending = false;
+    return true;
+}
+
+void BTreeIndex::snapshotLoop(int snapshotMillis) {
+    unique_lock<mutex> guard(snapshotterLatch);
+    while (!snapshotterWake.wait_for(guard, chrono::milliseconds(snapshotMillis), [this] { return stopSnapshots; })) {
+        guard.unlock();
+        Snapshot();
+        guard.lock();
+    }
+}
+
+void BTreeIndex::stopSnapshotter() {
+    if (!snapshotter.joinable()) {
+        return;
+    }
+    {
+        lock_guard<mutex> guard(snapshotterLatch);
+        stopSnapshots = true;
+    }
+    snapshotterWake.notify_all();
+    snapshotter.join();
+}
+
+/////////////////////////////////////Copy-on-write versions///////////////////////////////////////
+
+bool BTreeIndex::EnableCopyOnWrite() {
+    shared_lock<shared_mutex> frozen(snapshotGate);
+    unique_lock<shared_mutex> tree(treeLatch);
+    if (readOnly || !isOpen() || buffered) {
+        return false;
+    }
+    if (copyOnWrite) {
+        return true;
+    }
+    // an empty tree keeps its root on the free list; a version needs a root page to point at
+    if (isEmpty(1)) {
+        lock_guard<mutex> guard(allocatorLatch);
+        if (!takeFreeNode(1)) {
+            return false;
+        }
+        writeNode(1, emptyNode(1, 0));
+    }
+    rootPlace = 1;
+    copyOnWrite = true;
+    writeHeaderPage();
+    return true;
+}
+
+bool BTreeIndex::DisableCopyOnWrite() {
+    shared_lock<shared_mutex> frozen(snapshotGate);
+    unique_lock<shared_mutex> tree(treeLatch);
+    if (!copyOnWrite || readOnly) {
+        return !readOnly;
+    }
+    leaveCopyOnWrite();
+    return savedRoot == -1;
+}
+
+void BTreeIndex::leaveCopyOnWrite() {
+    // readers check the mode after announcing their epoch, so once every slot is free none is left
+    // that could still be reading a version
+    copyOnWrite = false;
+    for (int slot = 0; slot < ReaderSlots; ++slot) {
+        while (readerSlots[slot].epoch.load() != 0) {
+            this_thread::yield();
+        }
+    }
+    retired.clear();
+    savedRoot = rootPlace;
+    if (normalizeTree(rootPlace)) {
+        rootPlace = 1;
+    }
+}
+
+BTreeIndex::ReadView BTreeIndex::OpenReadView() {
+    ReadView view;
+    view.version = openVersion();
+    return view;
+}
+
+int BTreeIndex::ReadView::SearchARecord(int RecordID) const {
+    if (version == nullptr) {
+        return -1;
+    }
+    Metrics::Timer timer(version->index->metrics, Metrics::Search);
+    return version->index->searchVersion(version->root, RecordID);
+}
+
+BTreeIndex::RangeIterator BTreeIndex::ReadView::RangeScan(int lo, int hi) const {
+    RangeIterator it;
+    if (version == nullptr || lo > hi) {
+        return it;
+    }
+    Metrics::Timer timer(version->index->metrics, Metrics::RangeScan);
+    it.index = version->index;
+    it.hi = hi;
+    it.version = version;
+    it.loadVersion(lo);
+    return it;
+}
+
+void BTreeIndex::RangeIterator::loadVersion(int lo) {
+    // leaf links are not kept up between versions, so every leaf is found from the version's root
+    int place = index->leafFor(version->root, lo);
+    const int32_t *page = place != -1 ? index->readPage(place) : nullptr;
+    entries.clear();
+    if (page != nullptr) {
+        const int32_t *keys = index->pageKeys(page), *refs = index->pageRefs(page);
+        for (int s = lowerBound(page, lo); s < page[1] && keys[s] <= hi; ++s) {
+            entries.emplace_back(keys[s], refs[s]);
+        }
+        index->releasePage(place);
+    }
+    if (entries.empty()) {
+        *this = RangeIterator();
+        return;
+    }
+    leaf = place;
+    slot = 0;
+}
+
+int BTreeIndex::enterEpoch() {
+    // a slot is claimed with the epoch read just before; a change that retires pages after that epoch
+    // began either sees the claim or has published its root before the reader reads it
+    size_t start = hash<thread::id>()(this_thread::get_id());
+    for (size_t probe = 0;; ++probe) {
+        int slot = (int) ((start + probe) % ReaderSlots);
+        uint64_t idle = 0;
+        if (readerSlots[slot].epoch.compare_exchange_strong(idle, globalEpoch.load())) {
+            return slot;
+        }
+        if (probe % ReaderSlots == ReaderSlots - 1) {
+            this_thread::yield();
+        }
+    }
+}
+
+void BTreeIndex::leaveEpoch(int slot) {
+    readerSlots[slot].epoch.store(0);
+}
+
+shared_ptr<const BTreeIndex::Version> BTreeIndex::openVersion() {
+    int slot = enterEpoch();
+    if (!copyOnWrite) {
+        leaveEpoch(slot);
+        return nullptr;
+    }
+    return make_shared<const Version>(this, rootPlace.load(), slot);
+}
+
+int BTreeIndex::leafFor(int root, int RecordID) {
+    // pages reachable from a published root never change, so no latch is taken on the way down
+    int place = root;
+    for (;;) {
+        const int32_t *page = readPage(place);
+        if (page == nullptr) {
+            return -1;
+        }
+        int isLeaf = page[0], count = page[1];
+        int slot = lowerBound(page, RecordID);
+        int next = isLeaf == 1 && slot < count ? pageRefs(page)[slot] : -1;
+        releasePage(place);
+        if (isLeaf != 1) {
+            return isLeaf == 0 ? place : -1;
+        }
+        if (next == -1) {
+            return -1;
+        }
+        place = next;
+    }
+}
+
+int BTreeIndex::searchVersion(int root, int RecordID) {
+    int place = leafFor(root, RecordID);
+    const int32_t *page = place != -1 ? readPage(place) : nullptr;
+    if (page == nullptr) {
+        return -1;
+    }
+    int slot = lowerBound(page, RecordID);
+    int found = slot < page[1] && pageKeys(page)[slot] == RecordID ? pageRefs(page)[slot] : -1;
+    releasePage(place);
+    return found;
+}
+
+bool BTreeIndex::reserveVersioned(int depth) {
+    // every node of the path may be copied and split, and the root may get a new one above it. Callers
+    // hold versionLatch and are the only ones reserving, so what is left over is simply dropped after.
+    int needed = 2 * depth + 1;
+    if (reserveNodes(needed)) {
+        return true;
+    }
+    reclaimVersions();
+    return reserveNodes(needed);
+}
+
+void BTreeIndex::writeCopies(const BTreeNode &node, vector<BTreeNode> &copies) {
+    // writes the entries of node, up to m + 1 of them or 2m after a merge, to one new node or two halves
+    vector<pair<int, int>> entries(node.node.begin(), node.node.begin() + node.count);
+    vector<vector<pair<int, int>>> parts;
+    if (node.count <= m) {
+        parts.push_back(move(entries));
+    } else {
+        metrics.add(Metrics::Splits);
+        parts.resize(2);
+        tie(parts[0], parts[1]) = splitOriginalNode(entries);
+    }
+    copies.clear();
+    for (auto &part: parts) {
+        BTreeNode copy = emptyNode(allocateNode(), node.isLeaf);
+        setEntries(copy, part);
+        writeNode(copy.place, copy);
+        copies.push_back(move(copy));
+    }
+}
+
+void BTreeIndex::publish(int root, vector<int> &replaced) {
+    // callers hold versionLatch. The root goes out before the epoch moves on, so a reader that still
+    // gets the old root has claimed an epoch no later than the one the replaced pages are retired with
+    rootPlace.store(root);
+    writeHeaderPage();
+    uint64_t epoch = globalEpoch.fetch_add(1);
+    for (int place: replaced) {
+        retired.emplace_back(epoch, place);
+    }
+    replaced.clear();
+    {
+        lock_guard<mutex> guard(allocatorLatch);
+        reservedNodes = 0;
+    }
+    if (retired.size() >= ReclaimBatch) {
+        reclaimVersions();
+    }
+}
+
+void BTreeIndex::reclaimVersions() {
+    // callers hold versionLatch
+    uint64_t oldest = UINT64_MAX;
+    for (int slot = 0; slot < ReaderSlots; ++slot) {
+        uint64_t epoch = readerSlots[slot].epoch.load();
+        if (epoch != 0) {
+            oldest = min(oldest, epoch);
+        }
+    }
+    size_t kept = 0;
+    for (const auto &page: retired) {
+        if (page.first >= oldest) {
+            retired[kept++] = page;
+        } else if (page.second != 1) {
+            freeNode(page.second);
+        }
+    }
+    retired.resize(kept);
+}
+
+int BTreeIndex::insertVersioned(int RecordID, int Reference) {
+    lock_guard<mutex> guard(versionLatch);
+    vector<BTreeNode> path;
+    vector<int> slots;
+    BTreeNode node;
+    readNode(rootPlace.load(), node);
+    while (node.isLeaf == 1) {
+        int slot = min(childSlot(node, RecordID), node.count - 1);
+        int child = node.node[slot].second;
+        slots.push_back(slot);
+        path.push_back(move(node));
+        readNode(child, node);
+    }
+    if (findEntry(node, RecordID) != -1) {
+        return -1;
+    }
+    if (!reserveVersioned((int) path.size() + 1)) {
+        return -3;
+    }
+    logOperation(WriteAheadLog::Insert, RecordID, Reference);
+
+    // copy the leaf with the new entry, then each parent with the new places of its child, splitting any
+    // node that overflows; nothing the current root reaches is written
+    vector<int> replaced{node.place};
+    insertEntry(node, make_pair(RecordID, Reference));
+    vector<BTreeNode> copies;
+    writeCopies(node, copies);
+    int insertedAt = findEntry(copies[0], RecordID) != -1 ? copies[0].place : copies.back().place;
+    while (!path.empty()) {
+        BTreeNode parent = move(path.back());
+        path.pop_back();
+        int slot = slots.back();
+        slots.pop_back();
+        replaced.push_back(parent.place);
+        parent.node[slot] = make_pair(copies[0].node[copies[0].count - 1].first, copies[0].place);
+        if (copies.size() == 2) {
+            insertEntry(parent, make_pair(copies[1].node[copies[1].count - 1].first, copies[1].place));
+        }
+        writeCopies(parent, copies);
+    }
+    if (copies.size() == 2) {
+        metrics.add(Metrics::RootSplits);
+        BTreeNode root = emptyNode(allocateNode(), 1);
+        setEntries(root, {make_pair(copies[0].node[copies[0].count - 1].first, copies[0].place),
+                          make_pair(copies[1].node[copies[1].count - 1].first, copies[1].place)});
+        writeNode(root.place, root);
+        copies.assign(1, move(root));
+    }
+    publish(copies[0].place, replaced);
+    return insertedAt;
+}
+
+int BTreeIndex::deleteVersioned(int RecordID) {
+    // -1 if RecordID is not there, -3 if the file has to grow first, 0 once it is gone
+    lock_guard<mutex> guard(versionLatch);
+    vector<BTreeNode> path;
+    vector<int> slots;
+    BTreeNode node;
+    readNode(rootPlace.load(), node);
+    while (node.isLeaf == 1) {
+        int slot = childSlot(node, RecordID);
+        if (slot == node.count) {
+            return -1;
+        }
+        slots.push_back(slot);
+        int child = node.node[slot].second;
+        path.push_back(move(node));
+        readNode(child, node);
+    }
+    if (findEntry(node, RecordID) == -1) {
+        return -1;
+    }
+    if (!reserveVersioned((int) path.size() + 1)) {
+        return -3;
+    }
+    logOperation(WriteAheadLog::Delete, RecordID, -1);
+
+    // on the way up, a child left below the minimum takes a sibling's entries in with its own: together
+    // they make one new node, or two even halves when they do not fit one
+    vector<int> replaced{node.place};
+    removeEntry(node, RecordID);
+    BTreeNode child = move(node);
+    vector<BTreeNode> copies;
+    while (!path.empty()) {
+        BTreeNode parent = move(path.back());
+        path.pop_back();
+        int at = slots.back();
+        slots.pop_back();
+        replaced.push_back(parent.place);
+        if (child.count < minimumEntries() && parent.count > 1) {
+            int left = at > 0 ? at - 1 : at;
+            BTreeNode sibling = readNode(parent.node[left == at ? at + 1 : left].second);
+            replaced.push_back(sibling.place);
+            BTreeNode &first = left == at ? child : sibling, &second = left == at ? sibling : child;
+            mergeInto(first, second);
+            metrics.add(first.count <= m ? Metrics::Merges : Metrics::Borrows);
+            writeCopies(first, copies);
+            removeAt(parent, left + 1);
+            removeAt(parent, left);
+        } else {
+            writeCopies(child, copies);
+            removeAt(parent, at);
+        }
+        for (const BTreeNode &copy: copies) {
+            if (copy.count > 0) {
+                insertEntry(parent, make_pair(copy.node[copy.count - 1].first, copy.place));
+            } else {
+                replaced.push_back(copy.place); // an emptied child drops out of its parent
+            }
+        }
+        child = move(parent);
+    }
+    // a root left with a single child hands the root over to it
+    while (child.isLeaf == 1 && child.count == 1) {
+        int only = child.node[0].second;
+        replaced.push_back(only);
+        readNode(only, child);
+    }
+    writeCopies(child, copies);
+    publish(copies[0].place, replaced);
+    return 0;
+}
+
+bool BTreeIndex::normalizeTree(int root) {
+    // puts a tree left by copy-on-write mode back in the normal layout: the root at place 1, the leaves
+    // linked in key order and every page no node uses on the free list. Callers run it alone.
+    vector<char> live(numberOfRecords, 0);
+    vector<int> level{root}, leaves;
+    if (root <= 0 || root >= numberOfRecords) {
+        return false;
+    }
+    live[root] = 1;
+    while (!level.empty()) {
+        vector<int> below;
+        for (int place: level) {
+            BTreeNode node = readNode(place);
+            if (node.isLeaf != 1) {
+                leaves.push_back(place);
+                continue;
+            }
+            for (int i = 0; i < node.count; ++i) {
+                int child = node.node[i].second;
+                if (child <= 0 || child >= numberOfRecords || live[child]) {
+                    return false;
+                }
+                live[child] = 1;
+                below.push_back(child);
+            }
+        }
+        level.swap(below);
+    }
+    for (size_t i = 0; i < leaves.size(); ++i) {
+        BTreeNode leaf = readNode(leaves[i]);
+        leaf.next = i + 1 < leaves.size() ? leaves[i + 1] : -1;
+        writeNode(leaves[i], leaf);
+    }
+    if (root != 1) {
+        BTreeNode top = readNode(root);
+        top.place = 1;
+        writeNode(1, top);
+        live[root] = 0;
+        live[1] = 1;
+    }
+    if (readNode(1).count == 0) {
+        live[1] = 0; // an empty tree keeps its root on the free list
+    }
+    lock_guard<mutex> guard(allocatorLatch);
+    head = -1;
+    for (int place = numberOfRecords - 1; place > 0; --place) {
+        if (!live[place]) {
+            BTreeNode freed = emptyNode(place, -1);
+            freed.node[0].first = head;
+            writeNode(place, freed);
+            head = place;
+        }
+    }
+    savedRoot = -1;
+    writeHeaderPage();
+    return true;
+}
+
+/////////////////////////////////////Batched writes///////////////////////////////////////////////
+
+int BTreeIndex::ApplyBatch(const vector<BatchOp> &ops) {
+    Metrics::Timer timer(metrics, Metrics::ApplyBatch);
+    if (ops.size() > MaxBatchOps) {
+        return -1;
+    }
+    // a stable sort keeps the ops on one RecordID in order, so they fold into the one op they add up to
+    vector<BatchOp> sorted(ops);
+    stable_sort(sorted.begin(), sorted.end(),
+                [](const BatchOp &a, const BatchOp &b) { return a.RecordID < b.RecordID; });
+    size_t kept = 0;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        if (kept > 0 && sorted[kept - 1].RecordID == sorted[i].RecordID) {
+            sorted[kept - 1] = composeOps(sorted[kept - 1], sorted[i]);
+        } else {
+            sorted[kept++] = sorted[i];
+        }
+    }
+    sorted.resize(kept);
+    int changed;
+    bool durable;
+    {
+        // a batch may move entries anywhere in the tree, so it runs alone; versioned readers go on meanwhile
+        shared_lock<shared_mutex> frozen(snapshotGate);
+        unique_lock<shared_mutex> tree(treeLatch);
+        if (readOnly || !isOpen()) {
+            return -1;
+        }
+        unique_lock<mutex> serial(versionLatch, defer_lock);
+        if (copyOnWrite) {
+            serial.lock();
+        }
+        changed = applyBatchLocked(sorted.data(), sorted.data() + sorted.size(), true);
+        if (buffered && changed != -1) {
+            changed = (int) sorted.size();
+        }
+        if (wal.isOpen()) {
+            durable = wal.commit();
+        } else {
+            durable = arena.active() || (bufferPool.flush() && fsync(BTreeFile) == 0);
+        }
+    }
+    afterOperation();
+    return durable ? changed : -1;
+}
+
+int BTreeIndex::applyBatchLocked(const BatchOp *first, const BatchOp *last, bool log, bool drain) {
+    // callers hold treeLatch exclusively, and versionLatch in copy-on-write mode. A drain empties every
+    // buffer, also those a crash left behind while the mode is off
+    BatchState state;
+    state.versioned = copyOnWrite;
+    state.buffered = buffered || drain;
+    state.drain = drain;
+    if (first == last && !drain) {
+        return 0;
+    }
+    bool upserts = any_of(first, last, [](const BatchOp &op) { return op.type != BatchOp::Delete; });
+    if (!state.versioned && isEmpty(1)) {
+        // an empty tree keeps its root on the free list, so take it back first
+        lock_guard<mutex> guard(allocatorLatch);
+        if (!upserts || !takeFreeNode(1)) {
+            return 0;
+        }
+        writeNode(1, emptyNode(1, 0));
+    }
+    int root = state.versioned ? rootPlace.load() : 1;
+
+    // every node the batch may need is found before anything changes, so a batch is never half applied
+    int needed = 0;
+    int parts = planBatch(root, first, last, state, needed);
+    needed += parts > 1 && !state.versioned ? 1 : 0; // the root's first part moves off place 1
+    for (int level = parts; level > 1; level = (level + m - 1) / m) {
+        needed += (level + m - 1) / m;
+    }
+    while (!reserveNodes(needed)) {
+        if (state.versioned) {
+            reclaimVersions();
+            if (reserveNodes(needed)) {
+                break;
+            }
+        }
+        if (!growFile()) {
+            if (!state.versioned && readNode(1).count == 0) {
+                freeNode(1);
+            }
+            return -1;
+        }
+    }
+    if (log && wal.isOpen()) {
+        vector<int32_t> payload;
+        payload.reserve(3 * (last - first));
+        for (const BatchOp *op = first; op != last; ++op) {
+            payload.insert(payload.end(), {(int32_t) op->type, op->RecordID, op->Reference});
+        }
+        wal.append(WriteAheadLog::Batch, payload.data(), (int) payload.size());
+    }
+    vector<BTreeNode> level;
+    applyBatchTo(root, first, last, state, level);
+
+    // the parts of the old root get as many levels above them as they need, and the root ends up at
+    // place 1 unless the tree is versioned
+    while (level.size() > 1) {
+        metrics.add(Metrics::RootSplits);
+        vector<pair<int, int>> entries;
+        for (BTreeNode &node: level) {
+            if ((node.place == 1 || node.place == -1) && !state.versioned) {
+                node.place = batchPlace(state);
+            }
+            writeBatchNode(node, state);
+            entries.emplace_back(node.node[node.count - 1].first, node.place);
+        }
+        BTreeNode above = emptyNode(-1, 1);
+        level.clear();
+        spreadEntries(above, entries, state, level);
+    }
+    BTreeNode top = move(level[0]);
+    bool written = false;
+    while (top.isLeaf == 1 && top.count == 1) {
+        // a root left with one child hands the root over to it
+        int only = top.node[0].second;
+        if (top.place != -1 && top.place != 1) {
+            state.released.push_back(top.place);
+        }
+        readNode(only, top);
+        written = true;
+    }
+    if (top.count == 0 && top.isLeaf == 1) {
+        top = emptyNode(top.place, 0);
+    }
+    if (state.versioned) {
+        if (!written) {
+            writeBatchNode(top, state);
+        }
+        publish(top.place, state.released);
+        return state.changed;
+    }
+    if (top.place != 1) {
+        if (top.place != -1) {
+            state.released.push_back(top.place);
+        }
+        top.place = 1;
+    } else if (state.unchanged.count(1)) {
+        top.place = -1; // nothing to write
+    }
+    if (top.place == 1) {
+        writeNode(1, top);
+    }
+    if (top.count == 0) {
+        state.released.push_back(1); // an empty tree keeps its root on the free list
+    }
+    for (int place: state.released) {
+        freeNode(place);
+    }
+    lock_guard<mutex> guard(allocatorLatch);
+    reservedNodes = 0;
+    return state.changed;
+}
+
+int BTreeIndex::planBatch(int place, const BatchOp *first, const BatchOp *last, const BatchState &state,
+                          int &needed) {
+    // returns how many nodes the subtree at place becomes before underfull ones are combined, and adds
+    // the places that takes to needed; combining needs no new place except to copy a sibling when versioned,
+    // or to split the buffers of two siblings that share their entries
+    BTreeNode node = readNode(place);
+    int entries = node.count;
+    vector<BatchOp> messages;
+    vector<int> pages;
+    if (node.isLeaf == 0) {
+        vector<pair<int, int>> merged;
+        mergeBatch(node, first, last, merged);
+        entries = (int) merged.size();
+    } else if (state.buffered && takeMessages(node, first, last, state, messages, pages)) {
+        needed += max(0, ((int) messages.size() + messagesPerPage() - 1) / messagesPerPage() - (int) pages.size());
+        return 1;
+    } else {
+        if (state.buffered) {
+            first = messages.data();
+            last = first + messages.size();
+        }
+        // a drain also visits the internal children no op reaches, as they may hold buffers
+        bool deeper = state.drain && node.count > 0 && !isLeaf(node.node[0].second);
+        const BatchOp *from = first;
+        for (int i = 0; i < node.count && (from != last || deeper); ++i) {
+            const BatchOp *to = i + 1 < node.count ? upper_bound(from, last, node.node[i].first,
+                    [](int key, const BatchOp &op) { return key < op.RecordID; }) : last;
+            if (from != to || deeper) {
+                entries += planBatch(node.node[i].second, from, to, state, needed) - 1;
+                needed += state.versioned || state.buffered ? 1 : 0;
+            }
+            from = to;
+        }
+    }
+    int parts = max(1, (entries + m - 1) / m);
+    needed += state.versioned ? parts : parts - 1;
+    return parts;
+}
+
+void BTreeIndex::applyBatchTo(int place, const BatchOp *first, const BatchOp *last, BatchState &state,
+                              vector<BTreeNode> &out) {
+    // out gets the nodes the subtree at place turns into, in key order and not yet written
+    BTreeNode node = readNode(place);
+    vector<pair<int, int>> entries;
+    vector<BatchOp> messages;
+    vector<int> pages;
+    bool emptied = false;
+    if (node.isLeaf == 0) {
+        state.changed += mergeBatch(node, first, last, entries);
+    } else if (state.buffered && takeMessages(node, first, last, state, messages, pages)) {
+        // the ops stay in the node's buffer, and its subtree is finished as it is
+        int chain = node.next;
+        writeBuffer(node, messages, pages, state);
+        state.released.insert(state.released.end(), pages.begin(), pages.end());
+        if (node.next == chain) {
+            state.unchanged.insert(node.place);
+        }
+        state.before = node.place;
+        messagesPending = true;
+        out.push_back(move(node));
+        return;
+    } else {
+        if (state.buffered) {
+            // the buffer goes down together with the ops, so the node is reshaped with an empty one
+            metrics.add(Metrics::BufferFlushes);
+            state.released.insert(state.released.end(), pages.begin(), pages.end());
+            emptied = node.next != -1;
+            node.next = -1;
+            first = messages.data();
+            last = first + messages.size();
+        }
+        // children the ops do not reach keep their entries; the others are replaced by what they became.
+        // A drain also visits the internal children no op reaches, as they may hold buffers
+        bool deeper = state.drain && node.count > 0 && !isLeaf(node.node[0].second);
+        vector<BTreeNode> kids;
+        const BatchOp *from = first;
+        for (int i = 0; i < node.count; ++i) {
+            const BatchOp *to = i + 1 < node.count ? upper_bound(from, last, node.node[i].first,
+                    [](int key, const BatchOp &op) { return key < op.RecordID; }) : last;
+            if (from == to && !deeper) {
+                entries.push_back(node.node[i]);
+                kids.emplace_back();
+                kids.back().place = -1;
+                state.before = node.node[i].second;
+                continue;
+            }
+            vector<BTreeNode> parts;
+            applyBatchTo(node.node[i].second, from, to, state, parts);
+            for (BTreeNode &part: parts) {
+                entries.emplace_back(part.count > 0 ? part.node[part.count - 1].first : node.node[i].first,
+                                     part.place);
+                kids.push_back(move(part));
+            }
+            from = to;
+        }
+        combineUnderfull(entries, kids, state);
+        if (!entries.empty()) {
+            state.before = entries.back().second;
+        }
+    }
+    spreadEntries(node, entries, state, out);
+    if (emptied) {
+        state.unchanged.erase(node.place); // its buffer link at least is gone
+    }
+}
+
+int BTreeIndex::mergeBatch(const BTreeNode &leaf, const BatchOp *first, const BatchOp *last,
+                           vector<pair<int, int>> &entries) const {
+    // both runs are sorted, so the leaf and its ops are merged in one pass; returns the records changed
+    int changed = 0;
+    int i = 0;
+    entries.clear();
+    entries.reserve(leaf.count + (last - first));
+    for (const BatchOp *op = first; op != last; ++op) {
+        while (i < leaf.count && leaf.node[i].first < op->RecordID) {
+            entries.push_back(leaf.node[i++]);
+        }
+        bool found = i < leaf.count && leaf.node[i].first == op->RecordID;
+        if (op->type == BatchOp::Upsert) {
+            changed += !found || leaf.node[i].second != op->Reference ? 1 : 0;
+            entries.emplace_back(op->RecordID, op->Reference);
+        } else if (op->type == BatchOp::Insert) {
+            changed += found ? 0 : 1;
+            entries.push_back(found ? leaf.node[i] : make_pair(op->RecordID, op->Reference));
+        } else {
+            changed += found ? 1 : 0;
+        }
+        i += found ? 1 : 0;
+    }
+    entries.insert(entries.end(), leaf.node.begin() + i, leaf.node.begin() + leaf.count);
+    return changed;
+}
+
+void BTreeIndex::spreadEntries(BTreeNode &node, const vector<pair<int, int>> &entries, BatchState &state,
+                               vector<BTreeNode> &out) {
+    // the entries are shared evenly by as few nodes as hold them; the first keeps the node's place and
+    // a leaf's parts are chained in front of its old next leaf
+    int parts = max(1, ((int) entries.size() + m - 1) / m);
+    if (parts > 1) {
+        metrics.add(Metrics::Splits, parts - 1);
+    } else if (node.place != -1 && node.count == (int) entries.size() &&
+               equal(entries.begin(), entries.end(), node.node.begin())) {
+        state.unchanged.insert(node.place);
+    }
+    size_t begin = 0;
+    for (int k = 0; k < parts; ++k) {
+        size_t end = entries.size() * (k + 1) / parts;
+        BTreeNode part = emptyNode(k == 0 ? node.place : batchPlace(state), node.isLeaf);
+        setEntries(part, vector<pair<int, int>>(entries.begin() + begin, entries.begin() + end));
+        if (k > 0 && node.isLeaf == 0) {
+            out.back().next = part.place;
+        }
+        out.push_back(move(part));
+        begin = end;
+    }
+    if (node.isLeaf == 0) {
+        out.back().next = node.next;
+    }
+}
+
+void BTreeIndex::combineUnderfull(vector<pair<int, int>> &children, vector<BTreeNode> &kids, BatchState &state) {
+    // kids[i] is the child at children[i], or has place -1 if the batch left it alone. A changed child
+    // below the minimum takes in its right sibling, or its left one if it is the last child: the two
+    // become one node, or two even halves if they do not fit one. The changed children are then written.
+    size_t i = 0;
+    while (i < kids.size()) {
+        if (kids[i].place == -1 || kids[i].count >= minimumEntries() || kids.size() == 1) {
+            i++;
+            continue;
+        }
+        size_t left = i + 1 < kids.size() ? i : i - 1;
+        for (size_t j: {left, left + 1}) {
+            if (kids[j].place == -1) {
+                readNode(children[j].second, kids[j]);
+            }
+        }
+        BTreeNode &first = kids[left], &second = kids[left + 1];
+        state.unchanged.erase(first.place);
+        state.unchanged.erase(second.place);
+        // buffered internal siblings take their buffers along
+        bool buffers = state.buffered && first.isLeaf == 1 && (first.next != -1 || second.next != -1);
+        int firstChain = first.next, secondChain = second.next;
+        if (first.count + second.count <= m) {
+            metrics.add(Metrics::Merges);
+            mergeInto(first, second);
+            if (buffers) {
+                shareBuffers(first, second, firstChain, secondChain, true, state);
+            }
+            state.released.push_back(second.place);
+            kids.erase(kids.begin() + left + 1);
+            children.erase(children.begin() + left + 1);
+            combineBelow(first, state);
+        } else {
+            metrics.add(Metrics::Borrows);
+            vector<pair<int, int>> entries(first.node.begin(), first.node.begin() + first.count);
+            entries.insert(entries.end(), second.node.begin(), second.node.begin() + second.count);
+            vector<pair<int, int>> firstHalf, secondHalf;
+            tie(firstHalf, secondHalf) = splitOriginalNode(entries);
+            setEntries(first, firstHalf);
+            setEntries(second, secondHalf);
+            if (buffers) {
+                shareBuffers(first, second, firstChain, secondChain, false, state);
+            }
+            combineBelow(first, state);
+            combineBelow(second, state);
+        }
+        i = left;
+    }
+    if (kids.size() == 1 && kids[0].place != -1 && kids[0].count == 0) {
+        // nothing is left under the parent
+        if (kids[0].isLeaf == 0 && !state.versioned) {
+            unlinkLeaf(kids[0], state);
+        }
+        state.released.push_back(kids[0].place);
+        kids.clear();
+        children.clear();
+    }
+    for (size_t k = 0; k < kids.size(); ++k) {
+        if (kids[k].place != -1) {
+            writeBatchNode(kids[k], state);
+            children[k] = make_pair(kids[k].node[kids[k].count - 1].first, kids[k].place);
+        }
+    }
+    if (kids.size() == 1 && kids[0].place != -1 && kids[0].count < minimumEntries()) {
+        // it has no sibling here; the parent is now below the minimum too, and once that is combined
+        // with a sibling, combineBelow finds this child a sibling of its own
+        state.underfull.push_back(kids[0].place);
+    }
+}
+
+void BTreeIndex::combineBelow(BTreeNode &node, BatchState &state) {
+    // an internal node that was just combined may have taken in a child left below the minimum further down
+    if (node.isLeaf != 1) {
+        return;
+    }
+    vector<pair<int, int>> children(node.node.begin(), node.node.begin() + node.count);
+    vector<BTreeNode> kids(children.size());
+    bool found = false;
+    for (size_t k = 0; k < children.size(); ++k) {
+        kids[k].place = -1;
+        auto underfull = find(state.underfull.begin(), state.underfull.end(), children[k].second);
+        if (underfull != state.underfull.end()) {
+            state.underfull.erase(underfull);
+            readNode(children[k].second, kids[k]);
+            found = true;
+        }
+    }
+    if (found) {
+        combineUnderfull(children, kids, state);
+        setEntries(node, children);
+    }
+}
+
+int BTreeIndex::batchPlace(BatchState &state) {
+    int place = allocateNode();
+    if (place != -1) {
+        state.fresh.insert(place);
+    }
+    return place;
+}
+
+void BTreeIndex::writeBatchNode(BTreeNode &node, BatchState &state) {
+    // in copy-on-write mode a place the current version can reach is left as it is and replaced
+    if (node.place != -1 && state.unchanged.count(node.place)) {
+        return;
+    }
+    if (state.versioned && (node.place == -1 || !state.fresh.count(node.place))) {
+        if (node.place != -1) {
+            state.released.push_back(node.place);
+        }
+        node.place = batchPlace(state);
+    }
+    writeNode(node.place, node);
+}
+
+void BTreeIndex::unlinkLeaf(const BTreeNode &leaf, const BatchState &state) {
+    // the leaf before a dropped one is the last leaf of the subtree finished just before it
+    if (state.before == -1) {
+        return;
+    }
+    BTreeNode previous = readNode(state.before);
+    while (previous.isLeaf == 1 && previous.count > 0) {
+        readNode(previous.node[previous.count - 1].second, previous);
+    }
+    if (previous.isLeaf == 0 && previous.next == leaf.place) {
+        previous.next = leaf.next;
+        writeNode(previous.place, previous);
+    }
+}
+
+BTreeIndex::BatchOp BTreeIndex::composeOps(const BatchOp &older, const BatchOp &newer) {
+    // the one op that does what older and then newer do
+    if (newer.type != BatchOp::Insert) {
+        return newer;
+    }
+    if (older.type == BatchOp::Delete) {
+        return {BatchOp::Upsert, newer.RecordID, newer.Reference};
+    }
+    return older;
+}
+
+/////////////////////////////////////Buffered inserts/////////////////////////////////////////////
+
+bool BTreeIndex::EnableBufferedInserts(int bufferPages) {
+    shared_lock<shared_mutex> frozen(snapshotGate);
+    unique_lock<shared_mutex> tree(treeLatch);
+    if (readOnly || !isOpen() || copyOnWrite || bufferPages < 1) {
+        return false;
+    }
+    this->bufferPages = bufferPages;
+    buffered = true;
+    writeHeaderPage();
+    return true;
+}
+
+bool BTreeIndex::DisableBufferedInserts() {
+    shared_lock<shared_mutex> frozen(snapshotGate);
+    unique_lock<shared_mutex> tree(treeLatch);
+    if (!buffered || readOnly) {
+        return !readOnly;
+    }
+    buffered = false;
+    if (!drainBuffers()) {
+        buffered = true;
+        return false;
+    }
+    return true;
+}
+
+int BTreeIndex::changeBuffered(const BatchOp &op) {
+    // -2 if the mode ended before the latch was taken, so the change goes the usual way
+    shared_lock<shared_mutex> frozen(snapshotGate);
+    unique_lock<shared_mutex> tree(treeLatch);
+    if (readOnly || !isOpen()) {
+        return -1;
+    }
+    if (!buffered) {
+        return -2;
+    }
+    return applyBatchLocked(&op, &op + 1, true);
+}
+
+int BTreeIndex::searchBuffered(int RecordID) {
+    // callers hold treeLatch shared, and buffered changes hold it exclusively. The messages met on the
+    // way down are newer the higher they are, so they are applied to the leaf's entry deepest first.
+    vector<BatchOp> path;
+    bool present = false;
+    int reference = -1;
+    for (int place = 1; record_valid(place);) {
+        const int32_t *page = readPage(place);
+        if (page == nullptr)
+            break;
+        int isLeaf = page[0], count = page[1];
+        int slot = lowerBound(page, RecordID);
+        if (isLeaf != 1) {
+            present = isLeaf == 0 && slot < count && pageKeys(page)[slot] == RecordID;
+            reference = present ? pageRefs(page)[slot] : -1;
+            releasePage(place);
+            break;
+        }
+        // like the batch walk, the last child also takes the RecordIDs above every separator
+        int chain = page[2 + 2 * m];
+        int child = count > 0 ? pageRefs(page)[min(slot, count - 1)] : -1;
+        releasePage(place);
+        while (chain != -1) {
+            const int32_t *buffer = readPage(chain);
+            if (buffer == nullptr)
+                break;
+            int held = buffer[1], low = 0, high = held;
+            while (low < high) {
+                int middle = (low + high) / 2;
+                if (buffer[3 + 3 * middle] < RecordID)
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+            bool found = low < held && buffer[3 + 3 * low] == RecordID;
+            if (found)
+                path.push_back({(BatchOp::Type) buffer[2 + 3 * low], RecordID, buffer[4 + 3 * low]});
+            // the chain is sorted, so it is left once a page ends at or past RecordID
+            int next = !found && low == held ? buffer[2 + 2 * m] : -1;
+            releasePage(chain);
+            chain = next;
+        }
+        place = child;
+    }
+    for (auto op = path.rbegin(); op != path.rend(); ++op) {
+        if (op->type == BatchOp::Delete) {
+            present = false;
+            reference = -1;
+        } else if (op->type == BatchOp::Upsert || !present) {
+            present = true;
+            reference = op->Reference;
+        }
+    }
+    return reference;
+}
+
+bool BTreeIndex::drainBuffers() {
+    // callers hold treeLatch exclusively. Once the mode is off, the header stops asking for a drain
+    if (applyBatchLocked(nullptr, nullptr, false, true) == -1) {
+        return false;
+    }
+    messagesPending = false;
+    if (!buffered) {
+        savedBuffers = -1;
+        writeHeaderPage();
+    }
+    return true;
+}
+
+void BTreeIndex::readBuffer(int chain, vector<BatchOp> &messages, vector<int> &pages) {
+    // appends the messages and the pages of the chain
+    while (chain != -1) {
+        const int32_t *page = readPage(chain);
+        if (page == nullptr) {
+            return;
+        }
+        for (int i = 0; i < page[1]; ++i) {
+            const int32_t *message = page + 2 + 3 * i;
+            messages.push_back({(BatchOp::Type) message[0], message[1], message[2]});
+        }
+        pages.push_back(chain);
+        int next = page[2 + 2 * m];
+        releasePage(chain);
+        chain = next;
+    }
+}
+
+void BTreeIndex::writeBuffer(BTreeNode &node, const vector<BatchOp> &messages, vector<int> &pages,
+                             BatchState &state) {
+    // the chain takes its pages from the front of pages, in order, so a buffer that keeps its page count
+    // keeps its head; new places are taken only once pages runs out. A page that would come out as it
+    // is, usually one before the first new message, is not written
+    int perPage = messagesPerPage();
+    vector<int> chain((messages.size() + perPage - 1) / perPage);
+    size_t used = min(chain.size(), pages.size());
+    copy(pages.begin(), pages.begin() + used, chain.begin());
+    pages.erase(pages.begin(), pages.begin() + used);
+    for (size_t k = used; k < chain.size(); ++k) {
+        chain[k] = batchPlace(state);
+    }
+    for (size_t k = 0; k < chain.size(); ++k) {
+        int32_t *page = pinPage(chain[k], false);
+        if (page == nullptr) {
+            continue;
+        }
+        size_t begin = k * perPage, end = min(messages.size(), begin + perPage);
+        int link = k + 1 < chain.size() ? chain[k + 1] : -1;
+        if (k < used && sameMessages(page, messages.data() + begin, (int) (end - begin), link)) {
+            releasePage(chain[k]);
+            continue;
+        }
+        fill(page, page + pageSize / sizeof(int32_t), -1);
+        page[0] = BufferPage;
+        page[1] = (int) (end - begin);
+        for (size_t i = begin; i < end; ++i) {
+            int32_t *message = page + 2 + 3 * (i - begin);
+            message[0] = messages[i].type;
+            message[1] = messages[i].RecordID;
+            message[2] = messages[i].Reference;
+        }
+        page[2 + 2 * m] = link;
+        releasePage(chain[k], true);
+    }
+    node.next = chain.empty() ? -1 : chain[0];
+}
+
+bool BTreeIndex::sameMessages(const int32_t *page, const BatchOp *messages, int count, int link) const {
+    if (page[0] != BufferPage || page[1] != count || page[2 + 2 * m] != link) {
+        return false;
+    }
+    for (int i = 0; i < count; ++i) {
+        const int32_t *message = page + 2 + 3 * i;
+        if (message[0] != messages[i].type || message[1] != messages[i].RecordID ||
+            message[2] != messages[i].Reference) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BTreeIndex::takeMessages(const BTreeNode &node, const BatchOp *first, const BatchOp *last,
+                              const BatchState &state, vector<BatchOp> &messages, vector<int> &pages) {
+    // messages gets the node's buffer with the ops, which are newer, folded in, and pages its chain;
+    // true if they all stay in the buffer
+    vector<BatchOp> held;
+    held.reserve((size_t) bufferPages * messagesPerPage());
+    readBuffer(node.next, held, pages);
+    messages.clear();
+    messages.reserve(held.size() + (last - first));
+    size_t i = 0;
+    for (const BatchOp *op = first; op != last; ++op) {
+        while (i < held.size() && held[i].RecordID < op->RecordID) {
+            messages.push_back(held[i++]);
+        }
+        bool found = i < held.size() && held[i].RecordID == op->RecordID;
+        messages.push_back(found ? composeOps(held[i++], *op) : *op);
+    }
+    messages.insert(messages.end(), held.begin() + i, held.end());
+    return !state.drain && messages.size() <= (size_t) bufferPages * messagesPerPage();
+}
+
+void BTreeIndex::shareBuffers(BTreeNode &first, BTreeNode &second, int firstChain, int secondChain, bool merged,
+                              BatchState &state) {
+    // the two buffers hold RecordIDs on either side of the old boundary, so together they stay sorted and
+    // are cut again at the new one
+    vector<BatchOp> messages;
+    vector<int> pages;
+    readBuffer(firstChain, messages, pages);
+    readBuffer(secondChain, messages, pages);
+    if (merged) {
+        writeBuffer(first, messages, pages, state);
+    } else {
+        auto cut = upper_bound(messages.begin(), messages.end(), first.node[first.count - 1].first,
+                               [](int key, const BatchOp &op) { return key < op.RecordID; });
+        writeBuffer(first, vector<BatchOp>(messages.begin(), cut), pages, state);
+        writeBuffer(second, vector<BatchOp>(cut, messages.end()), pages, state);
+    }
+    state.released.insert(state.released.end(), pages.begin(), pages.end());
+}
+
+/////////////////////////////////////Write-ahead log/////////////////////////////////////////////
+
+bool BTreeIndex::EnableWriteAheadLog(size_t groupRecords, int groupMillis) {
+    unique_lock<shared_mutex> tree(treeLatch);
+    wal.configure(groupRecords, groupMillis);
+    walEnabled = true;
+    return BTreeFile == -1 || readOnly || wal.isOpen() || (bufferPool.flush() && fsync(BTreeFile) == 0 && attachLog());
+}
+
+void BTreeIndex::DisableWriteAheadLog() {
+    unique_lock<shared_mutex> tree(treeLatch);
+    walEnabled = false;
+    if (wal.isOpen()) {
+        checkpointLocked();
+        wal.close();
+        bufferPool.setNoSteal(false);
+    }
+}
+
+bool BTreeIndex::Commit() {
+    return wal.commit();
+}
+
+bool BTreeIndex::Checkpoint() {
+    unique_lock<shared_mutex> tree(treeLatch);
+    return checkpointLocked();
+}
+
+bool BTreeIndex::checkpointLocked() {
+    if (!wal.isOpen()) {
+        return bufferPool.flush();
+    }
+    // 1. images of every changed page go to the log, closed by an end marker, and are made durable
+    // 2. only then are the pages written in place and the index file synced
+    // 3. the log can then be emptied
+    // A crash before the end marker is durable leaves the index file as of the last checkpoint; a crash
+    // after it is repaired by copying the images in again, so a half-written index is never trusted.
+    if (!wal.commit()) {
+        return false;
+    }
+    vector<int32_t> image;
+    bool ok = true;
+    bufferPool.forEachDirty([&](int place, const int32_t *page) {
+        image.assign(1, place);
+        image.insert(image.end(), page, page + pageSize / sizeof(int32_t));
+        ok = wal.append(WriteAheadLog::PageImage, image.data(), image.size()) && ok;
+    });
+    ok = ok && wal.append(WriteAheadLog::CheckpointEnd, nullptr, 0) && wal.commit();
+    ok = ok && bufferPool.flush() && fsync(BTreeFile) == 0;
+    return ok && wal.truncate();
+}
+
+WriteAheadLog::Stats BTreeIndex::LogStats() const {
+    return wal.stats();
+}
+
+BTreeIndex::IndexMetrics BTreeIndex::GetMetrics(bool scanLevels) {
+    IndexMetrics result;
+    result.operations = metrics.snapshot();
+    result.buffer = bufferPool.stats();
+    result.log = wal.stats();
+    shared_lock<shared_mutex> tree(treeLatch);
+    if (!isOpen() && mapping.load() == nullptr) {
+        return result;
+    }
+    // nodes are latched one at a time, so a level total may straddle an insert that runs meanwhile
+    shared_ptr<const Version> version = copyOnWrite ? openVersion() : nullptr;
+    int root = version != nullptr ? version->root : 1;
+    vector<int> level;
+    if (!isEmpty(root)) {
+        level.push_back(root);
+    }
+    while (!level.empty()) {
+        result.height++;
+        vector<int> below;
+        LevelStats stats;
+        for (int place: level) {
+            if (!scanLevels && place != level.front()) {
+                break;
+            }
+            latchShared(place);
+            const int32_t *page = readPage(place);
+            if (page != nullptr) {
+                stats.nodes++;
+                stats.entries += page[1];
+                if (page[0] == 1) {
+                    below.insert(below.end(), pageRefs(page), pageRefs(page) + (scanLevels ? page[1] : 1));
+                }
+                releasePage(place);
+            }
+            unlatchShared(place);
+        }
+        if (scanLevels) {
+            stats.fill = stats.nodes > 0 ? double(stats.entries) / (double(stats.nodes) * m) : 0;
+            result.levels.push_back(stats);
+        }
+        level.swap(below);
+    }
+    return result;
+}
+
+bool BTreeIndex::WriteMetrics(const char *filename, bool scanLevels) {
+    // Prometheus text exposition format, written next to the target and renamed over it, so a
+    // collector reading the file never sees half of it
+    IndexMetrics current = GetMetrics(scanLevels);
+    ostringstream out;
+    auto metric = [&out](const string &name, const char *type, const char *help) {
+        out << "# HELP btree_" << name << " " << help << "\n# TYPE btree_" << name << " " << type << "\n";
+    };
+    static const char *help[] = {"Node pages read.", "Node pages written.", "Non-root node splits.",
+                                 "Root splits.", "Entries borrowed from a sibling on delete.",
+                                 "Nodes merged into a sibling on delete.", "Extents appended to the file.",
+                                 "Node buffers pushed down to their children."};
+    for (int c = 0; c < Metrics::CounterCount; ++c) {
+        string name = string(Metrics::name((Metrics::Counter) c)) + "_total";
+        metric(name, "counter", help[c]);
+        out << "btree_" << name << " " << current.operations.counters[c] << "\n";
+    }
+    metric("buffer_hits_total", "counter", "Buffer pool hits.");
+    out << "btree_buffer_hits_total " << current.buffer.hits << "\n";
+    metric("buffer_misses_total", "counter", "Buffer pool misses.");
+    out << "btree_buffer_misses_total " << current.buffer.misses << "\n";
+    metric("buffer_evictions_total", "counter", "Buffer pool evictions.");
+    out << "btree_buffer_evictions_total " << current.buffer.evictions << "\n";
+    metric("buffer_write_backs_total", "counter", "Dirty pages written back by the buffer pool.");
+    out << "btree_buffer_write_backs_total " << current.buffer.writeBacks << "\n";
+    metric("log_commits_total", "counter", "Write-ahead log group commits.");
+    out << "btree_log_commits_total " << current.log.commits << "\n";
+    metric("log_bytes_total", "counter", "Bytes synced to the write-ahead log.");
+    out << "btree_log_bytes_total " << current.log.bytes << "\n";
+    metric("tree_height", "gauge", "Levels from the root to the leaves.");
+    out << "btree_tree_height " << current.height << "\n";
+    if (!current.levels.empty()) {
+        metric("level_nodes", "gauge", "Nodes per level, level 0 being the root.");
+        for (size_t l = 0; l < current.levels.size(); ++l) {
+            out << "btree_level_nodes{level=\"" << l << "\"} " << current.levels[l].nodes << "\n";
+        }
+        metric("level_fill_ratio", "gauge", "Entries per level over the slots of its nodes.");
+        for (size_t l = 0; l < current.levels.size(); ++l) {
+            out << "btree_level_fill_ratio{level=\"" << l << "\"} " << current.levels[l].fill << "\n";
+        }
+    }
+    metric("operations_total", "counter", "Calls of each index operation.");
+    for (int o = 0; o < Metrics::OperationCount; ++o) {
+        out << "btree_operations_total{operation=\"" << Metrics::name((Metrics::Operation) o) << "\"} "
+            << current.operations.calls[o] << "\n";
+    }
+    metric("operation_duration_seconds", "histogram", "Latency of the sampled calls of index operations.");
+    for (int o = 0; o < Metrics::OperationCount; ++o) {
+        const Metrics::Histogram &histogram = current.operations.latency[o];
+        string labels = string("operation=\"") + Metrics::name((Metrics::Operation) o) + "\"";
+        long long cumulative = 0;
+        for (int b = 0; b < Metrics::Buckets - 1; ++b) {
+            cumulative += histogram.buckets[b];
+            out << "btree_operation_duration_seconds_bucket{" << labels << ",le=\""
+                << Metrics::Histogram::upperBoundNanos(b) / 1e9 << "\"} " << cumulative << "\n";
+        }
+        out << "btree_operation_duration_seconds_bucket{" << labels << ",le=\"+Inf\"} " << histogram.count << "\n";
+        out << "btree_operation_duration_seconds_sum{" << labels << "} " << histogram.sumNanos / 1e9 << "\n";
+        out << "btree_operation_duration_seconds_count{" << labels << "} " << histogram.count << "\n";
+    }
+
+    string temporary = string(filename) + ".tmp";
+    {
+        ofstream file(temporary, ios::trunc);
+        if (!(file << out.str()) || !file.flush()) {
+            return false;
+        }
+    }
+    return rename(temporary.c_str(), filename) == 0;
+}
+
+bool BTreeIndex::attachLog() {
+    if (!wal.isOpen() && !wal.open(logFileName())) {
+        return false;
+    }
+    bufferPool.setNoSteal(true);
+    return true;
+}
+
+bool BTreeIndex::recoverFromLog() {
+    ifstream existing(logFileName(), ios::binary | ios::ate);
+    if (!existing || existing.tellg() == 0) {
+        return true;
+    }
+    existing.close();
+    vector<WriteAheadLog::Record> records;
+    if (!attachLog() || !wal.readAll(records)) {
+        return false;
+    }
+
+    // a complete checkpoint supersedes everything logged before it
+    size_t replayFrom = 0;
+    for (size_t i = records.size(); i-- > 0;) {
+        if (records[i].type != WriteAheadLog::CheckpointEnd) {
+            continue;
+        }
+        size_t first = i;
+        while (first > 0 && records[first - 1].type == WriteAheadLog::PageImage) {
+            first--;
+        }
+        // the log is emptied by the checkpoint below, so the images must be in the file for good first
+        for (size_t k = first; k < i; ++k) {
+            const vector<int32_t> &image = records[k].payload;
+            if (image.size() != 1 + pageSize / sizeof(int32_t) ||
+                !StorageBackend::write(BTreeFile, image.data() + 1, pageSize, (off_t) image[0] * pageSize)) {
+                return false;
+            }
+        }
+        if (first < i && fsync(BTreeFile) != 0) {
+            return false;
+        }
+        vector<int32_t> header(pageSize / sizeof(int32_t));
+        if (pread(BTreeFile, header.data(), pageSize, 0) != pageSize) {
+            return false;
+        }
+        applyHeader(header.data());
+        replayFrom = i + 1;
+        break;
+    }
+    // the logged operations are redone on the normal layout
+    if ((savedRoot != -1 && !normalizeTree(savedRoot)) || (savedBuffers != -1 && !drainBuffers())) {
+        return false;
+    }
+    // pages are not stolen while the log is attached, so the file is untouched until the checkpoint
+    for (size_t i = replayFrom; i < records.size(); ++i) {
+        const vector<int32_t> &payload = records[i].payload;
+        if (records[i].type == WriteAheadLog::Insert && payload.size() == 2) {
+            if (insertRecord(payload[0], payload[1], false) == -3 && growFile()) {
+                insertRecord(payload[0], payload[1], false);
+            }
+        } else if (records[i].type == WriteAheadLog::Delete && payload.size() == 2) {
+            deleteRecord(payload[0]);
+        } else if (records[i].type == WriteAheadLog::Batch && payload.size() % 3 == 0) {
+            vector<BatchOp> ops(payload.size() / 3);
+            for (size_t k = 0; k < ops.size(); ++k) {
+                ops[k] = {(BatchOp::Type) payload[3 * k], payload[3 * k + 1], payload[3 * k + 2]};
+            }
+            applyBatchLocked(ops.data(), ops.data() + ops.size(), false);
+        }
+    }
+    bool ok = checkpointLocked();
+    if (!walEnabled) {
+        wal.close();
+        bufferPool.setNoSteal(false);
+    }
+    return ok;
+}
+
+void BTreeIndex::logOperation(int32_t type, int RecordID, int Reference) {
+    if (wal.isOpen()) {
+        int32_t payload[2] = {RecordID, Reference};
+        wal.append(type, payload, 2);
+    }
+}
+
+void BTreeIndex::afterOperation() {
+    auto due = [this] {
+        return wal.isOpen() && bufferPool.dirtyPages() >= max((size_t) 1, bufferPool.capacity() / 2);
+    };
+    if (!due()) {
+        return;
+    }
+    // several threads can find the pool half dirty at once; only the first still does after the wait
+    unique_lock<shared_mutex> tree(treeLatch);
+    if (due()) {
+        checkpointLocked();
+    }
+}
+
+/////////////////////////////////////Verification/////////////////////////////////////////////////
+
+struct BTreeIndex::VerifyState {
+    enum Reached : uint8_t { Unreached, InTree, InBuffer, Free };
+    vector<int> dirty;             // sorted places of the pool's dirty pages, whose file copy is stale
+    vector<atomic<uint8_t>> marks; // how each place was reached
+    atomic<long long> nodes{0}, leaves{0}, records{0}, bufferPages{0}, messages{0}, freePages{0};
+    atomic<long long> leafNodes{0}, internalNodes{0}; // of the level being checked
+    mutex problemLatch;
+    long long problemCount = 0;
+    vector<string> problems;
+
+    explicit VerifyState(int places) : marks(max(places, 1)) {}
+
+    void problem(const string &what) {
+        lock_guard<mutex> guard(problemLatch);
+        if (problems.size() < MaxVerifyProblems) {
+            problems.push_back(what);
+        }
+        problemCount++;
+    }
+
+    // false, with a problem, if the place is outside the file or was reached before
+    bool reach(int place, Reached how) {
+        if (place < 1 || place >= (int) marks.size()) {
+            problem("a link to page " + to_string(place) + ", outside the file");
+            return false;
+        }
+        if (marks[place].exchange(how) != Unreached) {
+            problem("page " + to_string(place) + " is reached twice");
+            return false;
+        }
+        return true;
+    }
+};
+
+BTreeIndex::VerifyReport BTreeIndex::Verify() {
+    VerifyReport report;
+    shared_lock<shared_mutex> frozen(snapshotGate);
+    unique_lock<shared_mutex> tree(treeLatch);
+    if (!isOpen()) {
+        report.problems.push_back("the index is not open");
+        report.problemCount = 1;
+        return report;
+    }
+    VerifyState state(numberOfRecords);
+    if (!arena.active() && mapping.load() == nullptr) {
+        bufferPool.forEachDirty([&](int place, const int32_t *) { state.dirty.push_back(place); });
+        sort(state.dirty.begin(), state.dirty.end());
+    }
+    ThreadPool pool(workerThreads);
+
+    // an empty tree keeps its root on the free list, except in copy-on-write mode
+    int root = copyOnWrite ? rootPlace.load() : 1;
+    vector<int32_t> page(pageSize / sizeof(int32_t));
+    vector<VerifyItem> level;
+    if (root < 1 || root >= numberOfRecords || !copyPages(&root, 1, page.data(), state.dirty)) {
+        state.problem("the root, page " + to_string(root) + ", cannot be read");
+    } else if (page[0] != -1 || copyOnWrite) {
+        state.reach(root, VerifyState::InTree);
+        level.push_back({root, LLONG_MIN, LLONG_MAX, true});
+    }
+    // the children of a level's nodes, in key order, are the next level
+    while (!level.empty()) {
+        report.height++;
+        size_t chunks = (level.size() + VerifyChunkNodes - 1) / VerifyChunkNodes;
+        vector<vector<VerifyItem>> below(chunks);
+        state.leafNodes = 0;
+        state.internalNodes = 0;
+        pool.parallelFor(chunks, 1, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; ++c) {
+                verifyNodes(level, c * VerifyChunkNodes, min(level.size(), (c + 1) * VerifyChunkNodes), root, state,
+                            below[c]);
+            }
+        });
+        if (state.leafNodes > 0 && state.internalNodes > 0) {
+            state.problem("level " + to_string(report.height) + " has both leaves and internal nodes");
+        }
+        level.clear();
+        for (const auto &part: below) {
+            level.insert(level.end(), part.begin(), part.end());
+        }
+    }
+    verifyFreeList(state);
+    // retired versions hold pages that are neither, so copy-on-write mode leaves this out
+    if (!copyOnWrite) {
+        pool.parallelFor(numberOfRecords - 1, 1 << 16, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k) {
+                if (state.marks[k + 1].load() == VerifyState::Unreached) {
+                    state.problem("page " + to_string(k + 1) + " is neither in the tree nor on the free list");
+                }
+            }
+        });
+    }
+
+    report.nodes = state.nodes;
+    report.leaves = state.leaves;
+    report.records = state.records;
+    report.bufferPages = state.bufferPages;
+    report.messages = state.messages;
+    report.freePages = state.freePages;
+    report.problemCount = state.problemCount;
+    report.problems = move(state.problems);
+    sort(report.problems.begin(), report.problems.end());
+    report.ok = report.problemCount == 0;
+    return report;
+}
+
+bool BTreeIndex::copyPages(const int *places, size_t count, int32_t *out, const vector<int> &dirty) {
+    // page k goes to out + k * words. Callers hold treeLatch exclusively, so nothing changes meanwhile.
+    // Neighbouring places are read from the file with one request, and dirty pages are taken from the pool
+    size_t words = pageSize / sizeof(int32_t);
+    const Mapping *mapped = mapping.load();
+    vector<pair<int, size_t>> order(count);
+    for (size_t k = 0; k < count; ++k) {
+        order[k] = make_pair(places[k], k);
+    }
+    sort(order.begin(), order.end());
+    vector<int32_t> run;
+    for (size_t i = 0; i < count;) {
+        int first = order[i].first;
+        size_t length = 1;
+        while (i + length < count && order[i + length].first == first + (int) length) {
+            length++;
+        }
+        const int32_t *source = nullptr;
+        if (mapped != nullptr) {
+            if ((size_t) (first + length) * pageSize > mapped->bytes) {
+                return false;
+            }
+            source = mapped->pages + (size_t) first * words;
+        } else if (!arena.active()) {
+            run.resize(length * words);
+            if (!StorageBackend::read(BTreeFile, run.data(), length * pageSize, (off_t) first * pageSize)) {
+                return false;
+            }
+            source = run.data();
+        }
+        for (size_t k = 0; k < length; ++k) {
+            const int32_t *from = source != nullptr ? source + k * words : arena.page(first + (int) k);
+            memcpy(out + order[i + k].second * words, from, pageSize);
+        }
+        i += length;
+    }
+    for (size_t k = 0; k < count && !dirty.empty(); ++k) {
+        if (binary_search(dirty.begin(), dirty.end(), places[k])) {
+            bufferPool.copyPage(places[k], out + k * words);
+        }
+    }
+    return true;
+}
+
+void BTreeIndex::verifyNodes(const vector<VerifyItem> &level, size_t begin, size_t end, int root,
+                             VerifyState &state, vector<VerifyItem> &below) {
+    size_t words = pageSize / sizeof(int32_t);
+    vector<int> places(end - begin);
+    for (size_t k = begin; k < end; ++k) {
+        places[k - begin] = level[k].place;
+    }
+    vector<int32_t> pages(places.size() * words);
+    if (!copyPages(places.data(), places.size(), pages.data(), state.dirty)) {
+        state.problem("pages " + to_string(places.front()) + " ... " + to_string(places.back()) + " cannot be read");
+        return;
+    }
+    for (size_t k = begin; k < end; ++k) {
+        const VerifyItem &item = level[k];
+        const int32_t *page = pages.data() + (k - begin) * words;
+        string at = "page " + to_string(item.place);
+        int isLeaf = page[0], count = page[1];
+        if (isLeaf != 0 && isLeaf != 1) {
+            state.problem(at + " is in the tree but is not a node (isLeaf " + to_string(isLeaf) + ")");
+            continue;
+        }
+        state.nodes++;
+        (isLeaf == 0 ? state.leafNodes : state.internalNodes)++;
+        if (count < 0 || count > m) {
+            state.problem(at + " holds " + to_string(count) + " entries, more than m or fewer than none");
+            continue;
+        }
+        // an internal root needs two children, and a leaf root may be empty, as copy-on-write keeps it once the
+        // last record is gone; any other node needs half of m
+        int least = item.place != root ? minimumEntries() : isLeaf == 0 ? 0 : 2;
+        if (count < least) {
+            state.problem(at + " holds " + to_string(count) + " entries, fewer than " + to_string(least));
+        }
+        const int32_t *keys = pageKeys(page), *refs = pageRefs(page);
+        for (int i = 0; i < count; ++i) {
+            if (i > 0 && keys[i] <= keys[i - 1]) {
+                state.problem(at + " has key " + to_string(keys[i]) + " after " + to_string(keys[i - 1]));
+                break;
+            }
+            if (keys[i] <= item.low || keys[i] > item.high) {
+                state.problem(at + " has key " + to_string(keys[i]) + " outside (" + to_string(item.low) + ", " +
+                              to_string(item.high) + "]");
+                break;
+            }
+        }
+        if (item.place != root && count > 0 && keys[count - 1] != item.high) {
+            state.problem("the separator " + to_string(item.high) + " above " + at + " is not its largest key " +
+                          to_string(keys[count - 1]));
+        }
+        int next = page[2 + 2 * m];
+        if (isLeaf == 0) {
+            state.leaves++;
+            state.records += count;
+            // leaves come in key order, so each links to the one after it; versions leave the links stale
+            int expected = k + 1 < level.size() ? level[k + 1].place : -1;
+            if (!copyOnWrite && next != expected) {
+                state.problem(at + " links to leaf " + to_string(next) + " instead of " + to_string(expected));
+            }
+            continue;
+        }
+        for (int i = 0; i < count; ++i) {
+            if (state.reach(refs[i], VerifyState::InTree)) {
+                below.push_back({refs[i], i == 0 ? item.low : keys[i - 1], keys[i], item.rightmost && i == count - 1});
+            }
+        }
+        if (next != -1 && buffered) {
+            verifyBuffer(item, next, state);
+        } else if (next != -1) {
+            state.problem(at + " is internal but links to page " + to_string(next));
+        }
+    }
+}
+
+void BTreeIndex::verifyBuffer(const VerifyItem &item, int chain, VerifyState &state) {
+    // the messages are sorted across the chain and lie inside the node's range, above it too on the right edge
+    vector<int32_t> page(pageSize / sizeof(int32_t));
+    string at = "the buffer of page " + to_string(item.place);
+    long long previous = item.low;
+    while (chain != -1) {
+        if (!state.reach(chain, VerifyState::InBuffer)) {
+            return;
+        }
+        if (!copyPages(&chain, 1, page.data(), state.dirty)) {
+            state.problem(at + " cannot be read at page " + to_string(chain));
+            return;
+        }
+        int held = page[1];
+        if (page[0] != BufferPage || held < 1 || held > messagesPerPage()) {
+            state.problem(at + " runs into page " + to_string(chain) + ", which is not a buffer page");
+            return;
+        }
+        state.bufferPages++;
+        state.messages += held;
+        for (int i = 0; i < held; ++i) {
+            const int32_t *message = page.data() + 2 + 3 * i;
+            if (message[0] < BatchOp::Upsert || message[0] > BatchOp::Insert) {
+                state.problem(at + " has a message of unknown type " + to_string(message[0]));
+            }
+            if (message[1] <= previous || (message[1] > item.high && !item.rightmost)) {
+                state.problem(at + " has RecordID " + to_string(message[1]) + " out of order or out of range");
+                return;
+            }
+            previous = message[1];
+        }
+        chain = page[2 + 2 * m];
+    }
+}
+
+void BTreeIndex::verifyFreeList(VerifyState &state) {
+    // the list is followed a page at a time, but a run of neighbouring places is read at once, as growth
+    // and bulk loads chain free pages in place order
+    size_t words = pageSize / sizeof(int32_t);
+    vector<int32_t> window;
+    int windowFirst = 0, windowPages = 0;
+    for (int place = head; place != -1;) {
+        if (!state.reach(place, VerifyState::Free)) {
+            return;
+        }
+        if (place < windowFirst || place >= windowFirst + windowPages) {
+            windowFirst = place;
+            windowPages = min((int) VerifyChunkNodes, numberOfRecords - place);
+            vector<int> places(windowPages);
+            iota(places.begin(), places.end(), place);
+            window.resize(windowPages * words);
+            if (!copyPages(places.data(), places.size(), window.data(), state.dirty)) {
+                state.problem("free page " + to_string(place) + " cannot be read");
+                return;
+            }
+        }
+        const int32_t *page = window.data() + (place - windowFirst) * words;
+        if (page[0] != -1) {
+            state.problem("page " + to_string(place) + " is on the free list but has isLeaf " + to_string(page[0]));
+            return;
+        }
+        state.freePages++;
+        place = page[2];
+    }
+}
+
+void BTreeIndex::run() {
+    int choice, recordID, reference;
+
+    do {
+        cout << "\n============================================\n";
+        cout << "            B-Tree Index Menu               \n";
+        cout << "============================================\n";
+        cout << "1. Insert New Record\n";
+        cout << "2. Delete Record\n";
+        cout << "3. Display Index File Content\n";
+        cout << "4. Search for a Record\n";
+        cout << "5. Exit\n";
+        cout << "============================================\n";
+        cout << "Enter your choice: ";
+        cin >> choice;
+
+        switch (choice) {
+            case 1: {
+                cout << "\n=== Insert New Record ===\n";
+                cout << "Enter RecordID: ";
+                cin >> recordID;
+                cout << "Enter Reference: ";
+                cin >> reference;
+
+                int referenceValue = SearchARecord(BTreeFileName.c_str(), recordID);
+                if (referenceValue == -1) {
+                    InsertNewRecordAtIndex(recordID, reference);
+                    cout << "\n✔ Record inserted successfully.\n";
+                } else {
+                    cout << "\n❌ Error: RecordID already exists. Cannot insert duplicate records.\n";
+                }
+                break;
+            }
+
+            case 2: {
+                cout << "\n=== Delete Record ===\n";
+                cout << "Enter RecordID to delete: ";
+                cin >> recordID;
+
+                int referenceValue = SearchARecord(BTreeFileName.c_str(), recordID);
+                if (referenceValue == -1) {
+                    cout << "\n❌ Error: Record not found in the index.\n";
+                } else {
+                    DeleteRecordFromIndex(BTreeFileName.c_str(), recordID, m);
+                    cout << "\n✔ Record deleted successfully.\n";
+                }
+                break;
+            }
+
+            case 3: {
+                cout << "\n=== Displaying Index File Content ===\n";
+                DisplayIndexFileContent(BTreeFileName.c_str());
+                break;
+            }
+
+            case 4: {
+                cout << "\n=== Search for a Record ===\n";
+                cout << "Enter RecordID to search: ";
+                cin >> recordID;
+
+                int referenceValue = SearchARecord(BTreeFileName.c_str(), recordID);
+                if (referenceValue == -1) {
+                    cout << "\n❌ Record not found in the index.\n";
+                } else {
+                    cout << "\n✔ Record found! Reference: " << referenceValue << "\n";
+                }
+                break;
+            }
+
+            case 5: {
+                cout << "\nExiting program...\n";
+                break;
+            }
+
+            default: {
+                cout << "\n❌ Invalid choice. Please enter a number between 1 and 5.\n";
+            }
+        }
+
+        if (choice != 5) {
+            cout << "\nPress Enter to continue...";
+            cin.ignore();
+            cin.get();
+        }
+
+    } while (choice != 5);
 }
\ No newline at end of file
@@ -1,61 +1,532 @@
-#ifndef BTREEINDEX_BTREEINDEX_H
-#define BTREEINDEX_BTREEINDEX_H
-
-#include <iostream>
-#include <string>
-#include <fstream>
-#include <vector>
-#include <stack>
-#include <utility>
-#include <sstream>
-#include <algorithm>
-#include <tuple>
-using namespace std;
-
-struct BTreeNode {
-public:
-    int isLeaf;
-    // update
-    int count = 0;
-    int place;
-    vector<pair<int, int>> node;
-    vector<BTreeNode> children;
-};
-
-class BTreeIndex {
-    const char *const BTreeFileName = "BTreeIndex.txt";
-    int numberOfRecords;
-    int m;
-    int head{};
-    fstream BTreeFile;
-    void DeleteCase2(const char *filename, vector<BTreeNode> &bTree, BTreeNode &find, int RecordID, int &count, int &temp);
-    void DeleteCase1(const char *filename, vector<BTreeNode> &bTree, BTreeNode &find, int RecordID);
-
-
-public:
-    void CreateIndexFile(const char *filename, int numberOfRecords, int m);
-    int InsertNewRecordAtIndex(int RecordID, int Reference);
-    void DeleteRecordFromIndex(const char *filename, int RecordID, int m);
-    void DisplayIndexFileContent(const char *filename);
-    int SearchARecord(const char *filename, int RecordID);
-    void run();
-
-    //////////////////////////////////////Functions for searching//////////////////////////////////////
-    bool record_valid(int recordNumber) const;
-    int read_val(int rowIndex, int columnIndex);
-    bool isEmpty(int recordNumber);
-    bool isLeaf(int recordNumber);
-    vector<pair<int, int>> read_node_values(int recordNumber);
-
-    vector<BTreeNode> readFile(const char *filename);
-    void savefile(const char *filename, vector<BTreeNode> bTree, int m);
-
-
-    /////////////////////////////functions for insert////////////////////////////////////////////
-    int split(int i,vector<BTreeNode> bTree);
-    bool split_root(vector<BTreeNode> bTree);
-    pair<vector<pair<int, int>>, vector<pair<int, int>>> splitOriginalNode(const vector<pair<int, int>>& originalNode);
-    int updateAfterInsert(int parentRecordNumber, int newChildRecordNumber);
-};
-
-#endif // BTREEINDEX_BTREEINDEX_H
+#ifndef BTREEINDEX_BTREEINDEX_H
+#define BTREEINDEX_BTREEINDEX_H
+
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <unordered_set>
+#include <stack>
+#include <utility>
+#include <sstream>
+#include <algorithm>
+#include <tuple>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include "BufferPool.h"
+#include "PageArena.h"
+#include "WriteAheadLog.h"
+#include "Latch.h"
+#include "NodeSearch.h"
+#include "Metrics.h"
+#include "ThreadPool.h"
+using namespace std;
+
+struct BTreeNode {
+public:
+    int isLeaf;
+    // update
+    int count = 0;
+    int place;
+    int next = -1; // leaves only: place of the next leaf in key order
+    vector<pair<int, int>> node;
+};
+
+class BTreeIndex {
+    string BTreeFileName = "BTreeIndex.bin";
+    int numberOfRecords;
+    int m;
+    int head{};
+    int pageSize{};
+    int BTreeFile = -1;
+    BufferPool bufferPool;
+    Metrics metrics;
+    bool readOnly = false;
+    struct Mapping {
+        const int32_t *pages;
+        size_t bytes;
+    };
+    atomic<const Mapping *> mapping{nullptr}; // whole file, only in OpenIndexFileReadOnly mode
+    vector<unique_ptr<Mapping>> mappings;     // every mapping made since open; older ones may still be read
+    mutex remapLatch;
+    WriteAheadLog wal;      // open only while logging (or replaying) the file at BTreeFileName
+    PageArena arena;        // every page of the index, only in OpenIndexFileInMemory mode
+    bool walEnabled = false;
+    int insertRecord(int RecordID, int Reference, bool log);
+    int insertOptimistic(int RecordID, int Reference, bool log);
+    void deleteRecord(int RecordID);
+    bool rebalance(BTreeNode &parent, int at, BTreeNode &child);
+    void mergeInto(BTreeNode &node, const BTreeNode &next);
+
+    /////////////////////////////////////Binary page format/////////////////////////////////////////
+    // Page 0 is the header page, page `place` holds the node at that place. Every page is pageSize
+    // bytes so a node lives at byte offset place * pageSize.
+    //   header: magic | version | m | node count | free-list head | root
+    // The root field is -1 in a normal file, whose root is at place 1. A file saved in copy-on-write mode
+    // names its root there instead, and its leaf links and free list are put right when it is opened.
+    //   node:   isLeaf | count | key0 ... key(m-1) | ref0 ... ref(m-1) | next leaf   (unused slots are -1)
+    // Keys are one contiguous array so a node is searched with NodeSearch's vector kernels.
+    bool readHeader(istream &in);
+    bool loadHeader(istream &in, int32_t *header) const;
+    void applyHeader(const int32_t *header);
+    void writeHeader(ostream &out) const;
+    void encodeHeader(int32_t *page) const;
+    void encodePage(const BTreeNode &node, int32_t *page) const;
+    void encodeEntries(const pair<int, int> *entries, int count, int isLeaf, int next, int32_t *page) const;
+    BTreeNode decodePage(const int32_t *page, int place) const;
+    void decodePage(const int32_t *page, int place, BTreeNode &into) const;
+    static void decodePage(const int32_t *page, int place, int order, BTreeNode &into);
+    void insertIntoPage(int32_t *page, int slot, int RecordID, int Reference) const;
+    const int32_t *pageKeys(const int32_t *page) const { return page + 2; }
+    const int32_t *pageRefs(const int32_t *page) const { return page + 2 + m; }
+
+    /////////////////////////////////////Page-level I/O/////////////////////////////////////////////
+    // Mutations read the root-to-leaf path with readNode and write back only the pages they change.
+    // Pages go through bufferPool, so writes reach the file on eviction, Flush or close.
+    bool isOpen() const { return BTreeFile != -1 || arena.active(); }
+    bool ensureOpen(const char *filename);
+    void closeIndexFile();
+    void unmapIndexFile();
+    void adviseTopLevels(const Mapping *mapped);
+    int32_t *pinPage(int place, bool load = true);
+    void writeHeaderPage();
+    void prefetchPages(const vector<int> &places);
+    bool flushLocked();
+    int allocateNode();
+    bool takeFreeNode(int place);
+    void freeNode(int place);
+    bool reserveNodes(int needed);
+    bool appendFreePages(int count);
+    bool growFile();
+    BTreeNode emptyNode(int place, int isLeaf) const;
+    void setEntries(BTreeNode &node, const vector<pair<int, int>> &entries) const;
+    void insertEntry(BTreeNode &node, pair<int, int> entry);
+    void removeEntry(BTreeNode &node, int key);
+    void removeAt(BTreeNode &node, int slot);
+    int findEntry(const BTreeNode &node, int key) const;
+    int findChild(const BTreeNode &node, int place) const;
+    int childFor(const BTreeNode &node, int RecordID) const;
+    int childSlot(const BTreeNode &node, int RecordID) const;
+    // every node but the root keeps at least this many entries; a split of m + 1 leaves both halves this full
+    int minimumEntries() const { return (m + 1) / 2; }
+    void multiSearchNode(int place, const int *ids, const size_t *order, size_t begin, size_t end,
+                         vector<int> &references);
+    void childRuns(const int32_t *page, const int *ids, const size_t *order, size_t begin, size_t end,
+                   vector<tuple<int, size_t, size_t>> &runs) const;
+    void prefetchPaths(int root, const int *ids, const size_t *order, size_t begin, size_t end);
+    int readahead(int from, int hi, int leaves);
+    atomic<int> scanReadahead{MaxReadaheadLeaves};
+    void linkLeaves(int place, int &previous);
+    int leafFor(int root, int RecordID);
+    int searchVersion(int root, int RecordID);
+
+    /////////////////////////////////////Concurrency///////////////////////////////////////////////
+    // Lookups and inserts hold treeLatch shared and latch nodes as they descend: a lookup latches the
+    // child before letting go of the parent, an insert latches the path exclusively and lets go of the
+    // ancestors as soon as a node cannot split. Deletes and checkpoints hold treeLatch exclusively.
+    // Opening, creating and bulk loading must not run alongside other calls on the same instance.
+    shared_mutex treeLatch;
+    unique_ptr<Latch[]> latches; // one per place of the open file
+    int latchCount = 0;
+    mutex allocatorLatch;        // head, the free list and the header page
+    int reservedNodes = 0;       // free nodes promised to inserts that are still splitting
+    void resetLatches();
+    void latchShared(int place);
+    void unlatchShared(int place);
+    void latchExclusive(int place);
+    void unlatchExclusive(int place);
+
+    // exclusive latches of an insert's path, released on every way out of it
+    class LatchedPath {
+    public:
+        explicit LatchedPath(BTreeIndex &index) : index(index) {}
+        ~LatchedPath();
+        void lock(int place);
+        void keepOnly(int place);
+    private:
+        BTreeIndex &index;
+        vector<int> places;
+    };
+
+    /////////////////////////////////////Write-ahead log/////////////////////////////////////////////
+    // Inserts and deletes are logged as logical records before they run. Dirty pages stay in the pool
+    // (no-steal) until a checkpoint logs their images and only then writes them in place, so opening
+    // the file replays the log from a consistent state.
+    string logFileName() const { return BTreeFileName + ".wal"; }
+    bool attachLog();
+    bool recoverFromLog();
+    void logOperation(int32_t type, int RecordID, int Reference);
+    void afterOperation();
+    bool checkpointLocked();
+
+    /////////////////////////////////////In-memory mode/////////////////////////////////////////////
+    // The file is read into the arena once and every page access goes to the arena. Snapshot copies
+    // the pages changed since the last one into the arena's images while holding snapshotGate, which
+    // inserts, deletes and shrinks hold shared (before treeLatch), so lookups never wait for it; the
+    // images are then written to a file next to the index, synced and renamed over it.
+    shared_mutex snapshotGate;
+    mutex snapshotLatch;        // one image write at a time; snapshotPending
+    bool snapshotPending = false; // the file on disk lags the last capture
+    thread snapshotter;
+    mutex snapshotterLatch;     // stopSnapshots
+    condition_variable snapshotterWake;
+    bool stopSnapshots = false;
+    string snapshotFileName() const { return BTreeFileName + ".snapshot"; }
+    void snapshotLoop(int snapshotMillis);
+    void stopSnapshotter();
+
+    /////////////////////////////////////Copy-on-write versions///////////////////////////////////////
+    // In copy-on-write mode a change never writes a page a reader can reach. It writes new copies of the
+    // nodes on its path, and of a sibling it borrows from or merges with, then publishes the new root in
+    // rootPlace. A reader announces the epoch it starts in, reads rootPlace and descends without latches.
+    // The pages a change replaced are retired with its epoch and go back on the free list once no reader
+    // is left from that epoch or before. Leaf links are not kept up, so scans descend once per leaf, and
+    // place 1 stays reserved until the tree is put back in the normal layout. Changes run one at a time.
+    struct Version {
+        BTreeIndex *index;
+        int root;
+        int slot; // reader slot holding the epoch the version was opened in
+        Version(BTreeIndex *index, int root, int slot) : index(index), root(root), slot(slot) {}
+        ~Version() { index->leaveEpoch(slot); }
+    };
+    struct alignas(64) ReaderSlot {
+        atomic<uint64_t> epoch{0}; // 0 while the slot is free
+    };
+    static const int ReaderSlots = 128;
+    static const size_t ReclaimBatch = 64; // retired pages that make a change look for reclaimable ones
+    unique_ptr<ReaderSlot[]> readerSlots{new ReaderSlot[ReaderSlots]};
+    atomic<uint64_t> globalEpoch{1};
+    atomic<int> rootPlace{1};
+    atomic<bool> copyOnWrite{false};
+    int savedRoot = -1;                  // root field of the header last read
+    mutex versionLatch;                  // held by the change in progress; guards retired
+    vector<pair<uint64_t, int>> retired; // (epoch, place) of pages replaced by a change
+    int enterEpoch();
+    void leaveEpoch(int slot);
+    shared_ptr<const Version> openVersion();
+    int insertVersioned(int RecordID, int Reference);
+    int deleteVersioned(int RecordID);
+    bool reserveVersioned(int depth);
+    void writeCopies(const BTreeNode &node, vector<BTreeNode> &copies);
+    void publish(int root, vector<int> &replaced);
+    void reclaimVersions();
+    void leaveCopyOnWrite();
+    bool normalizeTree(int root);
+
+    /////////////////////////////////////Bulk loading///////////////////////////////////////////////
+    // Records arrive sorted by RecordID with duplicates removed. Nodes are packed level by level and
+    // written in file order; only the root (place 1) and the header are written out of sequence.
+    // Records held in memory are sorted and packed by a thread pool. The sizes of a level's nodes follow
+    // from its entry count alone (levelShape), so every node's entries and place are known up front:
+    // threads pack disjoint runs of nodes and write each run at its place, and the file comes out the
+    // same as a streamed build of the same records.
+    unsigned workerThreads = 0; // threads of bulk loads and Verify, 0 for one per hardware thread
+    static void sortRecords(vector<pair<int, int>> &records, ThreadPool &pool);
+    bool bulkLoadRecords(const char *filename, vector<pair<int, int>> &records, int m, double fillFactor,
+                         int spareNodes);
+    void startBulkBuild(const char *filename, int m);
+    bool bulkBuild(const char *filename, int m, double fillFactor, int spareNodes,
+                   const function<bool(pair<int, int> &)> &next);
+    bool bulkBuildSorted(const char *filename, int m, double fillFactor, int spareNodes,
+                         const vector<pair<int, int>> &records, ThreadPool &pool);
+    void levelShape(size_t entries, int target, size_t &full, vector<int> &tail) const;
+
+public:
+    static const int32_t FileMagic = 0x58495442; // "BTIX"
+    static const int32_t FormatVersion = 3;
+    static const int AdvisedLevels = 3; // tree levels, root included, that read-only mode asks to keep paged in
+    static constexpr int MinGrowthPages = 64; // smallest extent appended when the free list runs out
+    static constexpr int MinReadaheadLeaves = 4;  // leaves a sequential scan fetches ahead at first
+    static constexpr int MaxReadaheadLeaves = 64; // ... doubling up to this many
+    static const int DefaultSnapshotMillis = 1000;
+    static const int DefaultBufferPages = 8;
+    enum HeaderField { HeaderMagic, HeaderVersion, HeaderOrder, HeaderNodeCount, HeaderFreeHead, HeaderRoot,
+                       HeaderBuffers, HeaderFields };
+    static int PageSizeFor(int m);
+    static constexpr double DefaultFillFactor = 0.9;
+    static const size_t DefaultSortRunRecords = 1 << 24; // records sorted in memory per external-sort run
+    static const size_t BuildChunkNodes = 4096;  // nodes a bulk-build task packs and writes with one request
+    static const size_t VerifyChunkNodes = 1024; // nodes a Verify task reads and checks at a time
+    static const size_t MaxVerifyProblems = 32;  // problems a VerifyReport spells out
+
+    // Forward iterator over the (RecordID, Reference) pairs of a RangeScan. It holds a copy of one leaf
+    // at a time and follows the sibling links, so a scan never goes back up through internal nodes.
+    // No latch is held between leaves, so inserts made while a scan runs may or may not be seen.
+    // A default-constructed iterator is the end of every scan.
+    class RangeIterator {
+    public:
+        using iterator_category = forward_iterator_tag;
+        using value_type = pair<int, int>;
+        using difference_type = ptrdiff_t;
+        using pointer = const pair<int, int> *;
+        using reference = const pair<int, int> &;
+
+        RangeIterator() = default;
+        reference operator*() const { return entries[slot]; }
+        pointer operator->() const { return &entries[slot]; }
+        RangeIterator &operator++();
+        RangeIterator operator++(int);
+        bool operator==(const RangeIterator &other) const;
+        bool operator!=(const RangeIterator &other) const { return !(*this == other); }
+
+    private:
+        friend class BTreeIndex;
+        BTreeIndex *index = nullptr;
+        int hi = 0;
+        int leaf = -1;
+        int slot = 0;
+        vector<pair<int, int>> entries;
+        int readaheadKey = INT32_MIN; // the leaves holding keys up to here have been fetched ahead
+        int readaheadLeaves = 0;      // size of the last readahead window
+        shared_ptr<const Version> version; // set when scanning a copy-on-write version
+        void load(int place, int lo);
+        void loadVersion(int lo);
+    };
+
+    // A consistent, read-only view of the tree as of OpenReadView, in copy-on-write mode. Lookups and
+    // scans through it take no latch and see none of the changes made after it was opened, however long
+    // they run. Pages it can reach are kept until the view and every iterator taken from it are gone,
+    // which must happen before the index is closed. A default-constructed view is not valid.
+    class ReadView {
+    public:
+        ReadView() = default;
+        bool valid() const { return version != nullptr; }
+        int SearchARecord(int RecordID) const;
+        RangeIterator RangeScan(int lo, int hi) const;
+
+    private:
+        friend class BTreeIndex;
+        shared_ptr<const Version> version;
+    };
+
+    // One change of an ApplyBatch: Upsert inserts RecordID or replaces its Reference, Delete removes it,
+    // and Insert adds it only if it is not there yet, like InsertNewRecordAtIndex
+    struct BatchOp {
+        enum Type { Upsert, Delete, Insert };
+        Type type;
+        int RecordID;
+        int Reference;
+    };
+    static const size_t MaxBatchOps = WriteAheadLog::MaxPayloadWords / 3; // a batch is logged as one record
+
+    BTreeIndex() = default;
+    BTreeIndex(const BTreeIndex &) = delete;
+    BTreeIndex &operator=(const BTreeIndex &) = delete;
+    ~BTreeIndex();
+
+    void CreateIndexFile(const char *filename, int numberOfRecords, int m);
+    // the place of the leaf that now holds RecordID, or -1 if it is already present or the index refuses the
+    // insert; buffered mode answers differently, see EnableBufferedInserts
+    int InsertNewRecordAtIndex(int RecordID, int Reference);
+    void DeleteRecordFromIndex(const char *filename, int RecordID, int m);
+    // Applies the ops in RecordID order, the ops on one RecordID in the order given, and returns how many
+    // records changed (in buffered mode, how many RecordIDs the ops touch, as most changes wait in buffers).
+    // The batch is applied whole and is durable on return: with the log it is one logged record and one
+    // commit, without it the changed pages are written and synced. In memory it reaches the file with the
+    // next snapshot. -1 if the batch is refused, or could not be made durable.
+    int ApplyBatch(const vector<BatchOp> &ops);
+    void DisplayIndexFileContent(const char *filename);
+    int SearchARecord(const char *filename, int RecordID);
+    RangeIterator RangeScan(const char *filename, int lo, int hi);
+    vector<int> MultiSearch(const char *filename, const int *ids, size_t count);
+    vector<int> MultiSearch(const char *filename, const vector<int> &ids) {
+        return MultiSearch(filename, ids.data(), ids.size());
+    }
+    void run();
+    bool OpenIndexFile(const char *filename);
+    bool OpenIndexFileReadOnly(const char *filename);
+    bool RemapIndexFile();
+    // Keeps the whole index in memory: the file is read front to back into an arena of pages, and a
+    // background thread writes it back every snapshotMillis (never if 0) and on close. Changes made
+    // since the last snapshot are lost in a crash; the write-ahead log is not used in this mode.
+    bool OpenIndexFileInMemory(const char *filename, int snapshotMillis = DefaultSnapshotMillis);
+    bool Snapshot();
+    // Copy-on-write mode (see ReadView) lasts until DisableCopyOnWrite or close, which wait for open
+    // views to go and put the file back in the normal layout. The mode is not saved with the file.
+    bool EnableCopyOnWrite();
+    bool DisableCopyOnWrite();
+    ReadView OpenReadView();
+    // Buffered mode gives every internal node a buffer of up to bufferPages pages of pending changes, so
+    // inserts and deletes only write the root's buffer until it fills and is pushed down a level. It lasts
+    // until DisableBufferedInserts or close, which apply everything still buffered. Range scans apply the
+    // buffers first. In this mode InsertNewRecordAtIndex is a blind insert: it cannot see whether RecordID
+    // is already present, so it returns 1, the root that took it, even for a duplicate. The duplicate is
+    // dropped on reaching the RecordID's leaf, and the Reference already stored stays.
+    bool EnableBufferedInserts(int bufferPages = DefaultBufferPages);
+    bool DisableBufferedInserts();
+    bool ConvertTextIndexFile(const char *textFilename, const char *binaryFilename);
+    template<class Iterator>
+    bool BulkLoad(const char *filename, Iterator first, Iterator last, int m,
+                  double fillFactor = DefaultFillFactor, int spareNodes = 0);
+    bool BulkLoad(const char *filename, const char *inputFilename, int m, double fillFactor = DefaultFillFactor,
+                  int spareNodes = 0, size_t runRecords = DefaultSortRunRecords);
+    void ConfigureBufferPool(size_t frames, BufferPool::Policy policy = BufferPool::LRU);
+    void ConfigureStorage(StorageBackend::Kind kind, unsigned queueDepth = StorageBackend::DefaultQueueDepth);
+    // largest readahead window of a sequential RangeScan, in leaves; 0 turns readahead off
+    void SetScanReadahead(int leaves) { scanReadahead.store(max(0, leaves), memory_order_relaxed); }
+    bool Flush();
+    int ShrinkIndexFile();
+    bool EnableWriteAheadLog(size_t groupRecords = WriteAheadLog::DefaultGroupRecords,
+                             int groupMillis = WriteAheadLog::DefaultGroupMillis);
+    void DisableWriteAheadLog();
+    bool Commit();
+    bool Checkpoint();
+    WriteAheadLog::Stats LogStats() const;
+    BufferPool::Stats BufferStats() const;
+    const char *StorageName() const { return bufferPool.storageName(); }
+
+    // Everything GetMetrics reports. levels is filled only when asked for: it reads every node, root
+    // level first, and those reads are counted in the node-read counter like any other.
+    struct LevelStats {
+        long long nodes = 0;
+        long long entries = 0;
+        double fill = 0; // entries / (nodes * m)
+    };
+    struct IndexMetrics {
+        Metrics::Snapshot operations;
+        BufferPool::Stats buffer;
+        WriteAheadLog::Stats log;
+        int height = 0;
+        vector<LevelStats> levels;
+    };
+    IndexMetrics GetMetrics(bool scanLevels = false);
+    void SetLatencySampling(int every) { metrics.setSampleEvery(every); }
+    bool WriteMetrics(const char *filename, bool scanLevels = true);
+
+    // Checks the whole index, a level at a time with the pages of each level shared out to threads: keys
+    // sorted within nodes and inside the separators above them, every separator the largest key of its
+    // child, every node but the root at least half full, leaves all at one depth and linked in key order,
+    // buffers sorted and inside their node's range, and every page reached once, from the root or along
+    // the free list. Pages are read straight from the file, a run of neighbours per request, or from the
+    // pool when it holds them. The tree is held exclusively meanwhile.
+    struct VerifyReport {
+        bool ok = false;
+        int height = 0;
+        long long nodes = 0;   // nodes of the tree, leaves included
+        long long leaves = 0;
+        long long records = 0;
+        long long bufferPages = 0;
+        long long messages = 0; // changes waiting in buffers
+        long long freePages = 0;
+        long long problemCount = 0;
+        vector<string> problems; // the first MaxVerifyProblems found, sorted
+    };
+    VerifyReport Verify();
+    // threads used by BulkLoad and Verify, 0 for one per hardware thread
+    void SetWorkerThreads(unsigned threads) { workerThreads = threads; }
+
+    //////////////////////////////////////Functions for searching//////////////////////////////////////
+    bool record_valid(int recordNumber) const;
+    int read_val(int rowIndex, int columnIndex);
+    bool isEmpty(int recordNumber);
+    bool isLeaf(int recordNumber);
+    vector<pair<int, int>> read_node_values(int recordNumber);
+
+    vector<BTreeNode> readFile(const char *filename, int &freeHead);
+    void savefile(const char *filename, const vector<BTreeNode> &bTree, int m);
+    const int32_t *readPage(int place);
+    void releasePage(int place, bool dirty = false);
+    static int lowerBound(const int32_t *page, int RecordID);
+    BTreeNode readNode(int place);
+    void readNode(int place, BTreeNode &into);
+    void writeNode(int place, const BTreeNode &node);
+
+
+    /////////////////////////////functions for insert////////////////////////////////////////////
+    int split(BTreeNode &node, BTreeNode &sibling);
+    bool split_root(BTreeNode &root, BTreeNode &first, BTreeNode &second);
+    pair<vector<pair<int, int>>, vector<pair<int, int>>> splitOriginalNode(const vector<pair<int, int>>& originalNode);
+    bool updateAfterInsert(BTreeNode &parent, const BTreeNode &child, BTreeNode &newChild);
+
+private:
+    /////////////////////////////////////Batched writes///////////////////////////////////////////////
+    // A batch is sorted by RecordID and applied in one walk over the subtrees it touches. Every leaf
+    // it reaches is merged with its ops once and spread over as many nodes as it needs, and every
+    // parent takes in the new nodes of all its children, combines the underfull ones with a sibling and
+    // is written once. Nodes are written only on the way back up, so a node is written twice only when
+    // it was left underfull as the only child of its parent and is combined once that parent is.
+    // A leaf left empty with no sibling to combine with is dropped. Subtrees are finished in key order,
+    // so the leaf before it is already final and is relinked at once. Freed places are released only at
+    // the end, so none is reused within a batch. In copy-on-write mode every node is written to a new
+    // place and the batch is published as one version.
+    struct BatchState {
+        bool versioned = false;
+        bool buffered = false;        // internal nodes take the ops into their buffers while they fit
+        bool drain = false;           // every buffer is emptied, so the ops reach the leaves
+        int changed = 0;
+        unordered_set<int> fresh;     // places allocated by this batch
+        unordered_set<int> unchanged; // places whose node the batch left as it was, so they are not written
+        vector<int> released;         // places freed, or retired, once the batch is done
+        vector<int> underfull;        // written below the minimum as the only child of their parent
+        int before = -1;              // a finished subtree whose last leaf comes just before the nodes being applied
+    };
+    int applyBatchLocked(const BatchOp *first, const BatchOp *last, bool log, bool drain = false);
+    int planBatch(int place, const BatchOp *first, const BatchOp *last, const BatchState &state, int &needed);
+    void applyBatchTo(int place, const BatchOp *first, const BatchOp *last, BatchState &state,
+                      vector<BTreeNode> &out);
+    int mergeBatch(const BTreeNode &leaf, const BatchOp *first, const BatchOp *last,
+                   vector<pair<int, int>> &entries) const;
+    void spreadEntries(BTreeNode &node, const vector<pair<int, int>> &entries, BatchState &state,
+                       vector<BTreeNode> &out);
+    void combineUnderfull(vector<pair<int, int>> &children, vector<BTreeNode> &kids, BatchState &state);
+    void combineBelow(BTreeNode &node, BatchState &state);
+    int batchPlace(BatchState &state);
+    void writeBatchNode(BTreeNode &node, BatchState &state);
+    void unlinkLeaf(const BTreeNode &leaf, const BatchState &state);
+    static BatchOp composeOps(const BatchOp &older, const BatchOp &newer);
+
+    /////////////////////////////////////Buffered inserts/////////////////////////////////////////////
+    // In buffered mode the next field of an internal node, unused otherwise, heads a chain of buffer
+    // pages holding the changes on their way to its subtree, sorted by RecordID with one per RecordID.
+    // A buffer page is marked BufferPage where a node has isLeaf, and holds (type, RecordID, Reference)
+    // triples. Every change goes through the batch walk: a node takes the ops from above into its buffer
+    // while they fit, and otherwise passes all of them and its buffer down to its children, emptied. So
+    // the nodes a batch reshapes have empty buffers, except siblings they are combined with, whose
+    // buffers are joined or split along with them. Changes run alone; lookups collect the messages on
+    // their path, newest highest, and apply them to what the leaf holds.
+    static constexpr int BufferPage = 2;
+    atomic<bool> buffered{false};
+    int bufferPages = 0;
+    int savedBuffers = -1;        // buffers field of the header last read
+    bool messagesPending = false; // a buffer may hold messages
+    int messagesPerPage() const { return 2 * m / 3; }
+    void readBuffer(int chain, vector<BatchOp> &messages, vector<int> &pages);
+    void writeBuffer(BTreeNode &node, const vector<BatchOp> &messages, vector<int> &pages, BatchState &state);
+    bool sameMessages(const int32_t *page, const BatchOp *messages, int count, int link) const;
+    bool takeMessages(const BTreeNode &node, const BatchOp *first, const BatchOp *last, const BatchState &state,
+                      vector<BatchOp> &messages, vector<int> &pages);
+    void shareBuffers(BTreeNode &first, BTreeNode &second, int firstChain, int secondChain, bool merged,
+                      BatchState &state);
+    int changeBuffered(const BatchOp &op);
+    int searchBuffered(int RecordID);
+    bool drainBuffers();
+
+    /////////////////////////////////////Verification/////////////////////////////////////////////////
+    // A node to check, with the keys its parent allows it: low < key <= high. The rightmost nodes' buffers
+    // also hold RecordIDs above every key in the tree.
+    struct VerifyItem {
+        int place;
+        long long low, high;
+        bool rightmost;
+    };
+    struct VerifyState;
+    bool copyPages(const int *places, size_t count, int32_t *out, const vector<int> &dirty);
+    void verifyNodes(const vector<VerifyItem> &level, size_t begin, size_t end, int root, VerifyState &state,
+                     vector<VerifyItem> &below);
+    void verifyBuffer(const VerifyItem &item, int chain, VerifyState &state);
+    void verifyFreeList(VerifyState &state);
+};
+
+template<class Iterator>
+bool BTreeIndex::BulkLoad(const char *filename, Iterator first, Iterator last, int m, double fillFactor, int spareNodes) {
+    vector<pair<int, int>> records(first, last);
+    return bulkLoadRecords(filename, records, m, fillFactor, spareNodes);
+}
+
+#endif // BTREEINDEX_BTREEINDEX_H
@@ -0,0 +1,485 @@
+#include "BufferPool.h"
+#include "PosixIO.h"
+#include <algorithm>
+using namespace std;
+
+BufferPool::BufferPool(size_t capacity, Policy policy) : evictionPolicy(policy), storage(StorageBackend::create()) {
+    configure(capacity, policy);
+}
+
+void BufferPool::attach(int fd, int pageSize) {
+    unique_lock<mutex> guard(poolLatch);
+    attachLocked(guard, fd, pageSize);
+}
+
+void BufferPool::detach() {
+    unique_lock<mutex> guard(poolLatch);
+    detachLocked(guard);
+}
+
+void BufferPool::configure(size_t capacity, Policy policy) {
+    unique_lock<mutex> guard(poolLatch);
+    int openFd = fd, openPageSize = pageSize;
+    detachLocked(guard);
+    evictionPolicy = policy;
+    limit = max(capacity, (size_t) 1);
+    frames.assign(limit, Frame());
+    unused.clear();
+    for (int i = (int) frames.size() - 1; i >= 0; --i) {
+        unused.push_back(i);
+    }
+    if (openFd != -1) {
+        attachLocked(guard, openFd, openPageSize);
+    }
+}
+
+void BufferPool::setStorage(StorageBackend::Kind kind, unsigned queueDepth) {
+    unique_lock<mutex> guard(poolLatch);
+    waitForIO(guard);
+    storage = StorageBackend::create(kind, queueDepth);
+}
+
+const char *BufferPool::storageName() const {
+    lock_guard<mutex> guard(poolLatch);
+    return storage->name();
+}
+
+bool BufferPool::overlapsIO() const {
+    lock_guard<mutex> guard(poolLatch);
+    return storage->overlapping();
+}
+
+void BufferPool::attachLocked(unique_lock<mutex> &guard, int fd, int pageSize) {
+    detachLocked(guard);
+    this->fd = fd;
+    this->pageSize = pageSize;
+    for (auto &frame: frames) {
+        frame.page.assign(pageSize / sizeof(int32_t), -1);
+    }
+}
+
+void BufferPool::detachLocked(unique_lock<mutex> &guard) {
+    flushLocked(guard);
+    frames.resize(limit);
+    for (auto &frame: frames) {
+        frame.place = -1;
+        frame.pinCount = 0;
+        frame.dirty = false;
+        frame.referenced = false;
+        frame.waiting = false;
+    }
+    frameOf.clear();
+    recent.clear();
+    waiting.clear();
+    unused.clear();
+    for (int i = (int) frames.size() - 1; i >= 0; --i) {
+        unused.push_back(i);
+    }
+    hand = 0;
+    dirtyCount = 0;
+    fd = -1;
+}
+
+int32_t *BufferPool::pin(int place, bool load) {
+    unique_lock<mutex> guard(poolLatch);
+    for (;;) {
+        if (fd == -1) {
+            return nullptr;
+        }
+        auto found = frameOf.find(place);
+        if (found != frameOf.end()) {
+            Frame &frame = frames[found->second];
+            if (frame.loading || frame.writing) {
+                // the page is in flight; once it lands it is either resident or, if the read failed, missing
+                ioDone.wait(guard);
+                continue;
+            }
+            counters.hits++;
+            frame.pinCount++;
+            touch(found->second);
+            return pageOf(found->second);
+        }
+
+        int frame = victim(guard);
+        if (frame == -1) {
+            return nullptr;
+        }
+        if (frameOf.find(place) != frameOf.end()) {
+            // another thread brought the page in while the eviction wrote
+            unused.push_back(frame);
+            continue;
+        }
+        counters.misses++;
+        install(frame, place, 1);
+        int32_t *page = pageOf(frame);
+        if (!load) {
+            return page;
+        }
+        frames[frame].loading = true;
+        ioFrames++;
+        int file = fd, bytes = pageSize;
+        guard.unlock();
+        bool read = StorageBackend::read(file, page, bytes, (off_t) place * bytes);
+        guard.lock();
+        frames[frame].loading = false;
+        ioFrames--;
+        ioDone.notify_all();
+        if (!read) {
+            forget(frame);
+            return nullptr;
+        }
+        counters.bytesRead += pageSize;
+        return page;
+    }
+}
+
+size_t BufferPool::prefetch(const int *places, size_t count) {
+    unique_lock<mutex> guard(poolLatch);
+    if (fd == -1) {
+        return 0;
+    }
+    vector<int> wanted;
+    for (size_t i = 0; i < count; ++i) {
+        if (places[i] >= 0 && frameOf.find(places[i]) == frameOf.end()) {
+            wanted.push_back(places[i]);
+        }
+    }
+    sort(wanted.begin(), wanted.end());
+    wanted.erase(unique(wanted.begin(), wanted.end()), wanted.end());
+    wanted.resize(min(wanted.size(), limit / 2));
+
+    // the chosen frames are loading until their reads are back; a pin keeps evictions off them
+    vector<pair<int, int>> loads; // (place, frame)
+    for (int place: wanted) {
+        int frame = victim(guard);
+        if (frame == -1) {
+            break;
+        }
+        if (frameOf.find(place) != frameOf.end()) {
+            unused.push_back(frame);
+            continue;
+        }
+        install(frame, place, 1);
+        frames[frame].loading = true;
+        loads.emplace_back(place, frame);
+    }
+    // counted only now, so the victim calls above never wait for reads that are not issued yet
+    ioFrames += loads.size();
+    vector<char> moved = movePages(loads, false, &guard);
+    size_t loaded = 0;
+    for (size_t i = 0; i < loads.size(); ++i) {
+        int frame = loads[i].second;
+        frames[frame].loading = false;
+        ioFrames--;
+        if (!moved[i]) {
+            forget(frame);
+            continue;
+        }
+        frames[frame].pinCount = 0;
+        counters.misses++;
+        counters.prefetched++;
+        counters.bytesRead += pageSize;
+        loaded++;
+    }
+    ioDone.notify_all();
+    return loaded;
+}
+
+void BufferPool::install(int frame, int place, int pinCount) {
+    frames[frame].place = place;
+    frames[frame].pinCount = pinCount;
+    frames[frame].dirty = false;
+    frames[frame].recency = recent.insert(recent.begin(), frame);
+    frames[frame].referenced = true;
+    frameOf[place] = frame;
+}
+
+void BufferPool::forget(int frame) {
+    Frame &forgotten = frames[frame];
+    if (forgotten.dirty) {
+        dirtyCount--;
+    }
+    frameOf.erase(forgotten.place);
+    (forgotten.waiting ? waiting : recent).erase(forgotten.recency);
+    forgotten.place = -1;
+    forgotten.pinCount = 0;
+    forgotten.dirty = false;
+    forgotten.referenced = false;
+    forgotten.waiting = false;
+    unused.push_back(frame);
+}
+
+void BufferPool::unpin(int place, bool dirty) {
+    lock_guard<mutex> guard(poolLatch);
+    auto found = frameOf.find(place);
+    if (found == frameOf.end()) {
+        return;
+    }
+    Frame &frame = frames[found->second];
+    if (frame.pinCount > 0) {
+        frame.pinCount--;
+    }
+    if (dirty && !frame.dirty) {
+        frame.dirty = true;
+        dirtyCount++;
+    }
+}
+
+bool BufferPool::flush() {
+    unique_lock<mutex> guard(poolLatch);
+    return flushLocked(guard);
+}
+
+bool BufferPool::flushLocked(unique_lock<mutex> &guard) {
+    // a flush is a durability point, so it writes under the latch; evictions' writes finish first
+    waitForIO(guard);
+    vector<int> dirty;
+    for (int i = 0; i < (int) frames.size(); ++i) {
+        if (frames[i].place != -1 && frames[i].dirty) {
+            dirty.push_back(i);
+        }
+    }
+    return writeBack(dirty);
+}
+
+void BufferPool::discardFrom(int place) {
+    unique_lock<mutex> guard(poolLatch);
+    waitForIO(guard);
+    for (int i = 0; i < (int) frames.size(); ++i) {
+        if (frames[i].place >= place) {
+            forget(i);
+        }
+    }
+}
+
+void BufferPool::waitForIO(unique_lock<mutex> &guard) {
+    ioDone.wait(guard, [this] { return ioFrames == 0; });
+}
+
+void BufferPool::setNoSteal(bool noSteal) {
+    lock_guard<mutex> guard(poolLatch);
+    this->noSteal = noSteal;
+    for (int frame: waiting) {
+        frames[frame].waiting = false;
+    }
+    recent.splice(recent.end(), waiting);
+}
+
+size_t BufferPool::dirtyPages() const {
+    lock_guard<mutex> guard(poolLatch);
+    return dirtyCount;
+}
+
+void BufferPool::forEachDirty(const function<void(int place, const int32_t *page)> &visit) {
+    lock_guard<mutex> guard(poolLatch);
+    for (int i = 0; i < (int) frames.size(); ++i) {
+        if (frames[i].place != -1 && frames[i].dirty) {
+            visit(frames[i].place, pageOf(i));
+        }
+    }
+}
+
+bool BufferPool::copyPage(int place, int32_t *out) const {
+    lock_guard<mutex> guard(poolLatch);
+    auto found = frameOf.find(place);
+    if (found == frameOf.end() || frames[found->second].loading) {
+        return false;
+    }
+    copy(frames[found->second].page.begin(), frames[found->second].page.end(), out);
+    return true;
+}
+
+BufferPool::Stats BufferPool::stats() const {
+    lock_guard<mutex> guard(poolLatch);
+    return counters;
+}
+
+void BufferPool::resetStats() {
+    lock_guard<mutex> guard(poolLatch);
+    counters = Stats();
+}
+
+size_t BufferPool::capacity() const {
+    lock_guard<mutex> guard(poolLatch);
+    return limit;
+}
+
+BufferPool::Policy BufferPool::policy() const {
+    lock_guard<mutex> guard(poolLatch);
+    return evictionPolicy;
+}
+
+int BufferPool::victim(unique_lock<mutex> &guard) {
+    int chosen = -1;
+    while (chosen == -1) {
+        if (!unused.empty()) {
+            int frame = unused.back();
+            unused.pop_back();
+            return frame;
+        }
+
+        if (evictionPolicy == LRU) {
+            // under no-steal a dirty frame cannot leave before the next checkpoint, so the search sets it
+            // aside rather than pass it again on every later miss
+            for (auto it = recent.end(); it != recent.begin();) {
+                auto current = prev(it);
+                Frame &frame = frames[*current];
+                if (frame.pinCount == 0 && !(noSteal && frame.dirty)) {
+                    chosen = *current;
+                    break;
+                }
+                if (noSteal && frame.dirty && frame.pinCount == 0) {
+                    waiting.splice(waiting.begin(), recent, current);
+                    frame.waiting = true;
+                } else {
+                    it = current;
+                }
+            }
+        } else {
+            // two sweeps are enough: the first clears every reference bit it passes
+            for (size_t step = 0; step < 2 * frames.size(); ++step) {
+                Frame &frame = frames[hand];
+                int current = (int) hand;
+                hand = (hand + 1) % frames.size();
+                if (frame.pinCount > 0 || (noSteal && frame.dirty)) {
+                    continue;
+                }
+                if (frame.referenced) {
+                    frame.referenced = false;
+                    continue;
+                }
+                chosen = current;
+                break;
+            }
+        }
+        if (chosen == -1 && ioFrames > 0) {
+            // frames in flight stay pinned only until their I/O lands
+            ioDone.wait(guard);
+            continue;
+        }
+        if (chosen == -1) {
+            if (!noSteal) {
+                return -1;
+            }
+            // every frame is pinned or waiting for the next checkpoint, so add one rather than fail
+            frames.emplace_back();
+            frames.back().page.assign(pageSize / sizeof(int32_t), -1);
+            return (int) frames.size() - 1;
+        }
+    }
+
+    if (frames[chosen].dirty) {
+        // the next evictions would most likely pay for the other cold dirty pages one write at a time
+        vector<int> batch{chosen};
+        for (auto it = recent.rbegin(); it != recent.rend() && batch.size() < WriteBehindPages; ++it) {
+            if (*it != chosen && frames[*it].dirty && frames[*it].pinCount == 0) {
+                batch.push_back(*it);
+            }
+        }
+        // other threads miss, hit and evict meanwhile; frames may grow, so the frame is looked up again after
+        if (!writeBack(batch, &guard) || frames[chosen].dirty) {
+            return -1;
+        }
+    }
+    Frame &frame = frames[chosen];
+    counters.evictions++;
+    frameOf.erase(frame.place);
+    recent.erase(frame.recency);
+    frame.place = -1;
+    frame.pinCount = 0;
+    frame.dirty = false;
+    frame.referenced = false;
+    return chosen;
+}
+
+bool BufferPool::writeBack(const vector<int> &dirtyFrames, unique_lock<mutex> *release) {
+    vector<pair<int, int>> pages; // (place, frame)
+    for (int frame: dirtyFrames) {
+        pages.emplace_back(frames[frame].place, frame);
+        if (release != nullptr) {
+            // the pin keeps other evictions off the frame, and writing makes pin wait so no change is lost
+            frames[frame].writing = true;
+            frames[frame].pinCount++;
+            ioFrames++;
+        }
+    }
+    vector<char> moved = movePages(pages, true, release);
+    bool ok = true;
+    for (size_t i = 0; i < pages.size(); ++i) {
+        Frame &frame = frames[pages[i].second];
+        if (release != nullptr) {
+            frame.writing = false;
+            frame.pinCount--;
+            ioFrames--;
+        }
+        ok = ok && moved[i];
+        if (moved[i]) {
+            frame.dirty = false;
+            if (frame.waiting) {
+                // it has stayed cold since it was set aside
+                recent.splice(recent.end(), waiting, frame.recency);
+                frame.waiting = false;
+            }
+            dirtyCount--;
+            counters.writeBacks++;
+            counters.bytesWritten += pageSize;
+        }
+    }
+    if (release != nullptr) {
+        ioDone.notify_all();
+    }
+    return ok;
+}
+
+vector<char> BufferPool::movePages(vector<pair<int, int>> &pages, bool write, unique_lock<mutex> *release) {
+    // pages next to each other in the file move as one request, scattered over their frames
+    sort(pages.begin(), pages.end());
+    vector<iovec> segments(pages.size());
+    vector<StorageBackend::Request> requests;
+    vector<size_t> firstOf;
+    for (size_t i = 0; i < pages.size();) {
+        size_t j = i + 1;
+        while (j < pages.size() && j - i < MaxRunPages && pages[j].first == pages[j - 1].first + 1) {
+            j++;
+        }
+        for (size_t k = i; k < j; ++k) {
+            segments[k] = {pageOf(pages[k].second), (size_t) pageSize};
+        }
+        StorageBackend::Request request{pageOf(pages[i].second), (j - i) * pageSize,
+                                        (off_t) pages[i].first * pageSize, write};
+        if (j - i > 1) {
+            request.segments = &segments[i];
+            request.segmentCount = (int) (j - i);
+        }
+        requests.push_back(request);
+        firstOf.push_back(i);
+        i = j;
+    }
+    if (release != nullptr) {
+        // the frames' page buffers stay in place, and attach, detach and setStorage wait for this to finish
+        StorageBackend *backend = storage.get();
+        int file = fd;
+        release->unlock();
+        backend->run(file, requests.data(), requests.size());
+        release->lock();
+    } else {
+        storage->run(fd, requests.data(), requests.size());
+    }
+    // a short read at the end of the file still delivers the pages before it
+    vector<char> moved(pages.size(), 0);
+    for (size_t r = 0; r < requests.size(); ++r) {
+        size_t count = requests[r].segments != nullptr ? requests[r].segmentCount : 1;
+        for (size_t k = 0; k < count; ++k) {
+            moved[firstOf[r] + k] = requests[r].result >= (ssize_t) ((k + 1) * pageSize);
+        }
+    }
+    return moved;
+}
+
+void BufferPool::touch(int frame) {
+    frames[frame].referenced = true;
+    if (evictionPolicy == LRU) {
+        recent.splice(recent.begin(), frames[frame].waiting ? waiting : recent, frames[frame].recency);
+        frames[frame].waiting = false;
+    }
+}
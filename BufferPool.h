@@ -0,0 +1,124 @@
+#ifndef BTREEINDEX_BUFFERPOOL_H
+#define BTREEINDEX_BUFFERPOOL_H
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include "StorageBackend.h"
+using namespace std;
+
+// Caches node pages of one open index file by place. A page handed out by pin stays in memory
+// until it is unpinned; dirty pages are written back when they are evicted or on flush.
+// In no-steal mode dirty pages are never evicted; the pool grows past its capacity instead and
+// only flush writes them, which is what the write-ahead log relies on.
+// Every call takes the pool's own mutex, so the pool can be shared by threads; keeping a pinned
+// page's contents consistent is left to the caller's node latches. A miss reads its page, and an
+// eviction writes its dirty pages back, with the mutex released: the frames involved are marked loading
+// or writing and stay pinned, and a thread that wants one of them waits until its I/O is done, so misses
+// on different pages overlap. Flush writes under the mutex, once the I/O in flight is done.
+// Batches go through a StorageBackend: prefetch loads many places with their reads in flight together,
+// flush writes every dirty page as one batch, and evicting a dirty page writes it back together with
+// the other dirty, unpinned pages at the cold end of the pool, so later evictions find them clean.
+// Within a batch, pages at consecutive places move as one scattered request.
+class BufferPool {
+public:
+    enum Policy { LRU, CLOCK };
+
+    struct Stats {
+        long long hits = 0;
+        long long misses = 0;
+        long long evictions = 0;
+        long long writeBacks = 0;
+        long long bytesRead = 0;    // file bytes read by misses
+        long long bytesWritten = 0; // file bytes written back
+        long long prefetched = 0;   // misses loaded ahead of time by prefetch
+    };
+
+    explicit BufferPool(size_t capacity = DefaultCapacity, Policy policy = LRU);
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    static const size_t DefaultCapacity = 256;
+    static const size_t WriteBehindPages = 32; // dirty pages written together when an eviction finds one
+    static const size_t MaxRunPages = 64;      // pages next to each other in the file moved by one request
+
+    void attach(int fd, int pageSize);
+    void detach();
+    void configure(size_t capacity, Policy policy);
+    void setStorage(StorageBackend::Kind kind, unsigned queueDepth = StorageBackend::DefaultQueueDepth);
+    const char *storageName() const;
+    bool overlapsIO() const; // whether a batch costs less than its requests one after another
+
+    // load = false skips the read for callers that overwrite the whole page
+    int32_t *pin(int place, bool load = true);
+    void unpin(int place, bool dirty = false);
+    // loads the places that are not resident yet, unpinned, with all their reads issued at once; at most
+    // half the pool is loaded per call so a prefetch cannot push out everything else. Returns the number loaded.
+    size_t prefetch(const int *places, size_t count);
+    bool flush();
+    // forget every page at or past `place` without writing it, for a file about to be cut there
+    void discardFrom(int place);
+    void setNoSteal(bool noSteal);
+    size_t dirtyPages() const;
+    void forEachDirty(const function<void(int place, const int32_t *page)> &visit);
+    // copies a resident page into out without touching its recency; false if it is not resident
+    bool copyPage(int place, int32_t *out) const;
+
+    Stats stats() const;
+    void resetStats();
+    size_t capacity() const;
+    Policy policy() const;
+
+private:
+    struct Frame {
+        int place = -1;
+        int pinCount = 0;
+        bool dirty = false;
+        bool referenced = false;
+        bool waiting = false; // in waiting rather than recent
+        bool loading = false; // its page is being read in, with the mutex released
+        bool writing = false; // its page is being written back by an eviction, with the mutex released
+        list<int>::iterator recency;
+        vector<int32_t> page;
+    };
+
+    mutable mutex poolLatch;
+    condition_variable ioDone; // a frame stopped loading or writing
+    size_t ioFrames = 0;       // frames loading or writing
+    int fd = -1;
+    int pageSize = 0;
+    Policy evictionPolicy;
+    size_t limit = 0;
+    bool noSteal = false;
+    vector<Frame> frames;           // each frame owns its page buffer, so growing frames keeps pages in place
+    unordered_map<int, int> frameOf; // place -> frame
+    list<int> recent;               // LRU order of resident frames, most recent first
+    list<int> waiting;              // no-steal: dirty frames the LRU search set aside until they are written
+    vector<int> unused;
+    size_t hand = 0;                // CLOCK hand
+    size_t dirtyCount = 0;
+    Stats counters;
+    unique_ptr<StorageBackend> storage;
+
+    int32_t *pageOf(int frame) { return frames[frame].page.data(); }
+    void attachLocked(unique_lock<mutex> &guard, int fd, int pageSize);
+    void detachLocked(unique_lock<mutex> &guard);
+    bool flushLocked(unique_lock<mutex> &guard);
+    void waitForIO(unique_lock<mutex> &guard);
+    int victim(unique_lock<mutex> &guard);
+    // with release set, the frames are written with the mutex released and marked writing meanwhile
+    bool writeBack(const vector<int> &dirtyFrames, unique_lock<mutex> *release = nullptr);
+    // (place, frame); which pages moved. With release set, the I/O runs with the mutex released
+    vector<char> movePages(vector<pair<int, int>> &pages, bool write, unique_lock<mutex> *release = nullptr);
+    void install(int frame, int place, int pinCount);
+    void forget(int frame);
+    void touch(int frame);
+};
+
+#endif // BTREEINDEX_BUFFERPOOL_H
@@ -0,0 +1,51 @@
+#ifndef BTREEINDEX_LATCH_H
+#define BTREEINDEX_LATCH_H
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+using namespace std;
+
+// Reader/writer latch for one tree node. It is a single word, so an index can keep one per node.
+// A waiting writer stops new readers from getting in, so writers are not starved by lookups.
+class Latch {
+public:
+    void lockShared() {
+        for (;;) {
+            int32_t state = word.load(memory_order_relaxed);
+            if (!(state & (Writer | Waiting)) &&
+                word.compare_exchange_weak(state, state + 1, memory_order_acquire)) {
+                return;
+            }
+            this_thread::yield();
+        }
+    }
+
+    void unlockShared() {
+        word.fetch_sub(1, memory_order_release);
+    }
+
+    void lock() {
+        for (;;) {
+            int32_t state = word.load(memory_order_relaxed);
+            if ((state & ~Waiting) == 0 && word.compare_exchange_weak(state, Writer, memory_order_acquire)) {
+                return;
+            }
+            if (!(state & Waiting)) {
+                word.fetch_or(Waiting, memory_order_relaxed);
+            }
+            this_thread::yield();
+        }
+    }
+
+    void unlock() {
+        word.fetch_and(~Writer, memory_order_release);
+    }
+
+private:
+    static const int32_t Writer = 1 << 30;
+    static const int32_t Waiting = 1 << 29;
+    atomic<int32_t> word{0}; // Writer | Waiting | number of readers
+};
+
+#endif // BTREEINDEX_LATCH_H
@@ -0,0 +1,64 @@
+#include "Metrics.h"
+#include <unordered_map>
+using namespace std;
+
+Metrics::Shard &Metrics::shardFor(uint64_t id) {
+    // a thread that moves between indexes keeps the shard it has in each, so it records into one shard
+    // per index however often it switches; only the first visit takes the lock
+    thread_local unordered_map<uint64_t, Shard *> known;
+    auto found = known.find(id);
+    if (found != known.end()) {
+        return *found->second;
+    }
+    lock_guard<mutex> guard(shardLatch);
+    shards.push_back(make_unique<Shard>());
+    known[id] = shards.back().get();
+    return *shards.back();
+}
+
+Metrics::Snapshot Metrics::snapshot() const {
+    Snapshot total;
+    lock_guard<mutex> guard(shardLatch);
+    for (const auto &shard: shards) {
+        for (int c = 0; c < CounterCount; ++c) {
+            total.counters[c] += shard->counters[c].load(memory_order_relaxed);
+        }
+        for (int o = 0; o < OperationCount; ++o) {
+            total.calls[o] += shard->calls[o].load(memory_order_relaxed);
+            Histogram &histogram = total.latency[o];
+            histogram.count += shard->count[o].load(memory_order_relaxed);
+            histogram.sumNanos += shard->sumNanos[o].load(memory_order_relaxed);
+            for (int b = 0; b < Buckets; ++b) {
+                histogram.buckets[b] += shard->buckets[o][b].load(memory_order_relaxed);
+            }
+        }
+    }
+    return total;
+}
+
+double Metrics::Histogram::percentileNanos(double q) const {
+    // the upper bound of the bucket holding the q-th latency, so the answer is within a factor of two
+    long long total = 0;
+    for (long long bucket: buckets) {
+        total += bucket;
+    }
+    long long seen = 0;
+    for (int b = 0; b < Buckets; ++b) {
+        seen += buckets[b];
+        if (total > 0 && seen >= q * total) {
+            return upperBoundNanos(b);
+        }
+    }
+    return 0;
+}
+
+const char *Metrics::name(Counter counter) {
+    static const char *names[] = {"node_reads", "node_writes", "splits", "root_splits", "borrows", "merges",
+                                  "file_growths", "buffer_flushes"};
+    return names[counter];
+}
+
+const char *Metrics::name(Operation operation) {
+    static const char *names[] = {"search", "insert", "delete", "range_scan", "multi_search", "apply_batch"};
+    return names[operation];
+}
@@ -0,0 +1,133 @@
+#ifndef BTREEINDEX_METRICS_H
+#define BTREEINDEX_METRICS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Operation counters and latency histograms of one BTreeIndex. Every thread records into its own
+// shard, found through a thread-local cache, with plain relaxed loads and stores: the hot path takes
+// no lock and does no read-modify-write. Calls are counted exactly, but only every sampleEvery-th
+// call of a thread is timed, since reading the clock twice costs about as much as a cached lookup.
+// snapshot() sums the shards; while other threads record it may be a few operations behind.
+class Metrics {
+    struct Shard;
+
+public:
+    enum Counter {
+        NodeReads, NodeWrites, Splits, RootSplits, Borrows, Merges, FileGrowths, BufferFlushes, CounterCount
+    };
+    enum Operation { Search, Insert, Delete, RangeScan, MultiSearch, ApplyBatch, OperationCount };
+
+    // bucket b counts latencies below 2^(b + FirstBucketShift) ns; the last bucket is unbounded
+    static const int Buckets = 24;
+    static const int FirstBucketShift = 7; // 128 ns
+
+    struct Histogram {
+        long long count = 0;
+        long long sumNanos = 0;
+        long long buckets[Buckets] = {};
+
+        static double upperBoundNanos(int bucket) { return double(1LL << (bucket + FirstBucketShift)); }
+        double percentileNanos(double q) const;
+    };
+
+    struct Snapshot {
+        long long counters[CounterCount] = {};
+        long long calls[OperationCount] = {};
+        Histogram latency[OperationCount]; // sampled calls only
+    };
+
+    static const int DefaultSampleEvery = 8;
+
+    Metrics() : id(nextId.fetch_add(1)) {}
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
+    void add(Counter counter, long long n = 1) {
+        bump(shard().counters[counter], n);
+    }
+
+    // 1 times every call
+    void setSampleEvery(int every) { sampleEvery.store(max(1, every), memory_order_relaxed); }
+
+    // counts the enclosing scope as one call of `operation` and times it if it is sampled
+    class Timer {
+    public:
+        Timer(Metrics &metrics, Operation operation) : mine(metrics.shard()), operation(operation) {
+            bump(mine.calls[operation], 1);
+            if (--mine.untilSample[operation] <= 0) {
+                mine.untilSample[operation] = metrics.sampleEvery.load(memory_order_relaxed);
+                sampled = true;
+                start = chrono::steady_clock::now();
+            }
+        }
+        ~Timer() {
+            if (sampled) {
+                record(mine, operation, chrono::duration_cast<chrono::nanoseconds>(
+                        chrono::steady_clock::now() - start).count());
+            }
+        }
+    private:
+        Shard &mine;
+        Operation operation;
+        bool sampled = false;
+        chrono::steady_clock::time_point start;
+    };
+
+    Snapshot snapshot() const;
+
+    static const char *name(Counter counter);
+    static const char *name(Operation operation);
+
+private:
+    struct alignas(64) Shard {
+        int untilSample[OperationCount] = {}; // calls of the owning thread left until the next timed one
+        atomic<long long> counters[CounterCount] = {};
+        atomic<long long> calls[OperationCount] = {};
+        atomic<long long> count[OperationCount] = {};
+        atomic<long long> sumNanos[OperationCount] = {};
+        atomic<long long> buckets[OperationCount][Buckets] = {};
+    };
+
+    static inline atomic<uint64_t> nextId{1};
+    const uint64_t id; // never reused, so a thread's cached shard can't outlive its Metrics unnoticed
+
+    mutable mutex shardLatch; // shards; taken once per thread, when it first records
+    vector<unique_ptr<Shard>> shards;
+    atomic<int> sampleEvery{DefaultSampleEvery};
+
+    // only the owning thread writes a shard, so a relaxed load and store is enough
+    static void bump(atomic<long long> &value, long long n) {
+        value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+
+    static void record(Shard &mine, Operation operation, long long nanos) {
+        // bucket b holds [2^(b + FirstBucketShift - 1), 2^(b + FirstBucketShift)), bucket 0 everything below
+        int bits = 64 - __builtin_clzll((unsigned long long) nanos | 1);
+        int bucket = min(Buckets - 1, max(0, bits - FirstBucketShift));
+        bump(mine.count[operation], 1);
+        bump(mine.sumNanos[operation], nanos);
+        bump(mine.buckets[operation][bucket], 1);
+    }
+
+    Shard &shard() {
+        thread_local uint64_t cachedId = 0;
+        thread_local Shard *cached = nullptr;
+        if (cachedId != id) {
+            cached = &shardFor(id);
+            cachedId = id;
+        }
+        return *cached;
+    }
+
+    Shard &shardFor(uint64_t id);
+};
+
+#endif // BTREEINDEX_METRICS_H
@@ -0,0 +1,121 @@
+#ifndef BTREEINDEX_NODESEARCH_H
+#define BTREEINDEX_NODESEARCH_H
+
+#include <cstdint>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BTREEINDEX_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+using namespace std;
+
+// Lower bound over the sorted int32 keys of one node page: the number of keys below `key`.
+// Binary search narrows the range to a window of Window keys, then the window is compared a whole
+// vector at a time and the movemask bits are counted, so wide nodes avoid most unpredictable branches.
+// The widest kernel the CPU supports is picked once at startup; other targets use the scalar one.
+class NodeSearch {
+public:
+    enum Kernel { Scalar, SSE2, AVX2 };
+    typedef int (*Function)(const int32_t *keys, int count, int key);
+
+    static const int Window = 32;
+
+    static int lowerBound(const int32_t *keys, int count, int key) {
+        return selected(keys, count, key);
+    }
+
+    static bool available(Kernel kernel) {
+#ifdef BTREEINDEX_X86_KERNELS
+        if (kernel == AVX2) {
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+        }
+        return true;
+#else
+        return kernel == Scalar;
+#endif
+    }
+
+    static Function kernelFunction(Kernel kernel) {
+#ifdef BTREEINDEX_X86_KERNELS
+        if (kernel == AVX2) {
+            return avx2LowerBound;
+        }
+        if (kernel == SSE2) {
+            return sse2LowerBound;
+        }
+#endif
+        return scalarLowerBound;
+    }
+
+    static Kernel best() {
+        return available(AVX2) ? AVX2 : available(SSE2) ? SSE2 : Scalar;
+    }
+
+    static const char *name(Kernel kernel) {
+        return kernel == AVX2 ? "avx2" : kernel == SSE2 ? "sse2" : "scalar";
+    }
+
+    static int scalarLowerBound(const int32_t *keys, int count, int key) {
+        int low = 0, high = count;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (keys[mid] < key) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return low;
+    }
+
+#ifdef BTREEINDEX_X86_KERNELS
+    static int sse2LowerBound(const int32_t *keys, int count, int key) {
+        int low = 0, high = count;
+        narrow(keys, low, high, key);
+        __m128i probe = _mm_set1_epi32(key);
+        int i = low;
+        for (; i + 4 <= high; i += 4) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i));
+            int below = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(probe, block)));
+            low += (0x4332322132212110ULL >> (4 * below)) & 0xf; // popcount of a 4-bit mask, no POPCNT needed
+        }
+        for (; i < high; ++i) {
+            low += keys[i] < key;
+        }
+        return low;
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    static int avx2LowerBound(const int32_t *keys, int count, int key) {
+        int low = 0, high = count;
+        narrow(keys, low, high, key);
+        __m256i probe = _mm256_set1_epi32(key);
+        int i = low;
+        for (; i + 8 <= high; i += 8) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i));
+            int below = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(probe, block)));
+            low += __builtin_popcount(below);
+        }
+        for (; i < high; ++i) {
+            low += keys[i] < key;
+        }
+        return low;
+    }
+#endif
+
+private:
+    static inline const Function selected = kernelFunction(best());
+
+    // binary search until at most Window keys are left in [low, high); keys before low are all below key
+    static void narrow(const int32_t *keys, int &low, int &high, int key) {
+        while (high - low > Window) {
+            int mid = (low + high) / 2;
+            if (keys[mid] < key) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+    }
+};
+
+#endif // BTREEINDEX_NODESEARCH_H
@@ -0,0 +1,123 @@
+#ifndef BTREEINDEX_PAGEARENA_H
+#define BTREEINDEX_PAGEARENA_H
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <new>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include "StorageBackend.h"
+using namespace std;
+
+// Node pages of an index kept wholly in memory, indexed by place like the file they come from. Pages
+// live in chunks of ChunkPages that are allocated once and never move, so a page pointer stays valid
+// while the arena grows and a node costs no allocation of its own.
+// Each chunk has a twin, its image, holding the pages as they were at the last capture. capture copies
+// only the pages marked dirty since then, so the caller keeps writers out just for that copy and can
+// write the images to disk while the live pages go on changing.
+// page and markDirty take no lock: callers latch the node, and keep growth and capture apart from
+// writers themselves. The chunk table is sized once, so page may run while the arena grows.
+class PageArena {
+public:
+    static constexpr int ChunkPages = 1024;
+    static constexpr int MaxChunks = 1 << 16;
+
+    // an image of consecutive pages, ready to be written at offset
+    struct Run {
+        const int32_t *pages;
+        size_t bytes;
+        off_t offset;
+    };
+
+    void reset(int pageSize = 0) {
+        chunkCount.store(0);
+        vector<unique_ptr<Chunk>>().swap(chunks);
+        if (pageSize > 0) {
+            chunks.reserve(MaxChunks);
+        }
+        this->pageSize = pageSize;
+    }
+    bool active() const { return pageSize > 0; }
+    int capacity() const { return chunkCount.load() * ChunkPages; }
+
+    // false if memory runs out; the pages added are zeroed and clean
+    bool grow(int pages) {
+        size_t words = (size_t) ChunkPages * (pageSize / sizeof(int32_t));
+        while (capacity() < pages) {
+            unique_ptr<Chunk> chunk(new (nothrow) Chunk);
+            if (!chunk || chunks.size() == (size_t) MaxChunks) {
+                return false;
+            }
+            chunk->pages.reset(new (nothrow) int32_t[words]());
+            chunk->image.reset(new (nothrow) int32_t[words]());
+            if (!chunk->pages || !chunk->image) {
+                return false;
+            }
+            chunk->dirty.assign(ChunkPages, 0);
+            chunks.push_back(move(chunk));
+            chunkCount.store((int) chunks.size());
+        }
+        return true;
+    }
+
+    int32_t *page(int place) const {
+        size_t words = pageSize / sizeof(int32_t);
+        return chunks[place / ChunkPages]->pages.get() + (size_t) (place % ChunkPages) * words;
+    }
+
+    void markDirty(int place) {
+        chunks[place / ChunkPages]->dirty[place % ChunkPages] = 1;
+    }
+
+    // copies the dirty pages among the first `pages` into the images and returns how many there were;
+    // runs gets the images of those pages chunk by chunk, in file order
+    size_t capture(int pages, vector<Run> &runs) {
+        runs.clear();
+        size_t changed = 0;
+        for (int first = 0; first < pages; first += ChunkPages) {
+            Chunk &chunk = *chunks[first / ChunkPages];
+            int count = min(ChunkPages, pages - first);
+            for (int i = 0; i < count; ++i) {
+                if (chunk.dirty[i]) {
+                    memcpy(chunk.image.get() + (size_t) i * (pageSize / sizeof(int32_t)),
+                           chunk.pages.get() + (size_t) i * (pageSize / sizeof(int32_t)), pageSize);
+                    chunk.dirty[i] = 0;
+                    changed++;
+                }
+            }
+            runs.push_back({chunk.image.get(), (size_t) count * pageSize, (off_t) first * pageSize});
+        }
+        return changed;
+    }
+
+    // reads the first `pages` pages of fd front to back, a chunk per read, into both pages and images
+    bool load(int fd, int pages) {
+        if (!grow(pages)) {
+            return false;
+        }
+        for (int first = 0; first < pages; first += ChunkPages) {
+            Chunk &chunk = *chunks[first / ChunkPages];
+            size_t bytes = (size_t) min(ChunkPages, pages - first) * pageSize;
+            if (!StorageBackend::read(fd, chunk.pages.get(), bytes, (off_t) first * pageSize)) {
+                return false;
+            }
+            memcpy(chunk.image.get(), chunk.pages.get(), bytes);
+        }
+        return true;
+    }
+
+private:
+    struct Chunk {
+        unique_ptr<int32_t[]> pages;
+        unique_ptr<int32_t[]> image;
+        vector<uint8_t> dirty; // a byte per page, so writers of different pages never touch the same location
+    };
+    vector<unique_ptr<Chunk>> chunks; // reserved to MaxChunks, so it never moves
+    atomic<int> chunkCount{0};
+    int pageSize = 0;
+};
+
+#endif // BTREEINDEX_PAGEARENA_H
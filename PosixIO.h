@@ -0,0 +1,41 @@
+#ifndef BTREEINDEX_POSIXIO_H
+#define BTREEINDEX_POSIXIO_H
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+static ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+    if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+        return -1;
+    }
+    return _read(fd, buf, count);
+}
+
+static ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+        return -1;
+    }
+    return _write(fd, buf, count);
+}
+
+static int fsync(int fd) {
+    return _commit(fd);
+}
+
+static int ftruncate(int fd, off_t length) {
+    return _chsize_s(fd, length);
+}
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#endif // BTREEINDEX_POSIXIO_H
@@ -0,0 +1,246 @@
+#include "StorageBackend.h"
+#include "PosixIO.h"
+#include <cerrno>
+#include <cstring>
+using namespace std;
+
+bool StorageBackend::read(int fd, void *buffer, size_t bytes, off_t offset) {
+    return pread(fd, buffer, bytes, offset) == (ssize_t) bytes;
+}
+
+bool StorageBackend::write(int fd, const void *buffer, size_t bytes, off_t offset) {
+    return pwrite(fd, buffer, bytes, offset) == (ssize_t) bytes;
+}
+
+unique_ptr<StorageBackend> StorageBackend::create(Kind kind, unsigned queueDepth) {
+#ifdef BTREEINDEX_IO_URING
+    if (kind != Pread) {
+        auto ring = make_unique<IoUringBackend>(queueDepth);
+        if (ring->usable()) {
+            return ring;
+        }
+    }
+#endif
+    return make_unique<PreadBackend>();
+}
+
+#ifdef _WIN32
+static ssize_t scattered(int fd, const iovec *segments, int count, off_t offset, bool write) {
+    ssize_t moved = 0;
+    for (int i = 0; i < count; ++i) {
+        ssize_t done = write ? pwrite(fd, segments[i].iov_base, segments[i].iov_len, offset + moved)
+                             : pread(fd, segments[i].iov_base, segments[i].iov_len, offset + moved);
+        if (done < 0) {
+            return moved > 0 ? moved : -1;
+        }
+        moved += done;
+        if ((size_t) done < segments[i].iov_len) {
+            break;
+        }
+    }
+    return moved;
+}
+#else
+static ssize_t scattered(int fd, const iovec *segments, int count, off_t offset, bool write) {
+    return write ? pwritev(fd, segments, count, offset) : preadv(fd, segments, count, offset);
+}
+#endif
+
+bool PreadBackend::run(int fd, Request *requests, size_t count) {
+    bool ok = true;
+    for (size_t i = 0; i < count; ++i) {
+        Request &request = requests[i];
+        if (request.segments != nullptr) {
+            request.result = scattered(fd, request.segments, request.segmentCount, request.offset, request.write);
+        } else {
+            request.result = request.write ? pwrite(fd, request.buffer, request.bytes, request.offset)
+                                           : pread(fd, request.buffer, request.bytes, request.offset);
+        }
+        ok = ok && request.result == (ssize_t) request.bytes;
+    }
+    return ok;
+}
+
+#ifdef BTREEINDEX_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+struct IoUringBackend::Ring {
+    int fd = -1;
+    unsigned entries = 0;
+    void *sqMap = MAP_FAILED, *cqMap = MAP_FAILED;
+    size_t sqMapBytes = 0, cqMapBytes = 0;
+    io_uring_sqe *sqes = (io_uring_sqe *) MAP_FAILED;
+    size_t sqesBytes = 0;
+    unsigned *sqTail = nullptr, *sqMask = nullptr, *sqArray = nullptr;
+    unsigned *cqHead = nullptr, *cqTail = nullptr, *cqMask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    bool setUp(unsigned depth);
+    ~Ring();
+};
+
+// the rings are shared with the kernel: it reads our tails and writes its own, and the other way round
+static unsigned loadAcquire(const unsigned *value) {
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+static void storeRelease(unsigned *value, unsigned stored) {
+    __atomic_store_n(value, stored, __ATOMIC_RELEASE);
+}
+
+bool IoUringBackend::Ring::setUp(unsigned depth) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd = (int) syscall(__NR_io_uring_setup, depth, &params);
+    if (fd < 0) {
+        return false;
+    }
+    entries = params.sq_entries;
+    sqMapBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqMapBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        sqMapBytes = cqMapBytes = max(sqMapBytes, cqMapBytes);
+    }
+    sqMap = mmap(nullptr, sqMapBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqMap == MAP_FAILED) {
+        return false;
+    }
+    cqMap = single ? sqMap : mmap(nullptr, cqMapBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                  IORING_OFF_CQ_RING);
+    if (cqMap == MAP_FAILED) {
+        return false;
+    }
+    sqesBytes = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe *) mmap(nullptr, sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                 IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    char *sq = (char *) sqMap, *cq = (char *) cqMap;
+    sqTail = (unsigned *) (sq + params.sq_off.tail);
+    sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *) (sq + params.sq_off.array);
+    cqHead = (unsigned *) (cq + params.cq_off.head);
+    cqTail = (unsigned *) (cq + params.cq_off.tail);
+    cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+    return true;
+}
+
+IoUringBackend::Ring::~Ring() {
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqesBytes);
+    }
+    if (cqMap != MAP_FAILED && cqMap != sqMap) {
+        munmap(cqMap, cqMapBytes);
+    }
+    if (sqMap != MAP_FAILED) {
+        munmap(sqMap, sqMapBytes);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+IoUringBackend::~IoUringBackend() {
+    for (Ring *ring: idle) {
+        delete ring;
+    }
+}
+
+bool IoUringBackend::usable() {
+    Ring *ring = takeRing();
+    if (ring == nullptr) {
+        return false;
+    }
+    returnRing(ring);
+    return true;
+}
+
+IoUringBackend::Ring *IoUringBackend::takeRing() {
+    {
+        lock_guard<mutex> guard(idleLatch);
+        if (!idle.empty()) {
+            Ring *ring = idle.back();
+            idle.pop_back();
+            return ring;
+        }
+    }
+    auto ring = make_unique<Ring>();
+    return ring->setUp(queueDepth) ? ring.release() : nullptr;
+}
+
+void IoUringBackend::returnRing(Ring *ring) {
+    lock_guard<mutex> guard(idleLatch);
+    idle.push_back(ring);
+}
+
+bool IoUringBackend::run(int fd, Request *requests, size_t count) {
+    Ring *ring = count > 1 ? takeRing() : nullptr;
+    if (ring == nullptr) {
+        return PreadBackend().run(fd, requests, count);
+    }
+    // keep the queue full: submit what fits, wait for at least one completion, refill from the rest
+    size_t next = 0, done = 0;
+    unsigned inFlight = 0, unsubmitted = 0;
+    bool broken = false;
+    while (done < count && !broken) {
+        unsigned tail = *ring->sqTail;
+        while (next < count && inFlight < ring->entries) {
+            Request &request = requests[next];
+            unsigned index = tail & *ring->sqMask;
+            io_uring_sqe *sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->fd = fd;
+            if (request.segments != nullptr) {
+                sqe->opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+                sqe->addr = (uint64_t) (uintptr_t) request.segments;
+                sqe->len = (uint32_t) request.segmentCount;
+            } else {
+                sqe->opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+                sqe->addr = (uint64_t) (uintptr_t) request.buffer;
+                sqe->len = (uint32_t) request.bytes;
+            }
+            sqe->off = (uint64_t) request.offset;
+            sqe->user_data = next;
+            ring->sqArray[index] = index;
+            tail++;
+            next++;
+            inFlight++;
+            unsubmitted++;
+        }
+        storeRelease(ring->sqTail, tail);
+
+        int entered = (int) syscall(__NR_io_uring_enter, ring->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS,
+                                    nullptr, 0);
+        if (entered >= 0) {
+            unsubmitted -= min((unsigned) entered, unsubmitted);
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            broken = true;
+        }
+
+        unsigned head = *ring->cqHead;
+        for (unsigned ready = loadAcquire(ring->cqTail); head != ready; ++head) {
+            const io_uring_cqe &cqe = ring->cqes[head & *ring->cqMask];
+            requests[cqe.user_data].result = cqe.res < 0 ? -1 : cqe.res;
+            done++;
+            inFlight--;
+        }
+        storeRelease(ring->cqHead, head);
+    }
+
+    if (broken) {
+        // the kernel may still hold requests of this ring, so it is closed rather than handed to the next batch
+        delete ring;
+        return false;
+    }
+    returnRing(ring);
+    bool ok = true;
+    for (size_t i = 0; i < count; ++i) {
+        ok = ok && requests[i].result == (ssize_t) requests[i].bytes;
+    }
+    return ok;
+}
+#endif
@@ -0,0 +1,88 @@
+#ifndef BTREEINDEX_STORAGEBACKEND_H
+#define BTREEINDEX_STORAGEBACKEND_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+#include <sys/types.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#else
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+using namespace std;
+
+// How the buffer pool moves pages to and from the index file. A single page is always read or
+// written with pread/pwrite: waiting on one request through a queue costs more than the syscall.
+// run moves a batch and returns once all of it is done. The pread backend does the batch one request
+// at a time; the io_uring backend keeps up to queueDepth requests in flight on the device, so a batch
+// of misses costs about one device latency instead of one per page.
+class StorageBackend {
+public:
+    enum Kind { Auto, Pread, IoUring }; // Auto is io_uring where the kernel allows it, pread otherwise
+
+    // a request moves bytes at offset to or from buffer, or, when segments is set, scattered over the
+    // segments, which lets pages that sit next to each other in the file move in one request
+    struct Request {
+        void *buffer;
+        size_t bytes;
+        off_t offset;
+        bool write;
+        const iovec *segments = nullptr;
+        int segmentCount = 0;
+        ssize_t result = -1; // bytes moved, or -1
+    };
+
+    static const unsigned DefaultQueueDepth = 64;
+
+    virtual ~StorageBackend() = default;
+    virtual const char *name() const = 0;
+    virtual bool overlapping() const { return false; } // whether run keeps several requests in flight
+    // true if every request moved all its bytes; each request's result says which did
+    virtual bool run(int fd, Request *requests, size_t count) = 0;
+
+    static bool read(int fd, void *buffer, size_t bytes, off_t offset);
+    static bool write(int fd, const void *buffer, size_t bytes, off_t offset);
+
+    // falls back to pread when io_uring is asked for but cannot be set up
+    static unique_ptr<StorageBackend> create(Kind kind = Auto, unsigned queueDepth = DefaultQueueDepth);
+};
+
+class PreadBackend : public StorageBackend {
+public:
+    const char *name() const override { return "pread"; }
+    bool run(int fd, Request *requests, size_t count) override;
+};
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define BTREEINDEX_IO_URING 1
+
+// Talks to the kernel through the raw io_uring syscalls and the mapped rings, so it needs no library.
+// A ring serves one batch at a time; concurrent batches take further rings from an idle list, creating
+// one when all are busy, so threads never queue behind each other's I/O.
+class IoUringBackend : public StorageBackend {
+public:
+    explicit IoUringBackend(unsigned queueDepth = DefaultQueueDepth) : queueDepth(queueDepth) {}
+    ~IoUringBackend() override;
+    const char *name() const override { return "io_uring"; }
+    bool overlapping() const override { return true; }
+    bool run(int fd, Request *requests, size_t count) override;
+    // false if the kernel refuses to set up a ring (too old, or io_uring disabled)
+    bool usable();
+
+private:
+    struct Ring;
+    unsigned queueDepth;
+    mutex idleLatch;
+    vector<Ring *> idle;
+    Ring *takeRing();
+    void returnRing(Ring *ring);
+};
+#endif
+
+#endif // BTREEINDEX_STORAGEBACKEND_H
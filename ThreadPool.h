@@ -0,0 +1,151 @@
+#ifndef BTREEINDEX_THREADPOOL_H
+#define BTREEINDEX_THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <cstddef>
+using namespace std;
+
+// Work-stealing pool for bulk work over a range: parallelFor cuts the range into chunks and deals each
+// thread's queue one contiguous block of them, so a thread mostly works through neighbouring chunks in
+// order. A thread whose queue runs dry steals from the far end of another's block, which keeps the
+// threads busy when chunks cost unevenly. The thread calling parallelFor is one of the pool's threads and
+// works on the chunks too, so a pool of one thread runs everything inline.
+// Bodies must not call parallelFor on the same pool.
+class ThreadPool {
+public:
+    // 0 threads means one per hardware thread
+    explicit ThreadPool(unsigned threads = 0) {
+        if (threads == 0) {
+            threads = max(1u, thread::hardware_concurrency());
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            queues.emplace_back(new Queue);
+        }
+        for (unsigned i = 1; i < threads; ++i) {
+            workers.emplace_back(&ThreadPool::work, this, i);
+        }
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> guard(idleLatch);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (thread &worker: workers) {
+            worker.join();
+        }
+    }
+
+    unsigned size() const { return (unsigned) queues.size(); }
+
+    // runs body(begin, end) over [0, count) in chunks of at most grain, and returns once all are done
+    void parallelFor(size_t count, size_t grain, const function<void(size_t, size_t)> &body) {
+        if (count == 0) {
+            return;
+        }
+        grain = max<size_t>(1, grain);
+        size_t chunks = (count + grain - 1) / grain;
+        Group group;
+        group.left = chunks;
+        size_t threads = queues.size();
+        for (size_t q = 0; q < threads; ++q) {
+            lock_guard<mutex> guard(queues[q]->latch);
+            for (size_t c = q * chunks / threads; c < (q + 1) * chunks / threads; ++c) {
+                queues[q]->tasks.push_back({&body, c * grain, min(count, (c + 1) * grain), &group});
+            }
+        }
+        {
+            lock_guard<mutex> guard(idleLatch);
+            queued += chunks;
+        }
+        wakeup.notify_all();
+
+        Task task;
+        while (take(0, task)) {
+            run(task);
+        }
+        unique_lock<mutex> idle(idleLatch);
+        finished.wait(idle, [&] { return group.left.load() == 0; });
+    }
+
+private:
+    struct Group {
+        atomic<size_t> left{0};
+    };
+    struct Task {
+        const function<void(size_t, size_t)> *body;
+        size_t begin, end;
+        Group *group;
+    };
+    struct Queue {
+        mutex latch;
+        deque<Task> tasks;
+    };
+
+    vector<unique_ptr<Queue>> queues; // queue 0 belongs to the thread calling parallelFor
+    vector<thread> workers;
+    mutex idleLatch;
+    condition_variable wakeup;   // tasks were queued, or the pool is stopping
+    condition_variable finished; // a group's last task is done
+    size_t queued = 0;           // tasks in the queues, changed under idleLatch
+    bool stopping = false;
+
+    // a thread takes from the front of its own queue and steals from the back of the others
+    bool take(size_t self, Task &task) {
+        for (size_t k = 0; k < queues.size(); ++k) {
+            Queue &queue = *queues[(self + k) % queues.size()];
+            lock_guard<mutex> guard(queue.latch);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (k == 0) {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            } else {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            lock_guard<mutex> idle(idleLatch);
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void run(const Task &task) {
+        (*task.body)(task.begin, task.end);
+        // the group lives on the caller's stack, so it is not touched once its count reaches zero
+        if (task.group->left.fetch_sub(1) == 1) {
+            lock_guard<mutex> idle(idleLatch);
+            finished.notify_all();
+        }
+    }
+
+    void work(size_t self) {
+        Task task;
+        for (;;) {
+            if (take(self, task)) {
+                run(task);
+                continue;
+            }
+            unique_lock<mutex> idle(idleLatch);
+            wakeup.wait(idle, [&] { return stopping || queued > 0; });
+            if (stopping) {
+                return;
+            }
+        }
+    }
+};
+
+#endif // BTREEINDEX_THREADPOOL_H
@@ -0,0 +1,663 @@
+#include "VarKeyIndex.h"
+#include "PosixIO.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+using namespace std;
+
+KeyBuilder &KeyBuilder::addString(const string &part) {
+    for (char c: part) {
+        bytes.push_back(c);
+        if (c == '\0') {
+            bytes.push_back('\xff');
+        }
+    }
+    bytes.push_back('\0');
+    bytes.push_back('\x01');
+    return *this;
+}
+
+KeyBuilder &KeyBuilder::addUint64(uint64_t part) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        bytes.push_back((char) (part >> shift & 0xff));
+    }
+    return *this;
+}
+
+KeyBuilder &KeyBuilder::addInt64(int64_t part) {
+    return addUint64((uint64_t) part ^ (1ULL << 63));
+}
+
+VarKeyIndex::~VarKeyIndex() {
+    closeIndexFile();
+}
+
+bool VarKeyIndex::CreateIndexFile(const char *filename, int pageSize, int flags) {
+    if (pageSize < MinPageSize || pageSize > MaxPageSize || pageSize % 4 != 0) {
+        return false;
+    }
+    unique_lock<shared_mutex> tree(treeLatch);
+    closeIndexFile();
+    indexFile = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (indexFile == -1) {
+        return false;
+    }
+    fileName = filename;
+    this->pageSize = pageSize;
+    this->flags = flags & AllCompression;
+    pageCount = 1;
+    freeHead = -1;
+    bufferPool.attach(indexFile, pageSize);
+    Node leaf;
+    leaf.place = allocatePage();
+    writeNode(leaf);
+    root = leaf.place;
+    writeHeader();
+    return bufferPool.flush();
+}
+
+bool VarKeyIndex::OpenIndexFile(const char *filename) {
+    unique_lock<shared_mutex> tree(treeLatch);
+    closeIndexFile();
+    int file = open(filename, O_RDWR | O_BINARY);
+    if (file == -1) {
+        return false;
+    }
+    int32_t header[HeaderFields];
+    if (pread(file, header, sizeof(header), 0) != (ssize_t) sizeof(header) || header[HeaderMagic] != FileMagic ||
+        header[HeaderVersion] != FormatVersion) {
+        cerr << "Not a variable-length key index file, or an unsupported version of one\n";
+        close(file);
+        return false;
+    }
+    indexFile = file;
+    fileName = filename;
+    pageSize = header[HeaderPageSize];
+    pageCount = header[HeaderPageCount];
+    freeHead = header[HeaderFreeHead];
+    root = header[HeaderRoot];
+    flags = header[HeaderFlags];
+    bufferPool.attach(indexFile, pageSize);
+    return true;
+}
+
+void VarKeyIndex::closeIndexFile() {
+    if (indexFile != -1) {
+        bufferPool.detach();
+        close(indexFile);
+        indexFile = -1;
+    }
+}
+
+bool VarKeyIndex::Flush() {
+    unique_lock<shared_mutex> tree(treeLatch);
+    if (indexFile == -1) {
+        return false;
+    }
+    writeHeader();
+    return bufferPool.flush();
+}
+
+int VarKeyIndex::MaxKeyLength() const {
+    // four of the largest cells, with their slots, fit one page, so any node that overflows can be split
+    // into two halves that both fit
+    return (pageSize - PageHeaderBytes) / 4 - 8;
+}
+
+/////////////////////////////////////////////Lookups/////////////////////////////////////////////
+
+int VarKeyIndex::SearchARecord(const string &key) {
+    shared_lock<shared_mutex> tree(treeLatch);
+    if (indexFile == -1) {
+        return -1;
+    }
+    int place = root;
+    for (;;) {
+        const uint8_t *page = readPage(place);
+        if (page == nullptr) {
+            return -1;
+        }
+        if ((int16_t) field16(page, PageKind) == 1) {
+            int child = childFor(page, key);
+            releasePage(place);
+            place = child;
+            continue;
+        }
+        int slot = lowerBound(page, key);
+        int reference = -1;
+        if (slot < field16(page, PageCount) && prefixMatch(page, key) == 0 && compareToCell(page, slot, key) == 0) {
+            reference = cellValue(page, slot);
+        }
+        releasePage(place);
+        return reference;
+    }
+}
+
+void VarKeyIndex::RangeScan(const string &lo, const string &hi,
+                            const function<bool(const string &key, int reference)> &visit) {
+    shared_lock<shared_mutex> tree(treeLatch);
+    if (indexFile == -1 || hi < lo) {
+        return;
+    }
+    // each leaf is copied out before its entries are visited, so visit may be slow without holding a page
+    vector<Entry> entries;
+    for (int place = leafFor(lo, nullptr), first = 1; place != -1; first = 0) {
+        const uint8_t *page = readPage(place);
+        if (page == nullptr) {
+            return;
+        }
+        int count = field16(page, PageCount);
+        entries.clear();
+        for (int slot = first ? lowerBound(page, lo) : 0; slot < count; ++slot) {
+            entries.push_back({cellKey(page, slot), cellValue(page, slot)});
+        }
+        int next = field32(page, PageLink);
+        releasePage(place);
+        for (const Entry &entry: entries) {
+            if (entry.key > hi || !visit(entry.key, entry.value)) {
+                return;
+            }
+        }
+        place = next;
+    }
+}
+
+int VarKeyIndex::Height() {
+    shared_lock<shared_mutex> tree(treeLatch);
+    int height = 0;
+    for (int place = root; indexFile != -1 && place != -1; height++) {
+        const uint8_t *page = readPage(place);
+        if (page == nullptr) {
+            break;
+        }
+        int child = (int16_t) field16(page, PageKind) == 1 ? field32(page, PageLink) : -1;
+        releasePage(place);
+        place = child;
+    }
+    return height;
+}
+
+int VarKeyIndex::leafFor(const string &key, vector<pair<int, int>> *path) {
+    // writers get the path: each internal place with the child slot taken there (0 is the link child)
+    int place = root;
+    for (;;) {
+        const uint8_t *page = readPage(place);
+        if (page == nullptr || (int16_t) field16(page, PageKind) != 1) {
+            if (page != nullptr) {
+                releasePage(place);
+            }
+            return page == nullptr ? -1 : place;
+        }
+        int slot = upperBound(page, key);
+        int child = slot == 0 ? field32(page, PageLink) : cellValue(page, slot - 1);
+        if (path != nullptr) {
+            path->emplace_back(place, slot);
+        }
+        releasePage(place);
+        place = child;
+    }
+}
+
+/////////////////////////////////////////////Changes/////////////////////////////////////////////
+
+int VarKeyIndex::InsertRecord(const string &key, int Reference) {
+    unique_lock<shared_mutex> tree(treeLatch);
+    if (indexFile == -1 || (int) key.size() > MaxKeyLength()) {
+        return -1;
+    }
+    vector<pair<int, int>> path;
+    int leaf = leafFor(key, &path);
+    if (leaf == -1) {
+        return -1;
+    }
+    // the common case: the key shares the leaf's prefix and its cell fits in the free gap
+    uint8_t *page = reinterpret_cast<uint8_t *>(bufferPool.pin(leaf));
+    if (page == nullptr) {
+        return -1;
+    }
+    int slot = lowerBound(page, key);
+    if (slot < field16(page, PageCount) && prefixMatch(page, key) == 0 && compareToCell(page, slot, key) == 0) {
+        releasePage(leaf);
+        return -1;
+    }
+    bool inPlace = insertIntoPage(page, slot, key, Reference);
+    Node node = inPlace ? Node() : decode(page, leaf);
+    releasePage(leaf, inPlace);
+    if (inPlace) {
+        return leaf;
+    }
+
+    node.entries.insert(node.entries.begin() + slot, Entry{key, Reference});
+    if (encodedBytes(node) <= pageSize) {
+        writeNode(node);
+        return leaf;
+    }
+    size_t at = splitPoint(node);
+    Node right;
+    right.kind = 0;
+    right.place = allocatePage();
+    right.link = node.link;
+    right.entries.assign(node.entries.begin() + at, node.entries.end());
+    node.entries.resize(at);
+    node.link = right.place;
+    string separator = separatorBetween(node.entries.back().key, right.entries.front().key);
+    writeNode(node);
+    writeNode(right);
+    insertSeparator(path, separator, right.place);
+    return key < separator ? node.place : right.place;
+}
+
+void VarKeyIndex::insertSeparator(vector<pair<int, int>> &path, string separator, int right) {
+    if (path.empty()) {
+        // the root split: a new root goes above it
+        Node top;
+        top.kind = 1;
+        top.place = allocatePage();
+        top.link = root;
+        top.entries.push_back(Entry{move(separator), right});
+        writeNode(top);
+        root = top.place;
+        writeHeader();
+        return;
+    }
+    Node parent = readNode(path.back().first);
+    int slot = path.back().second;
+    path.pop_back();
+    parent.entries.insert(parent.entries.begin() + slot, Entry{move(separator), right});
+    if (encodedBytes(parent) <= pageSize) {
+        writeNode(parent);
+        return;
+    }
+    // the middle separator moves up; the child to its right becomes the new node's link child
+    size_t at = splitPoint(parent);
+    Node sibling;
+    sibling.kind = 1;
+    sibling.place = allocatePage();
+    sibling.link = parent.entries[at].value;
+    sibling.entries.assign(make_move_iterator(parent.entries.begin() + at + 1),
+                           make_move_iterator(parent.entries.end()));
+    string promoted = move(parent.entries[at].key);
+    parent.entries.resize(at);
+    writeNode(parent);
+    writeNode(sibling);
+    insertSeparator(path, move(promoted), sibling.place);
+}
+
+bool VarKeyIndex::DeleteRecord(const string &key) {
+    unique_lock<shared_mutex> tree(treeLatch);
+    if (indexFile == -1) {
+        return false;
+    }
+    vector<pair<int, int>> path;
+    int leaf = leafFor(key, &path);
+    if (leaf == -1) {
+        return false;
+    }
+    Node node = readNode(leaf);
+    auto found = lower_bound(node.entries.begin(), node.entries.end(), key,
+                             [](const Entry &entry, const string &k) { return entry.key < k; });
+    if (found == node.entries.end() || found->key != key) {
+        return false;
+    }
+    node.entries.erase(found);
+    fixUnderflow(path, move(node));
+    return true;
+}
+
+void VarKeyIndex::fixUnderflow(vector<pair<int, int>> &path, Node node) {
+    if (path.empty()) {
+        // an internal root left with only its link child hands the root over to that child
+        if (node.kind == 1 && node.entries.empty()) {
+            root = node.link;
+            writeHeader();
+            freePage(node.place);
+        } else {
+            writeNode(node);
+        }
+        return;
+    }
+    if (encodedBytes(node) >= pageSize / 4) {
+        writeNode(node);
+        return;
+    }
+    Node parent = readNode(path.back().first);
+    int slot = path.back().second;
+    path.pop_back();
+    auto childAt = [&parent](int i) { return i == 0 ? parent.link : parent.entries[i - 1].value; };
+    // merging pulls the parent's separator down between the two halves of an internal node
+    auto merge = [this](Node &into, const string &separator, const Node &from) {
+        if (into.kind == 1) {
+            into.entries.push_back(Entry{separator, from.link});
+        } else {
+            into.link = from.link;
+        }
+        into.entries.insert(into.entries.end(), from.entries.begin(), from.entries.end());
+        return encodedBytes(into) <= pageSize;
+    };
+
+    // variable-size entries rarely even out by moving one, so an underfull node only merges, and only
+    // when it and a sibling fit a single page; otherwise it stays as it is
+    if (slot < (int) parent.entries.size()) {
+        Node right = readNode(childAt(slot + 1));
+        Node merged = node;
+        if (merge(merged, parent.entries[slot].key, right)) {
+            writeNode(merged);
+            freePage(right.place);
+            parent.entries.erase(parent.entries.begin() + slot);
+            fixUnderflow(path, move(parent));
+            return;
+        }
+    }
+    if (slot > 0) {
+        Node left = readNode(childAt(slot - 1));
+        if (merge(left, parent.entries[slot - 1].key, node)) {
+            writeNode(left);
+            freePage(node.place);
+            parent.entries.erase(parent.entries.begin() + slot - 1);
+            fixUnderflow(path, move(parent));
+            return;
+        }
+    }
+    writeNode(node);
+}
+
+string VarKeyIndex::separatorBetween(const string &left, const string &right) const {
+    // the shortest prefix of right that sorts after left: one byte past their common prefix
+    if (!(flags & SuffixTruncation)) {
+        return right;
+    }
+    size_t common = 0;
+    while (common < left.size() && common < right.size() && left[common] == right[common]) {
+        common++;
+    }
+    return right.substr(0, common + 1);
+}
+
+size_t VarKeyIndex::splitPoint(const Node &node) const {
+    // halve the bytes rather than the entries, leaving at least one entry on each side (internal nodes
+    // also keep the separator that moves up out of both)
+    size_t total = 0;
+    for (const Entry &entry: node.entries) {
+        total += entry.key.size() + 8;
+    }
+    size_t first = 1, last = node.entries.size() - (node.kind == 1 ? 2 : 1);
+    size_t at = first, bytes = 0;
+    for (size_t i = 0; i < node.entries.size(); ++i) {
+        bytes += node.entries[i].key.size() + 8;
+        if (2 * bytes >= total) {
+            at = i + 1;
+            break;
+        }
+    }
+    return min(max(at, first), last);
+}
+
+//////////////////////////////////////////Page allocation//////////////////////////////////////////
+
+int VarKeyIndex::allocatePage() {
+    if (freeHead == -1) {
+        // append an extent of free pages; they reach the file when the pool writes them back
+        int extent = pageCount / 4 < MinGrowthPages ? MinGrowthPages : pageCount / 4;
+        for (int place = pageCount + extent - 1; place >= pageCount; --place) {
+            Node freed;
+            freed.kind = -1;
+            freed.place = place;
+            freed.link = freeHead;
+            writeNode(freed);
+            freeHead = place;
+        }
+        pageCount += extent;
+    }
+    int place = freeHead;
+    const uint8_t *page = readPage(place);
+    freeHead = page == nullptr ? -1 : field32(page, PageLink);
+    releasePage(place);
+    writeHeader();
+    return place;
+}
+
+void VarKeyIndex::freePage(int place) {
+    Node freed;
+    freed.kind = -1;
+    freed.place = place;
+    freed.link = freeHead;
+    writeNode(freed);
+    freeHead = place;
+    writeHeader();
+}
+
+void VarKeyIndex::writeHeader() {
+    int32_t *page = bufferPool.pin(0, false);
+    if (page == nullptr) {
+        return;
+    }
+    fill(page, page + pageSize / sizeof(int32_t), -1);
+    page[HeaderMagic] = FileMagic;
+    page[HeaderVersion] = FormatVersion;
+    page[HeaderPageSize] = pageSize;
+    page[HeaderPageCount] = pageCount;
+    page[HeaderFreeHead] = freeHead;
+    page[HeaderRoot] = root;
+    page[HeaderFlags] = flags;
+    bufferPool.unpin(0, true);
+}
+
+const uint8_t *VarKeyIndex::readPage(int place) {
+    return reinterpret_cast<const uint8_t *>(bufferPool.pin(place));
+}
+
+void VarKeyIndex::releasePage(int place, bool dirty) {
+    bufferPool.unpin(place, dirty);
+}
+
+VarKeyIndex::Node VarKeyIndex::readNode(int place) {
+    const uint8_t *page = readPage(place);
+    if (page == nullptr) {
+        Node missing;
+        missing.place = place;
+        return missing;
+    }
+    Node node = decode(page, place);
+    releasePage(place);
+    return node;
+}
+
+void VarKeyIndex::writeNode(const Node &node) {
+    uint8_t *page = reinterpret_cast<uint8_t *>(bufferPool.pin(node.place, false));
+    if (page == nullptr) {
+        return;
+    }
+    encode(node, page);
+    releasePage(node.place, true);
+}
+
+///////////////////////////////////////////Slotted pages///////////////////////////////////////////
+
+int VarKeyIndex::field16(const uint8_t *page, int offset) {
+    uint16_t value;
+    memcpy(&value, page + offset, sizeof(value));
+    return value;
+}
+
+void VarKeyIndex::setField16(uint8_t *page, int offset, int value) {
+    uint16_t stored = (uint16_t) value;
+    memcpy(page + offset, &stored, sizeof(stored));
+}
+
+int32_t VarKeyIndex::field32(const uint8_t *page, int offset) {
+    int32_t value;
+    memcpy(&value, page + offset, sizeof(value));
+    return value;
+}
+
+void VarKeyIndex::setField32(uint8_t *page, int offset, int32_t value) {
+    memcpy(page + offset, &value, sizeof(value));
+}
+
+int VarKeyIndex::prefixMatch(const uint8_t *page, const string &key) {
+    // -1 if key sorts before every key of the page, 1 if after, 0 if it starts with the page prefix
+    int length = field16(page, PagePrefixLength);
+    int compared = memcmp(key.data(), page + PageHeaderBytes, min((size_t) length, key.size()));
+    if (compared != 0) {
+        return compared < 0 ? -1 : 1;
+    }
+    return (int) key.size() < length ? -1 : 0;
+}
+
+int VarKeyIndex::compareToCell(const uint8_t *page, int slot, const string &key) {
+    // the sign of (cell key - key) for a key that starts with the page prefix
+    int prefix = field16(page, PagePrefixLength);
+    int cell = field16(page, PageHeaderBytes + prefix + 2 * slot);
+    int length = field16(page, cell);
+    size_t rest = key.size() - prefix;
+    int compared = memcmp(page + cell + 2, key.data() + prefix, min((size_t) length, rest));
+    if (compared != 0) {
+        return compared;
+    }
+    return (size_t) length < rest ? -1 : (size_t) length > rest ? 1 : 0;
+}
+
+int32_t VarKeyIndex::cellValue(const uint8_t *page, int slot) {
+    int cell = field16(page, PageHeaderBytes + field16(page, PagePrefixLength) + 2 * slot);
+    return field32(page, cell + 2 + field16(page, cell));
+}
+
+string VarKeyIndex::cellKey(const uint8_t *page, int slot) {
+    int prefix = field16(page, PagePrefixLength);
+    int cell = field16(page, PageHeaderBytes + prefix + 2 * slot);
+    string key(reinterpret_cast<const char *>(page + PageHeaderBytes), prefix);
+    key.append(reinterpret_cast<const char *>(page + cell + 2), field16(page, cell));
+    return key;
+}
+
+int VarKeyIndex::lowerBound(const uint8_t *page, const string &key) const {
+    int count = field16(page, PageCount);
+    int match = prefixMatch(page, key);
+    if (match != 0) {
+        return match < 0 ? 0 : count;
+    }
+    int low = 0, high = count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (compareToCell(page, mid, key) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+int VarKeyIndex::upperBound(const uint8_t *page, const string &key) const {
+    int count = field16(page, PageCount);
+    int match = prefixMatch(page, key);
+    if (match != 0) {
+        return match < 0 ? 0 : count;
+    }
+    int low = 0, high = count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (compareToCell(page, mid, key) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+int VarKeyIndex::childFor(const uint8_t *page, const string &key) const {
+    int slot = upperBound(page, key);
+    return slot == 0 ? field32(page, PageLink) : cellValue(page, slot - 1);
+}
+
+int VarKeyIndex::encodedBytes(const Node &node) const {
+    size_t prefix = 0;
+    if ((flags & PrefixCompression) && !node.entries.empty()) {
+        const string &first = node.entries.front().key, &last = node.entries.back().key;
+        while (prefix < first.size() && prefix < last.size() && first[prefix] == last[prefix]) {
+            prefix++;
+        }
+    }
+    size_t bytes = PageHeaderBytes + prefix;
+    for (const Entry &entry: node.entries) {
+        bytes += 2 + 2 + (entry.key.size() - prefix) + 4;
+    }
+    return (int) min(bytes, (size_t) pageSize + 1);
+}
+
+bool VarKeyIndex::encode(const Node &node, uint8_t *page) const {
+    if (encodedBytes(node) > pageSize) {
+        return false;
+    }
+    // the keys are sorted, so the prefix every key shares is the one the first and last share
+    size_t prefix = 0;
+    if ((flags & PrefixCompression) && !node.entries.empty()) {
+        const string &first = node.entries.front().key, &last = node.entries.back().key;
+        while (prefix < first.size() && prefix < last.size() && first[prefix] == last[prefix]) {
+            prefix++;
+        }
+    }
+    memset(page, 0, pageSize);
+    setField16(page, PageKind, node.kind);
+    setField16(page, PageCount, (int) node.entries.size());
+    setField16(page, PagePrefixLength, (int) prefix);
+    setField32(page, PageLink, node.link);
+    if (prefix > 0) {
+        memcpy(page + PageHeaderBytes, node.entries.front().key.data(), prefix);
+    }
+    int heap = pageSize;
+    int slots = PageHeaderBytes + (int) prefix;
+    for (size_t i = 0; i < node.entries.size(); ++i) {
+        const Entry &entry = node.entries[i];
+        int length = (int) (entry.key.size() - prefix);
+        heap -= 2 + length + 4;
+        setField16(page, heap, length);
+        memcpy(page + heap + 2, entry.key.data() + prefix, length);
+        setField32(page, heap + 2 + length, entry.value);
+        setField16(page, slots + 2 * (int) i, heap);
+    }
+    setField16(page, PageHeapStart, heap);
+    return true;
+}
+
+VarKeyIndex::Node VarKeyIndex::decode(const uint8_t *page, int place) const {
+    Node node;
+    node.kind = (int16_t) field16(page, PageKind);
+    node.place = place;
+    node.link = field32(page, PageLink);
+    if (node.kind == -1) {
+        return node;
+    }
+    int count = field16(page, PageCount);
+    node.entries.reserve(count + 1);
+    for (int slot = 0; slot < count; ++slot) {
+        node.entries.push_back(Entry{cellKey(page, slot), cellValue(page, slot)});
+    }
+    return node;
+}
+
+bool VarKeyIndex::insertIntoPage(uint8_t *page, int slot, const string &key, int32_t value) const {
+    // a new cell goes just below the heap and its slot is opened in the slot array; nothing else moves
+    if ((int16_t) field16(page, PageKind) != 0 || prefixMatch(page, key) != 0) {
+        return false;
+    }
+    int prefix = field16(page, PagePrefixLength);
+    int count = field16(page, PageCount);
+    int heap = field16(page, PageHeapStart);
+    int slots = PageHeaderBytes + prefix;
+    int length = (int) key.size() - prefix;
+    int cellBytes = 2 + length + 4;
+    if (heap - (slots + 2 * count) < cellBytes + 2) {
+        return false;
+    }
+    heap -= cellBytes;
+    setField16(page, heap, length);
+    memcpy(page + heap + 2, key.data() + prefix, length);
+    setField32(page, heap + 2 + length, value);
+    memmove(page + slots + 2 * (slot + 1), page + slots + 2 * slot, 2 * (count - slot));
+    setField16(page, slots + 2 * slot, heap);
+    setField16(page, PageCount, count + 1);
+    setField16(page, PageHeapStart, heap);
+    return true;
+}
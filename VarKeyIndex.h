@@ -0,0 +1,128 @@
+#ifndef BTREEINDEX_VARKEYINDEX_H
+#define BTREEINDEX_VARKEYINDEX_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <shared_mutex>
+#include "BufferPool.h"
+using namespace std;
+
+// Builds composite keys whose byte order is the order of their parts, so tenant + timestamp + id
+// sorts by tenant first. Strings are escaped (0x00 becomes 0x00 0xFF) and end in 0x00 0x01, so a
+// shorter string sorts before every longer one it is a prefix of; integers are big-endian, signed
+// ones with the sign bit flipped.
+class KeyBuilder {
+public:
+    KeyBuilder &addString(const string &part);
+    KeyBuilder &addUint64(uint64_t part);
+    KeyBuilder &addInt64(int64_t part);
+    const string &key() const { return bytes; }
+
+private:
+    string bytes;
+};
+
+// B+ tree over variable-length byte-string keys (compared with memcmp, shorter first on a tie) with
+// int references, kept in a file of slotted pages next to the fixed-width int index. A page is
+//   kind | count | heap start | prefix length | link | prefix | slot offsets ... | free | ... cells
+// where a cell is  suffix length | suffix bytes | value  and the slots are kept in key order.
+// Every key of a page starts with the page's prefix, which is stored once (prefix compression).
+// A leaf's link is the next leaf and its values are references; an internal page's link is the child
+// left of its first separator, and each cell's value is the child holding the keys from that
+// separator up to the next one. Separators pushed up by leaf splits are cut to the shortest prefix
+// of the right leaf's first key that still sorts after the left leaf's last key (suffix truncation),
+// so long keys cost little fan-out. Both can be turned off at creation time to compare.
+// Lookups binary-search the slots in place on the cached page. An insert that fits its leaf is made
+// in place in the page; everything else decodes the node, changes it and writes it back compacted.
+// A page left less than a quarter full by a delete is merged with a sibling when both fit one page.
+// Lookups run concurrently; inserts and deletes take the whole tree exclusively.
+class VarKeyIndex {
+    struct Entry {
+        string key;
+        int32_t value;
+    };
+    struct Node {
+        int kind = 0; // 0 leaf, 1 internal, -1 free, as in BTreeIndex
+        int place = -1;
+        int32_t link = -1;
+        vector<Entry> entries;
+    };
+
+    string fileName;
+    int indexFile = -1;
+    int pageSize = 0;
+    int pageCount = 0;
+    int freeHead = -1;
+    int root = -1;
+    int flags = 0;
+    BufferPool bufferPool;
+    shared_mutex treeLatch; // shared for lookups and scans, exclusive for changes
+
+    /////////////////////////////////////Slotted pages/////////////////////////////////////////////
+    enum PageField { PageKind = 0, PageCount = 2, PageHeapStart = 4, PagePrefixLength = 6, PageLink = 8,
+                     PageHeaderBytes = 12 };
+    static int field16(const uint8_t *page, int offset);
+    static void setField16(uint8_t *page, int offset, int value);
+    static int32_t field32(const uint8_t *page, int offset);
+    static void setField32(uint8_t *page, int offset, int32_t value);
+    static int compareToCell(const uint8_t *page, int slot, const string &key);
+    static int prefixMatch(const uint8_t *page, const string &key);
+    static int32_t cellValue(const uint8_t *page, int slot);
+    static string cellKey(const uint8_t *page, int slot);
+    int upperBound(const uint8_t *page, const string &key) const;
+    int lowerBound(const uint8_t *page, const string &key) const;
+    int childFor(const uint8_t *page, const string &key) const;
+    int encodedBytes(const Node &node) const;
+    bool encode(const Node &node, uint8_t *page) const;
+    Node decode(const uint8_t *page, int place) const;
+    bool insertIntoPage(uint8_t *page, int slot, const string &key, int32_t value) const;
+
+    /////////////////////////////////////Page-level I/O/////////////////////////////////////////////
+    const uint8_t *readPage(int place);
+    void releasePage(int place, bool dirty = false);
+    Node readNode(int place);
+    void writeNode(const Node &node);
+    void writeHeader();
+    int allocatePage();
+    void freePage(int place);
+    void closeIndexFile();
+
+    ////////////////////////////////////////Tree changes////////////////////////////////////////////
+    string separatorBetween(const string &left, const string &right) const;
+    size_t splitPoint(const Node &node) const;
+    void insertSeparator(vector<pair<int, int>> &path, string separator, int right);
+    void fixUnderflow(vector<pair<int, int>> &path, Node node);
+    int leafFor(const string &key, vector<pair<int, int>> *path);
+
+public:
+    static const int32_t FileMagic = 0x4B565442; // "BTVK"
+    static const int32_t FormatVersion = 1;
+    static const int DefaultPageSize = 4096;
+    static const int MinPageSize = 256;
+    static const int MaxPageSize = 32768; // page offsets are 16 bits
+    static const int MinGrowthPages = 16;
+    enum HeaderField { HeaderMagic, HeaderVersion, HeaderPageSize, HeaderPageCount, HeaderFreeHead, HeaderRoot,
+                       HeaderFlags, HeaderFields };
+    enum Flag { PrefixCompression = 1, SuffixTruncation = 2, AllCompression = 3 };
+
+    VarKeyIndex() = default;
+    VarKeyIndex(const VarKeyIndex &) = delete;
+    VarKeyIndex &operator=(const VarKeyIndex &) = delete;
+    ~VarKeyIndex();
+
+    bool CreateIndexFile(const char *filename, int pageSize = DefaultPageSize, int flags = AllCompression);
+    bool OpenIndexFile(const char *filename);
+    int InsertRecord(const string &key, int Reference);
+    int SearchARecord(const string &key);
+    bool DeleteRecord(const string &key);
+    // visits lo <= key <= hi in key order until visit returns false
+    void RangeScan(const string &lo, const string &hi, const function<bool(const string &key, int reference)> &visit);
+    bool Flush();
+    int Height();
+    int MaxKeyLength() const;
+    BufferPool::Stats BufferStats() const { return bufferPool.stats(); }
+};
+
+#endif // BTREEINDEX_VARKEYINDEX_H
@@ -0,0 +1,146 @@
+#include "WriteAheadLog.h"
+#include "PosixIO.h"
+using namespace std;
+
+WriteAheadLog::~WriteAheadLog() {
+    close();
+}
+
+bool WriteAheadLog::open(const string &filename) {
+    close();
+    lock_guard<mutex> guard(commitLatch);
+    fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    end = lseek(fd, 0, SEEK_END);
+    return true;
+}
+
+void WriteAheadLog::close() {
+    lock_guard<mutex> guard(commitLatch);
+    if (fd != -1) {
+        commitLocked();
+        ::close(fd);
+        fd = -1;
+    }
+    lock_guard<mutex> appendGuard(appendLatch);
+    pending.clear();
+    pendingRecords = 0;
+}
+
+void WriteAheadLog::configure(size_t groupRecords, int groupMillis) {
+    lock_guard<mutex> guard(appendLatch);
+    this->groupRecords = groupRecords == 0 ? 1 : groupRecords;
+    this->groupMillis = groupMillis;
+}
+
+bool WriteAheadLog::append(int32_t type, const int32_t *payload, int words) {
+    bool due;
+    {
+        lock_guard<mutex> guard(appendLatch);
+        if (fd == -1) {
+            return false;
+        }
+        if (pendingRecords == 0) {
+            oldestPending = chrono::steady_clock::now();
+        }
+        pending.push_back(type);
+        pending.push_back(words);
+        pending.push_back(checksum(type, payload, words));
+        pending.insert(pending.end(), payload, payload + words);
+        pendingRecords++;
+        counters.records++;
+        due = pendingRecords >= groupRecords ||
+              chrono::steady_clock::now() - oldestPending >= chrono::milliseconds(groupMillis);
+    }
+    return !due || commit();
+}
+
+bool WriteAheadLog::commit() {
+    lock_guard<mutex> guard(commitLatch);
+    return commitLocked();
+}
+
+bool WriteAheadLog::commitLocked() {
+    // take the waiting records and sync them while other threads go on appending the next group
+    vector<int32_t> group;
+    {
+        lock_guard<mutex> appendGuard(appendLatch);
+        if (fd == -1 || pending.empty()) {
+            return true;
+        }
+        group.swap(pending);
+        pendingRecords = 0;
+    }
+    size_t bytes = group.size() * sizeof(int32_t);
+    if (pwrite(fd, group.data(), bytes, end) != (ssize_t) bytes || fsync(fd) != 0) {
+        return false;
+    }
+    end += bytes;
+    lock_guard<mutex> appendGuard(appendLatch);
+    counters.bytes += bytes;
+    counters.commits++;
+    return true;
+}
+
+bool WriteAheadLog::truncate() {
+    lock_guard<mutex> guard(commitLatch);
+    {
+        lock_guard<mutex> appendGuard(appendLatch);
+        pending.clear();
+        pendingRecords = 0;
+    }
+    if (fd == -1 || ftruncate(fd, 0) != 0 || fsync(fd) != 0) {
+        return false;
+    }
+    end = 0;
+    return true;
+}
+
+bool WriteAheadLog::readAll(vector<Record> &records) {
+    lock_guard<mutex> guard(commitLatch);
+    records.clear();
+    if (fd == -1) {
+        return false;
+    }
+    off_t offset = 0;
+    int32_t header[3];
+    while (pread(fd, header, sizeof(header), offset) == (ssize_t) sizeof(header)) {
+        if (header[1] < 0 || header[1] > MaxPayloadWords) {
+            break;
+        }
+        Record record{header[0], vector<int32_t>(header[1])};
+        size_t bytes = record.payload.size() * sizeof(int32_t);
+        if (pread(fd, record.payload.data(), bytes, offset + sizeof(header)) != (ssize_t) bytes ||
+            checksum(record.type, record.payload.data(), header[1]) != header[2]) {
+            break;
+        }
+        offset += sizeof(header) + bytes;
+        records.push_back(move(record));
+    }
+    // anything after the last whole record is a torn write, so later appends overwrite it
+    end = offset;
+    return true;
+}
+
+WriteAheadLog::Stats WriteAheadLog::stats() const {
+    lock_guard<mutex> guard(appendLatch);
+    return counters;
+}
+
+int32_t WriteAheadLog::checksum(int32_t type, const int32_t *payload, int words) {
+    // FNV-1a over the type, length and payload words
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](int32_t word) {
+        for (int i = 0; i < 4; ++i) {
+            hash = (hash ^ ((uint32_t) word >> (8 * i) & 0xff)) * 16777619u;
+        }
+    };
+    mix(type);
+    mix(words);
+    for (int i = 0; i < words; ++i) {
+        mix(payload[i]);
+    }
+    return (int32_t) hash;
+}
@@ -0,0 +1,70 @@
+#ifndef BTREEINDEX_WRITEAHEADLOG_H
+#define BTREEINDEX_WRITEAHEADLOG_H
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+using namespace std;
+
+// Append-only redo log kept next to an index file. Every record is
+//   type | payload words | checksum | payload...
+// and a torn or corrupt tail is dropped when the log is read back. Appends are buffered and
+// made durable together by commit (group commit), which runs on its own once groupRecords
+// records are waiting or the oldest of them is groupMillis old. Threads keep appending while a
+// commit is syncing; their records go out with the next one.
+class WriteAheadLog {
+public:
+    enum RecordType { Insert = 1, Delete = 2, PageImage = 3, CheckpointEnd = 4, Batch = 5 };
+
+    struct Record {
+        int32_t type;
+        vector<int32_t> payload;
+    };
+
+    struct Stats {
+        long long records = 0;
+        long long commits = 0;
+        long long bytes = 0;
+    };
+
+    static const size_t DefaultGroupRecords = 256;
+    static const int DefaultGroupMillis = 5;
+    static const int32_t MaxPayloadWords = 1 << 24;
+
+    WriteAheadLog() = default;
+    WriteAheadLog(const WriteAheadLog &) = delete;
+    WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+    ~WriteAheadLog();
+
+    bool open(const string &filename);
+    void close();
+    bool isOpen() const { return fd != -1; }
+    void configure(size_t groupRecords, int groupMillis);
+
+    bool append(int32_t type, const int32_t *payload, int words);
+    bool commit();
+    bool truncate();
+    bool readAll(vector<Record> &records);
+
+    Stats stats() const;
+
+private:
+    mutable mutex appendLatch; // pending, pendingRecords, oldestPending, counters.records
+    mutex commitLatch;         // end and the file itself
+    int fd = -1;
+    size_t groupRecords = DefaultGroupRecords;
+    int groupMillis = DefaultGroupMillis;
+    vector<int32_t> pending;
+    size_t pendingRecords = 0;
+    chrono::steady_clock::time_point oldestPending;
+    off_t end = 0;
+    Stats counters;
+
+    bool commitLocked();
+    static int32_t checksum(int32_t type, const int32_t *payload, int words);
+};
+
+#endif // BTREEINDEX_WRITEAHEADLOG_H
@@ -0,0 +1,949 @@
+#include "BTreeIndex.h"
+#include "BTreeIndex.cpp"
+#include "BufferPool.cpp"
+#include "StorageBackend.cpp"
+#include "WriteAheadLog.cpp"
+#include "Metrics.cpp"
+#include "VarKeyIndex.cpp"
+#include "BTree.h"
+#include <chrono>
+#include <random>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+using namespace std;
+
+// Build with:  g++ -O2 -std=c++17 -pthread benchmark.cpp -o benchmark
+// Usage:       ./benchmark [max lookup keys (default 1000000)] [m (default 32)] [max bulk-load keys (default 1000000)]
+
+static const char *BenchFileName = "BTreeBenchmark.bin";
+
+// Every heap allocation made by the process is counted, so a section can report allocations per operation.
+static atomic<long long> allocations{0};
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    if (void *block = malloc(size == 0 ? 1 : size)) {
+        return block;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void *block) noexcept {
+    free(block);
+}
+
+void operator delete(void *block, size_t) noexcept {
+    free(block);
+}
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Enough nodes for every key to land in a half-full leaf, plus the internal levels above them.
+static int nodesFor(long long keys, int m) {
+    return (int) (4 * keys / max(1, m / 2) + 64);
+}
+
+static void LookupBenchmark(long long maxKeys, int m) {
+    cout << "\n=== SearchARecord latency (m = " << m << ") ===\n";
+    cout << setw(12) << "keys" << setw(16) << "build (s)" << setw(18) << "lookup (ns)"
+         << setw(20) << "misses/lookup" << setw(18) << "mapped (ns)" << "\n";
+    mt19937 rng(42);
+    for (long long keys = 1000; keys <= maxKeys; keys *= 10) {
+        vector<int> ids(keys);
+        for (int i = 0; i < keys; ++i) {
+            ids[i] = 2 * i + 1;
+        }
+        shuffle(ids.begin(), ids.end(), rng);
+
+        BTreeIndex index;
+        auto start = chrono::steady_clock::now();
+        index.CreateIndexFile(BenchFileName, nodesFor(keys, m), m);
+        for (int id: ids) {
+            index.InsertNewRecordAtIndex(id, id * 10);
+        }
+        double build = secondsSince(start);
+
+        const int probes = 100000;
+        long long found = 0;
+        BufferPool::Stats before = index.BufferStats();
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < probes; ++i) {
+            found += index.SearchARecord(BenchFileName, ids[rng() % keys]) != -1;
+        }
+        double lookup = secondsSince(start) * 1e9 / probes;
+        double misses = double(index.BufferStats().misses - before.misses) / probes;
+        index.Flush();
+        BTreeIndex mapped;
+        double mappedLookup = -1;
+        if (mapped.OpenIndexFileReadOnly(BenchFileName)) {
+            start = chrono::steady_clock::now();
+            for (int i = 0; i < probes; ++i) {
+                found += mapped.SearchARecord(BenchFileName, ids[rng() % keys]) != -1;
+            }
+            mappedLookup = secondsSince(start) * 1e9 / probes;
+            found -= probes;
+        }
+        if (found != probes) {
+            cout << "  lookup mismatch: found " << found << " of " << probes << "\n";
+        }
+        cout << setw(12) << keys << setw(16) << fixed << setprecision(2) << build
+             << setw(18) << setprecision(0) << lookup
+             << setw(20) << setprecision(2) << misses
+             << setw(18) << setprecision(0) << mappedLookup << "\n";
+    }
+}
+
+// The insert loop needs its whole file created up front, which gets too big to be worth timing past this.
+static const long long InsertLoopLimit = 10000000;
+
+static void BulkLoadBenchmark(long long maxKeys, int m) {
+    cout << "\n=== BulkLoad vs insert loop (m = " << m << ") ===\n";
+    cout << setw(12) << "keys" << setw(18) << "insert loop (s)" << setw(16) << "bulk load (s)"
+         << setw(12) << "speedup" << "\n";
+    mt19937 rng(7);
+    for (long long keys = 1000000; keys <= maxKeys; keys *= 10) {
+        vector<pair<int, int>> records(keys);
+        for (int i = 0; i < keys; ++i) {
+            records[i] = make_pair(2 * i + 1, i);
+        }
+        shuffle(records.begin(), records.end(), rng);
+
+        double loop = -1;
+        if (keys <= InsertLoopLimit) {
+            BTreeIndex index;
+            auto start = chrono::steady_clock::now();
+            index.CreateIndexFile(BenchFileName, nodesFor(keys, m), m);
+            for (const auto &record: records) {
+                index.InsertNewRecordAtIndex(record.first, record.second);
+            }
+            index.Flush();
+            loop = secondsSince(start);
+        }
+
+        BTreeIndex index;
+        auto start = chrono::steady_clock::now();
+        index.BulkLoad(BenchFileName, records.begin(), records.end(), m);
+        double bulk = secondsSince(start);
+        if (index.SearchARecord(BenchFileName, records[0].first) != records[0].second) {
+            cout << "  bulk load lookup mismatch\n";
+        }
+
+        cout << setw(12) << keys << fixed << setprecision(2);
+        if (loop < 0) {
+            cout << setw(18) << "-" << setw(16) << bulk << setw(12) << "-" << "\n";
+        } else {
+            cout << setw(18) << loop << setw(16) << bulk << setw(11) << setprecision(1) << loop / bulk << "x\n";
+        }
+    }
+}
+
+static long long pageReads(const BTreeIndex &index) {
+    BufferPool::Stats stats = index.BufferStats();
+    return stats.hits + stats.misses;
+}
+
+static void MultiSearchBenchmark(long long keys, int m) {
+    cout << "\n=== MultiSearch vs SearchARecord loop (" << keys << " keys, m = " << m << ") ===\n";
+    cout << setw(10) << "batch" << setw(16) << "loop (ns/key)" << setw(16) << "loop reads" << setw(18)
+         << "multi (ns/key)" << setw(16) << "multi reads" << "\n";
+    vector<pair<int, int>> records(keys);
+    for (int i = 0; i < keys; ++i) {
+        records[i] = make_pair(2 * i + 1, i);
+    }
+    BTreeIndex index;
+    index.BulkLoad(BenchFileName, records.begin(), records.end(), m);
+    mt19937 rng(11);
+    for (int batch = 10; batch <= 100000; batch *= 10) {
+        vector<int> ids(batch);
+        for (int &id: ids) {
+            id = 2 * (int) (rng() % keys) + 1;
+        }
+
+        long long reads = pageReads(index);
+        auto start = chrono::steady_clock::now();
+        long long sum = 0;
+        for (int id: ids) {
+            sum += index.SearchARecord(BenchFileName, id);
+        }
+        double loop = secondsSince(start) * 1e9 / batch;
+        long long loopReads = pageReads(index) - reads;
+
+        reads = pageReads(index);
+        start = chrono::steady_clock::now();
+        vector<int> references = index.MultiSearch(BenchFileName, ids);
+        double multi = secondsSince(start) * 1e9 / batch;
+        long long multiReads = pageReads(index) - reads;
+        for (int reference: references) {
+            sum -= reference;
+        }
+        if (sum != 0) {
+            cout << "  MultiSearch mismatch\n";
+        }
+        cout << setw(10) << batch << fixed << setprecision(0) << setw(16) << loop << setw(16) << loopReads
+             << setw(18) << multi << setw(16) << multiReads << "\n";
+    }
+}
+
+// Drops the file's pages from the OS page cache so the next reads go to the device.
+static void dropFileCache(const char *filename) {
+#ifdef POSIX_FADV_DONTNEED
+    int file = open(filename, O_RDONLY);
+    if (file != -1) {
+        fdatasync(file);
+        posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+        close(file);
+    }
+#endif
+}
+
+static void QueueDepthBenchmark(long long keys, int m) {
+    const int lookups = 20000;
+    cout << "\n=== Cold random lookups by MultiSearch batch size (" << keys << " keys, m = " << m << ", "
+         << lookups << " lookups) ===\n";
+    cout << setw(10) << "backend" << setw(10) << "batch" << setw(16) << "lookups/s" << setw(18)
+         << "misses/lookup" << "\n";
+    vector<pair<int, int>> records(keys);
+    for (int i = 0; i < keys; ++i) {
+        records[i] = make_pair(2 * i + 1, i);
+    }
+    {
+        BTreeIndex build;
+        build.BulkLoad(BenchFileName, records.begin(), records.end(), m);
+    }
+    mt19937 rng(29);
+    vector<int> ids(lookups);
+    for (int &id: ids) {
+        id = 2 * (int) (rng() % keys) + 1;
+    }
+    for (StorageBackend::Kind kind: {StorageBackend::Pread, StorageBackend::IoUring}) {
+        for (int batch = 1; batch <= 256; batch *= 4) {
+            // a pool far smaller than the file and an emptied page cache, so nearly every leaf is a device read
+            BTreeIndex index;
+            index.ConfigureStorage(kind);
+            index.ConfigureBufferPool(4096);
+            index.OpenIndexFile(BenchFileName);
+            dropFileCache(BenchFileName);
+            long long misses = index.BufferStats().misses, wrong = 0;
+            auto start = chrono::steady_clock::now();
+            for (int from = 0; from < lookups; from += batch) {
+                int count = min(batch, lookups - from);
+                vector<int> references = index.MultiSearch(BenchFileName, ids.data() + from, count);
+                for (int i = 0; i < count; ++i) {
+                    wrong += references[i] != (ids[from + i] - 1) / 2;
+                }
+            }
+            double seconds = secondsSince(start);
+            misses = index.BufferStats().misses - misses;
+            cout << setw(10) << index.StorageName() << setw(10) << batch << fixed << setprecision(0) << setw(16)
+                 << lookups / seconds << setprecision(2) << setw(18) << double(misses) / lookups
+                 << (wrong == 0 ? "" : "  wrong results") << "\n";
+        }
+    }
+}
+
+static void ScanBenchmark(long long keys, int m) {
+    cout << "\n=== Cold full RangeScan with and without leaf readahead (" << keys << " keys, m = " << m
+         << ") ===\n";
+    cout << setw(16) << "layout" << setw(10) << "backend" << setw(12) << "readahead" << setw(16) << "keys/s"
+         << setw(12) << "MB/s" << setw(12) << "seconds" << "\n";
+    vector<pair<int, int>> records(keys);
+    for (int i = 0; i < keys; ++i) {
+        records[i] = make_pair(2 * i + 1, i);
+    }
+    for (const char *layout: {"bulk load", "random inserts"}) {
+        {
+            BTreeIndex build;
+            if (layout[0] == 'b') {
+                // bulk-loaded leaves sit at consecutive places, so readahead becomes large sequential reads
+                build.BulkLoad(BenchFileName, records.begin(), records.end(), m);
+            } else {
+                vector<pair<int, int>> shuffled(records);
+                shuffle(shuffled.begin(), shuffled.end(), mt19937(31));
+                build.ConfigureBufferPool(nodesFor(keys, m));
+                build.CreateIndexFile(BenchFileName, nodesFor(keys, m), m);
+                for (const auto &record: shuffled) {
+                    build.InsertNewRecordAtIndex(record.first, record.second);
+                }
+            }
+        }
+        for (StorageBackend::Kind kind: {StorageBackend::Pread, StorageBackend::IoUring}) {
+            for (int readahead: {0, BTreeIndex::MaxReadaheadLeaves}) {
+                BTreeIndex index;
+                index.ConfigureStorage(kind);
+                index.ConfigureBufferPool(4096);
+                index.SetScanReadahead(readahead);
+                index.OpenIndexFile(BenchFileName);
+                dropFileCache(BenchFileName);
+                long long bytes = index.BufferStats().bytesRead, seen = 0, sum = 0;
+                auto start = chrono::steady_clock::now();
+                for (auto it = index.RangeScan(BenchFileName, INT32_MIN, INT32_MAX); it != BTreeIndex::RangeIterator(); ++it) {
+                    seen++;
+                    sum += it->second;
+                }
+                double seconds = secondsSince(start);
+                bytes = index.BufferStats().bytesRead - bytes;
+                cout << setw(16) << layout << setw(10) << index.StorageName() << setw(12)
+                     << (readahead > 0 ? "on" : "off") << fixed << setprecision(0) << setw(16) << seen / seconds
+                     << setprecision(1) << setw(12) << bytes / seconds / 1048576 << setprecision(3) << setw(12)
+                     << seconds << (seen == keys && sum == keys * (keys - 1) / 2 ? "" : "  wrong results") << "\n";
+            }
+        }
+    }
+}
+
+static void WriteAheadLogBenchmark(int m) {
+    const int keys = 20000;
+    cout << "\n=== Durable inserts (" << keys << " random keys, m = " << m << ") ===\n";
+    cout << setw(28) << "mode" << setw(14) << "ops/sec" << setw(10) << "fsyncs" << "\n";
+    vector<int> ids(keys);
+    for (int i = 0; i < keys; ++i) {
+        ids[i] = i;
+    }
+    shuffle(ids.begin(), ids.end(), mt19937(5));
+
+    // group size 0 means no log at all
+    vector<pair<string, size_t>> modes = {{"no log", 0}, {"log, fsync every op", 1},
+                                          {"log, group commit of 256", 256}};
+    for (const auto &mode: modes) {
+        BTreeIndex index;
+        if (mode.second > 0) {
+            index.EnableWriteAheadLog(mode.second, 1000);
+        }
+        index.CreateIndexFile(BenchFileName, nodesFor(keys, m), m);
+        auto start = chrono::steady_clock::now();
+        for (int id: ids) {
+            index.InsertNewRecordAtIndex(id, id);
+        }
+        index.Commit();
+        double seconds = secondsSince(start);
+        cout << setw(28) << mode.first << setw(14) << fixed << setprecision(0) << keys / seconds
+             << setw(10) << index.LogStats().commits << "\n";
+    }
+    remove((string(BenchFileName) + ".wal").c_str());
+}
+
+// Format version 2 kept keys and references interleaved, so the keys were searched with a stride of two.
+static int interleavedLowerBound(const int32_t *pairs, int count, int key) {
+    int low = 0, high = count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (pairs[2 * mid] < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static void NodeSearchBenchmark() {
+    const int nodes = 1024, probes = 1 << 20;
+    cout << "\n=== Key search inside one node (ns per search, " << nodes << " full nodes) ===\n";
+    cout << setw(6) << "m" << setw(14) << "pair loop" << setw(14) << "interleaved";
+    vector<NodeSearch::Kernel> kernels;
+    for (auto kernel: {NodeSearch::Scalar, NodeSearch::SSE2, NodeSearch::AVX2}) {
+        if (NodeSearch::available(kernel)) {
+            kernels.push_back(kernel);
+            cout << setw(14) << NodeSearch::name(kernel);
+        }
+    }
+    cout << "\n";
+    mt19937 rng(3);
+    for (int m = 8; m <= 512; m *= 2) {
+        // every node holds the keys 0, 2, ..., 2m-2 in each layout; probes hit and miss evenly
+        vector<int32_t> interleaved((size_t) nodes * 2 * m), keys((size_t) nodes * m);
+        for (int n = 0; n < nodes; ++n) {
+            for (int i = 0; i < m; ++i) {
+                interleaved[(size_t) n * 2 * m + 2 * i] = 2 * i;
+                interleaved[(size_t) n * 2 * m + 2 * i + 1] = i;
+                keys[(size_t) n * m + i] = 2 * i;
+            }
+        }
+        vector<int> probe(probes), node(probes);
+        for (int i = 0; i < probes; ++i) {
+            probe[i] = (int) (rng() % (2 * m));
+            node[i] = (int) (rng() % nodes);
+        }
+
+        auto time = [&](const function<int(int)> &search) {
+            long long sum = 0;
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < probes; ++i) {
+                sum += search(i);
+            }
+            double ns = secondsSince(start) * 1e9 / probes;
+            return sum == -1 ? 0 : ns; // keeps sum alive
+        };
+        cout << setw(6) << m << fixed << setprecision(1);
+        cout << setw(14) << time([&](int i) {
+            const int32_t *pairs = &interleaved[(size_t) node[i] * 2 * m];
+            int slot = 0;
+            while (slot < m && pairs[2 * slot] < probe[i]) {
+                slot++;
+            }
+            return slot;
+        });
+        cout << setw(14) << time([&](int i) {
+            return interleavedLowerBound(&interleaved[(size_t) node[i] * 2 * m], m, probe[i]);
+        });
+        for (auto kernel: kernels) {
+            NodeSearch::Function search = NodeSearch::kernelFunction(kernel);
+            cout << setw(14) << time([&](int i) {
+                return search(&keys[(size_t) node[i] * m], m, probe[i]);
+            });
+        }
+        cout << "\n";
+    }
+}
+
+template<class Key, int M>
+static void templateRow(const vector<int> &ids, const char *keyName) {
+    BTree<Key, Key, M> tree;
+    auto start = chrono::steady_clock::now();
+    for (int id: ids) {
+        tree.insert((Key) id, (Key) id);
+    }
+    double insert = secondsSince(start) * 1e9 / ids.size();
+    long long found = 0;
+    start = chrono::steady_clock::now();
+    for (int id: ids) {
+        const Key *value = tree.find((Key) id);
+        found += value != nullptr && *value == (Key) id;
+    }
+    double lookup = secondsSince(start) * 1e9 / ids.size();
+    cout << setw(24) << string("BTree<") + keyName + ", " + to_string(M) + ">" << fixed << setprecision(0)
+         << setw(16) << insert << setw(16) << lookup << setw(10) << tree.height() << setw(14)
+         << sizeof(typename BTree<Key, Key, M>::Node) << (found == (long long) ids.size() ? "" : "  wrong results")
+         << "\n";
+}
+
+static void EngineBenchmark(long long keys, int m) {
+    cout << "\n=== In-memory BTree<Key, Value, M> vs BTreeIndex (" << keys << " random keys) ===\n";
+    cout << setw(24) << "engine" << setw(16) << "insert (ns)" << setw(16) << "lookup (ns)" << setw(10) << "height"
+         << setw(14) << "node bytes" << "\n";
+    vector<int> ids(keys);
+    for (int i = 0; i < keys; ++i) {
+        ids[i] = 2 * i + 1;
+    }
+    shuffle(ids.begin(), ids.end(), mt19937(9));
+
+    // the file index with a pool large enough to keep every page cached
+    BTreeIndex index;
+    index.ConfigureBufferPool(nodesFor(keys, m));
+    index.CreateIndexFile(BenchFileName, nodesFor(keys, m), m);
+    auto start = chrono::steady_clock::now();
+    for (int id: ids) {
+        index.InsertNewRecordAtIndex(id, id);
+    }
+    double insert = secondsSince(start) * 1e9 / keys;
+    long long found = 0;
+    start = chrono::steady_clock::now();
+    for (int id: ids) {
+        found += index.SearchARecord(BenchFileName, id) == id;
+    }
+    double lookup = secondsSince(start) * 1e9 / keys;
+    cout << setw(24) << "BTreeIndex, m = " + to_string(m) << fixed << setprecision(0) << setw(16) << insert
+         << setw(16) << lookup << setw(10) << "-" << setw(14) << BTreeIndex::PageSizeFor(m)
+         << (found == keys ? "" : "  wrong results") << "\n";
+
+    templateRow<int32_t, 16>(ids, "int32");
+    templateRow<int32_t, 64>(ids, "int32");
+    templateRow<int32_t, 256>(ids, "int32");
+    templateRow<int64_t, 64>(ids, "int64");
+}
+
+static int treeDepth(BTreeIndex &index) {
+    int depth = 1;
+    for (BTreeNode Node = index.readNode(1); Node.isLeaf == 1; Node = index.readNode(Node.node[0].second)) {
+        depth++;
+    }
+    return depth;
+}
+
+static void DeleteBenchmark(long long maxKeys, int m) {
+    cout << "\n=== DeleteRecordFromIndex throughput (m = " << m << ") ===\n";
+    cout << setw(12) << "keys" << setw(18) << "delete (ns)" << setw(20) << "pages/delete"
+         << setw(18) << "depth at half" << "\n";
+    mt19937 rng(11);
+    for (long long keys = 1000; keys <= maxKeys; keys *= 10) {
+        vector<int> ids(keys);
+        for (int i = 0; i < keys; ++i) {
+            ids[i] = i + 1;
+        }
+        shuffle(ids.begin(), ids.end(), rng);
+        BTreeIndex index;
+        index.CreateIndexFile(BenchFileName, nodesFor(keys, m), m);
+        for (int id: ids) {
+            index.InsertNewRecordAtIndex(id, id);
+        }
+        shuffle(ids.begin(), ids.end(), rng);
+
+        // delete every key in random order, checking halfway that the other half is still there
+        long long half = keys / 2, found = 0, pages = 0;
+        double deleted = 0;
+        int depth = 0;
+        for (long long from: {0LL, half}) {
+            long long before = pageReads(index);
+            auto start = chrono::steady_clock::now();
+            for (long long i = from; i < (from == 0 ? half : keys); ++i) {
+                index.DeleteRecordFromIndex(BenchFileName, ids[i], m);
+            }
+            deleted += secondsSince(start);
+            pages += pageReads(index) - before;
+            if (from == 0) {
+                depth = treeDepth(index);
+                for (long long i = half; i < keys; ++i) {
+                    found += index.SearchARecord(BenchFileName, ids[i]) == ids[i];
+                }
+            }
+        }
+        if (found != keys - half || index.SearchARecord(BenchFileName, ids[0]) != -1) {
+            cout << "  delete mismatch: " << found << " of " << keys - half << " kept\n";
+        }
+        cout << setw(12) << keys << setw(18) << fixed << setprecision(0) << deleted * 1e9 / keys
+             << setw(20) << setprecision(2) << double(pages) / keys
+             << setw(18) << depth << "\n";
+    }
+}
+
+// an insert allocates for a bounded number of temporaries on each level it splits, and writes at most the node
+// and its new sibling there, plus a new root
+static const int AllocationsPerLevel = 16;
+static int failedChecks = 0;
+
+static void AllocationBenchmark(long long maxKeys, int m) {
+    const int inserts = 20000;
+    cout << "\n=== Heap allocations per insert (m = " << m << ", " << inserts << " random inserts) ===\n";
+    cout << setw(12) << "keys" << setw(10) << "depth" << setw(12) << "average" << setw(10) << "worst" << setw(16)
+         << "writes (worst)" << setw(10) << "check" << "\n";
+    for (long long keys = 1000; keys <= maxKeys; keys *= 10) {
+        // odd keys are loaded, random even keys are inserted; the pool holds every page so misses add nothing
+        vector<pair<int, int>> records(keys);
+        for (int i = 0; i < keys; ++i) {
+            records[i] = make_pair(2 * i + 1, i);
+        }
+        vector<int> ids(inserts);
+        mt19937 rng(17);
+        for (int &id: ids) {
+            id = 2 * (int) (rng() % keys);
+        }
+        BTreeIndex index;
+        index.ConfigureBufferPool(nodesFor(keys + inserts, m));
+        index.BulkLoad(BenchFileName, records.begin(), records.end(), m, 0.9, nodesFor(inserts, m));
+        for (int i = 0; i < keys; i += max(1, m / 2)) {
+            index.SearchARecord(BenchFileName, 2 * i + 1);
+        }
+        long long total = 0, worst = 0, worstWrites = 0;
+        for (int id: ids) {
+            long long writesBefore = index.GetMetrics(false).operations.counters[Metrics::NodeWrites];
+            long long before = allocations.load();
+            index.InsertNewRecordAtIndex(id, id);
+            long long made = allocations.load() - before;
+            total += made;
+            worst = max(worst, made);
+            worstWrites = max(worstWrites, index.GetMetrics(false).operations.counters[Metrics::NodeWrites] - writesBefore);
+        }
+        int depth = treeDepth(index);
+        bool ok = worst <= AllocationsPerLevel * (depth + 1) && worstWrites <= 2 * depth + 1;
+        failedChecks += ok ? 0 : 1;
+        cout << setw(12) << keys << setw(10) << depth << fixed << setprecision(2) << setw(12)
+             << double(total) / inserts << setw(10) << worst << setw(16) << worstWrites << setw(10)
+             << (ok ? "ok" : "FAILED") << "\n";
+    }
+}
+
+static void VarKeyBenchmark(long long keys) {
+    cout << "\n=== Variable-length composite keys (" << keys << " tenant + timestamp + id keys, "
+         << VarKeyIndex::DefaultPageSize << "-byte pages) ===\n";
+    cout << setw(22) << "compression" << setw(14) << "insert (ns)" << setw(14) << "lookup (ns)" << setw(8)
+         << "height" << setw(12) << "file (MB)" << setw(18) << "misses/lookup" << "\n";
+    mt19937 rng(23);
+    vector<string> ids(keys);
+    for (long long i = 0; i < keys; ++i) {
+        // a few long tenant names, so keys share long prefixes and differ late
+        KeyBuilder key;
+        key.addString("customer-account-" + to_string(rng() % 64) + "-production-eu-west")
+           .addUint64(1700000000000ULL + rng() % 86400000ULL)
+           .addUint64(i);
+        ids[i] = key.key();
+    }
+    vector<string> probes(ids);
+    shuffle(probes.begin(), probes.end(), rng);
+    const pair<int, const char *> modes[] = {{0, "none"}, {VarKeyIndex::PrefixCompression, "prefix"},
+                                             {VarKeyIndex::SuffixTruncation, "suffix truncation"},
+                                             {VarKeyIndex::AllCompression, "both"}};
+    for (auto mode: modes) {
+        VarKeyIndex index;
+        index.CreateIndexFile(BenchFileName, VarKeyIndex::DefaultPageSize, mode.first);
+        auto start = chrono::steady_clock::now();
+        for (long long i = 0; i < keys; ++i) {
+            index.InsertRecord(ids[i], (int) i);
+        }
+        double inserted = secondsSince(start);
+        index.Flush();
+
+        long long found = 0, missesBefore = index.BufferStats().misses;
+        start = chrono::steady_clock::now();
+        for (const string &probe: probes) {
+            found += index.SearchARecord(probe) != -1;
+        }
+        double looked = secondsSince(start);
+        long long misses = index.BufferStats().misses - missesBefore;
+        struct stat file{};
+        stat(BenchFileName, &file);
+        cout << setw(22) << mode.second << fixed << setprecision(0) << setw(14) << inserted * 1e9 / keys
+             << setw(14) << looked * 1e9 / keys << setw(8) << index.Height() << setprecision(1) << setw(12)
+             << file.st_size / 1048576.0 << setprecision(2) << setw(18) << double(misses) / keys
+             << (found == keys ? "" : "  wrong results") << "\n";
+    }
+}
+
+// Runs body(thread) on `threads` threads and returns the wall time in seconds.
+static double runThreads(int threads, const function<void(int)> &body) {
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back(body, t);
+    }
+    for (auto &worker: workers) {
+        worker.join();
+    }
+    return secondsSince(start);
+}
+
+static void ConcurrencyBenchmark(long long keys, int m) {
+    const int opsPerThread = 200000;
+    cout << "\n=== Concurrent lookups and inserts (" << keys << " keys, m = " << m << ") ===\n";
+    cout << setw(10) << "threads" << setw(18) << "lookups/sec" << setw(18) << "inserts/sec" << setw(10) << "check"
+         << "\n";
+    vector<pair<int, int>> records(keys);
+    for (int i = 0; i < keys; ++i) {
+        records[i] = make_pair(2 * i + 1, i);
+    }
+    for (int threads = 1; threads <= 16; threads *= 2) {
+        // odd keys are loaded, even keys are inserted by the threads, each taking every threads-th one
+        BTreeIndex index;
+        index.ConfigureBufferPool(nodesFor(keys, m));
+        index.BulkLoad(BenchFileName, records.begin(), records.end(), m, 0.7, nodesFor(keys, m));
+        atomic<long long> wrong{0};
+        double lookups = runThreads(threads, [&](int t) {
+            mt19937 rng(t);
+            for (int i = 0; i < opsPerThread; ++i) {
+                int k = (int) (rng() % keys);
+                if (index.SearchARecord(BenchFileName, 2 * k + 1) != k) {
+                    wrong++;
+                }
+            }
+        });
+        long long inserted = min(keys, (long long) opsPerThread * threads);
+        double inserts = runThreads(threads, [&](int t) {
+            for (long long k = t; k < inserted; k += threads) {
+                index.InsertNewRecordAtIndex(2 * (int) k, (int) k);
+            }
+        });
+        // every insert must be visible once the threads are done
+        for (long long k = 0; k < inserted; ++k) {
+            if (index.SearchARecord(BenchFileName, 2 * (int) k) != k) {
+                wrong++;
+            }
+        }
+        cout << setw(10) << threads << fixed << setprecision(0) << setw(18) << threads * opsPerThread / lookups
+             << setw(18) << inserted / inserts << setw(10) << (wrong == 0 ? "ok" : "FAILED") << "\n";
+    }
+}
+
+static void InMemoryBenchmark(long long keys, int m) {
+    const int ops = 200000;
+    cout << "\n=== Buffered file against in-memory mode (" << keys << " keys, m = " << m << ") ===\n";
+    cout << setw(12) << "mode" << setw(12) << "open s" << setw(16) << "lookups/sec" << setw(16) << "inserts/sec"
+         << setw(14) << "snapshot s" << setw(22) << "worst lookup us" << setw(10) << "check" << "\n";
+    vector<pair<int, int>> records(keys);
+    for (int i = 0; i < keys; ++i) {
+        records[i] = make_pair(2 * i + 1, i);
+    }
+    for (bool inMemory: {false, true}) {
+        {
+            BTreeIndex build;
+            build.BulkLoad(BenchFileName, records.begin(), records.end(), m);
+        }
+        BTreeIndex index;
+        auto start = chrono::steady_clock::now();
+        // the buffered index reads its pages on demand, so opening it costs little and the lookups pay
+        bool opened = inMemory ? index.OpenIndexFileInMemory(BenchFileName, 0) : index.OpenIndexFile(BenchFileName);
+        double open = secondsSince(start);
+        long long wrong = opened ? 0 : 1;
+        mt19937 rng(7);
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < ops; ++i) {
+            int k = (int) (rng() % keys);
+            if (index.SearchARecord(BenchFileName, 2 * k + 1) != k) {
+                wrong++;
+            }
+        }
+        double lookups = secondsSince(start);
+        long long inserted = min(keys, (long long) ops);
+        start = chrono::steady_clock::now();
+        for (long long k = 0; k < inserted; ++k) {
+            index.InsertNewRecordAtIndex(2 * (int) ((k * 7919) % keys), (int) k);
+        }
+        double inserts = secondsSince(start);
+        // a lookup thread keeps running while the changes are written out, and reports its slowest call
+        atomic<bool> writing{true};
+        long long worst = 0;
+        thread reader([&] {
+            mt19937 readerRng(11);
+            while (writing.load()) {
+                int k = (int) (readerRng() % keys);
+                auto call = chrono::steady_clock::now();
+                if (index.SearchARecord(BenchFileName, 2 * k + 1) != k) {
+                    wrong++;
+                }
+                worst = max(worst, (long long) chrono::duration_cast<chrono::microseconds>(
+                        chrono::steady_clock::now() - call).count());
+            }
+        });
+        start = chrono::steady_clock::now();
+        bool written = inMemory ? index.Snapshot() : index.Flush();
+        double snapshot = secondsSince(start);
+        writing = false;
+        reader.join();
+        cout << setw(12) << (inMemory ? "in-memory" : "buffered") << fixed << setprecision(3) << setw(12) << open
+             << setprecision(0) << setw(16) << ops / lookups << setw(16) << inserted / inserts << setprecision(3)
+             << setw(14) << snapshot << setw(22) << worst << setw(10) << (wrong == 0 && written ? "ok" : "FAILED")
+             << "\n";
+    }
+}
+
+static void VersionBenchmark(long long keys, int m) {
+    const int ops = 100000;
+    cout << "\n=== Latched against copy-on-write readers (" << keys << " keys, m = " << m << ") ===\n";
+    cout << setw(16) << "mode" << setw(16) << "inserts/sec" << setw(16) << "scans/sec" << setw(16) << "lookups/sec"
+         << setw(20) << "repeatable scans" << setw(10) << "check" << "\n";
+    vector<pair<int, int>> records(keys);
+    for (int i = 0; i < keys; ++i) {
+        records[i] = make_pair(2 * i + 1, i);
+    }
+    for (bool versions: {false, true}) {
+        {
+            BTreeIndex build;
+            build.BulkLoad(BenchFileName, records.begin(), records.end(), m);
+        }
+        BTreeIndex index;
+        long long wrong = index.OpenIndexFile(BenchFileName) ? 0 : 1;
+        if (versions && !index.EnableCopyOnWrite()) {
+            wrong++;
+        }
+        // one thread scans a slice of the keys twice per pass and another looks keys up, both while a
+        // writer inserts; a scan is repeatable when both passes see the same records
+        const int slice = (int) min(keys, 100000LL);
+        atomic<bool> writing{true};
+        long long scans = 0, repeated = 0, lookups = 0;
+        auto count = [&](BTreeIndex::RangeIterator it) {
+            long long seen = 0;
+            for (; it != BTreeIndex::RangeIterator(); ++it) {
+                seen++;
+            }
+            return seen;
+        };
+        thread scanner([&] {
+            while (writing.load()) {
+                long long first, second;
+                if (versions) {
+                    BTreeIndex::ReadView view = index.OpenReadView();
+                    first = count(view.RangeScan(0, 2 * slice));
+                    second = count(view.RangeScan(0, 2 * slice));
+                } else {
+                    first = count(index.RangeScan(BenchFileName, 0, 2 * slice));
+                    second = count(index.RangeScan(BenchFileName, 0, 2 * slice));
+                }
+                scans += 2;
+                repeated += first == second;
+            }
+        });
+        thread reader([&] {
+            mt19937 rng(11);
+            while (writing.load()) {
+                int k = (int) (rng() % keys);
+                if (index.SearchARecord(BenchFileName, 2 * k + 1) != k) {
+                    wrong++;
+                }
+                lookups++;
+            }
+        });
+        auto start = chrono::steady_clock::now();
+        for (int k = 0; k < ops; ++k) {
+            index.InsertNewRecordAtIndex(2 * (int) (((long long) k * 7919) % keys), k);
+        }
+        double seconds = secondsSince(start);
+        writing = false;
+        scanner.join();
+        reader.join();
+        if (versions && !index.DisableCopyOnWrite()) {
+            wrong++;
+        }
+        cout << setw(16) << (versions ? "copy-on-write" : "latched") << fixed << setprecision(0) << setw(16)
+             << ops / seconds << setw(16) << scans / seconds << setw(16) << lookups / seconds << setw(19)
+             << (scans ? 100.0 * 2 * repeated / scans : 0) << "%" << setw(10) << (wrong == 0 ? "ok" : "FAILED")
+             << "\n";
+    }
+}
+
+static void BatchBenchmark(long long keys, int m) {
+    cout << "\n=== Batched writes with the log on (" << keys << " keys, m = " << m << ") ===\n";
+    cout << setw(10) << "batch" << setw(14) << "mode" << setw(14) << "ops/sec" << setw(18) << "node writes/op"
+         << setw(10) << "fsyncs" << setw(10) << "check" << "\n";
+    vector<pair<int, int>> records(keys);
+    for (int i = 0; i < keys; ++i) {
+        records[i] = make_pair(2 * i + 1, i);
+    }
+    for (int batch: {1, 10, 100, 1000, 10000, 100000}) {
+        // nine in ten ops insert a new even key, the rest delete an odd one; every batch commits once
+        int total = (int) min((long long) batch * 1000, max((long long) batch, 100000LL));
+        mt19937 rng(batch);
+        vector<BTreeIndex::BatchOp> ops(total);
+        for (auto &op: ops) {
+            int k = (int) (rng() % keys);
+            op = rng() % 10 ? BTreeIndex::BatchOp{BTreeIndex::BatchOp::Upsert, 2 * k, k}
+                            : BTreeIndex::BatchOp{BTreeIndex::BatchOp::Delete, 2 * k + 1, 0};
+        }
+        for (bool batched: {false, true}) {
+            {
+                BTreeIndex build;
+                build.BulkLoad(BenchFileName, records.begin(), records.end(), m);
+            }
+            BTreeIndex index;
+            long long wrong = index.OpenIndexFile(BenchFileName) && index.EnableWriteAheadLog(1 << 30, 1 << 30) ? 0 : 1;
+            long long writesBefore = index.GetMetrics().operations.counters[Metrics::NodeWrites];
+            long long commitsBefore = index.LogStats().commits;
+            auto start = chrono::steady_clock::now();
+            for (int first = 0; first < total; first += batch) {
+                if (batched) {
+                    vector<BTreeIndex::BatchOp> group(ops.begin() + first, ops.begin() + first + batch);
+                    wrong += index.ApplyBatch(group) < 0;
+                    continue;
+                }
+                for (int i = first; i < first + batch; ++i) {
+                    if (ops[i].type == BTreeIndex::BatchOp::Upsert) {
+                        index.InsertNewRecordAtIndex(ops[i].RecordID, ops[i].Reference);
+                    } else {
+                        index.DeleteRecordFromIndex(BenchFileName, ops[i].RecordID, m);
+                    }
+                }
+                wrong += !index.Commit();
+            }
+            double seconds = secondsSince(start);
+            long long writes = index.GetMetrics().operations.counters[Metrics::NodeWrites] - writesBefore;
+            for (int i = 0; i < total; i += 97) {
+                int expected = ops[i].type == BTreeIndex::BatchOp::Upsert ? ops[i].Reference : -1;
+                wrong += index.SearchARecord(BenchFileName, ops[i].RecordID) != expected;
+            }
+            cout << setw(10) << batch << setw(14) << (batched ? "ApplyBatch" : "one by one") << fixed
+                 << setprecision(0) << setw(14) << total / seconds << setprecision(2) << setw(18)
+                 << (double) writes / total << setw(10) << index.LogStats().commits - commitsBefore << setw(10)
+                 << (wrong == 0 ? "ok" : "FAILED") << "\n";
+        }
+    }
+    remove((string(BenchFileName) + ".wal").c_str());
+}
+
+static void BufferedInsertBenchmark(long long keys, int m) {
+    cout << "\n=== Buffered vs classic inserts, random keys (" << keys << " keys, m = " << m << ") ===\n";
+    cout << setw(16) << "mode" << setw(14) << "inserts/sec" << setw(18) << "node writes/op" << setw(18)
+         << "pages to disk/op" << setw(16) << "bytes/op" << setw(10) << "check" << "\n";
+    vector<pair<int, int>> records(keys);
+    for (int i = 0; i < keys; ++i) {
+        records[i] = make_pair(2 * i + 1, i);
+    }
+    // new even keys in random order, into a tree whose pool holds a tenth of its nodes
+    int total = (int) min(keys, 200000LL);
+    mt19937 rng(24);
+    vector<int> ids(total);
+    for (int &id: ids) {
+        id = 2 * (int) (rng() % keys);
+    }
+    for (int pages: {0, 1, 8}) {
+        {
+            BTreeIndex build;
+            build.BulkLoad(BenchFileName, records.begin(), records.end(), m);
+        }
+        BTreeIndex index;
+        long long wrong = index.OpenIndexFile(BenchFileName) ? 0 : 1;
+        index.ConfigureBufferPool(max(64, nodesFor(keys, m) / 10));
+        if (pages > 0) {
+            wrong += !index.EnableBufferedInserts(pages);
+        }
+        long long writesBefore = index.GetMetrics().operations.counters[Metrics::NodeWrites];
+        auto start = chrono::steady_clock::now();
+        for (int id: ids) {
+            index.InsertNewRecordAtIndex(id, id / 2);
+        }
+        // what is still buffered or dirty counts too
+        wrong += pages > 0 && !index.DisableBufferedInserts();
+        wrong += !index.Flush();
+        double seconds = secondsSince(start);
+        long long writes = index.GetMetrics().operations.counters[Metrics::NodeWrites] - writesBefore;
+        BufferPool::Stats stats = index.BufferStats();
+        for (int i = 0; i < total; i += 97) {
+            wrong += index.SearchARecord(BenchFileName, ids[i]) != ids[i] / 2;
+        }
+        string mode = pages == 0 ? "classic" : "buffered x" + to_string(pages);
+        cout << setw(16) << mode << fixed << setprecision(0) << setw(14) << total / seconds << setprecision(2)
+             << setw(18) << (double) writes / total << setw(18) << (double) stats.writeBacks / total << setprecision(0)
+             << setw(16) << (double) stats.bytesWritten / total << setw(10) << (wrong == 0 ? "ok" : "FAILED") << "\n";
+    }
+}
+
+static void ParallelBuildBenchmark(long long keys, int m) {
+    cout << "\n=== Parallel BulkLoad and Verify, shuffled keys (" << keys << " keys, m = " << m << ") ===\n";
+    cout << setw(10) << "threads" << setw(14) << "build (s)" << setw(14) << "keys/sec" << setw(14) << "verify (s)"
+         << setw(14) << "pages/sec" << setw(10) << "check" << "\n";
+    vector<pair<int, int>> records(keys);
+    for (int i = 0; i < keys; ++i) {
+        records[i] = make_pair(2 * i + 1, i);
+    }
+    shuffle(records.begin(), records.end(), mt19937(25));
+    for (unsigned threads: {1u, 2u, 4u, 8u}) {
+        BTreeIndex index;
+        index.SetWorkerThreads(threads);
+        auto start = chrono::steady_clock::now();
+        bool built = index.BulkLoad(BenchFileName, records.begin(), records.end(), m);
+        double build = secondsSince(start);
+        start = chrono::steady_clock::now();
+        BTreeIndex::VerifyReport report = index.Verify();
+        double verify = secondsSince(start);
+        bool ok = built && report.ok && report.records == keys;
+        cout << setw(10) << threads << fixed << setprecision(2) << setw(14) << build << setprecision(0) << setw(14)
+             << keys / build << setprecision(3) << setw(14) << verify << setprecision(0) << setw(14)
+             << (report.nodes + report.freePages) / verify << setw(10) << (ok ? "ok" : "FAILED") << "\n";
+    }
+}
+
+int main(int argc, char **argv) {
+    long long maxKeys = argc > 1 ? atoll(argv[1]) : 1000000;
+    int m = argc > 2 ? atoi(argv[2]) : 32;
+    long long maxBulkKeys = argc > 3 ? atoll(argv[3]) : 1000000;
+
+    NodeSearchBenchmark();
+    LookupBenchmark(maxKeys, m);
+    BulkLoadBenchmark(maxBulkKeys, m);
+    ParallelBuildBenchmark(maxBulkKeys, m);
+    MultiSearchBenchmark(maxKeys, m);
+    QueueDepthBenchmark(min(maxKeys, 10000000LL), m);
+    ScanBenchmark(min(maxKeys, 10000000LL), m);
+    WriteAheadLogBenchmark(m);
+    EngineBenchmark(min(maxKeys, 1000000LL), m);
+    DeleteBenchmark(min(maxKeys, 1000000LL), m);
+    AllocationBenchmark(min(maxKeys, 1000000LL), m);
+    ConcurrencyBenchmark(min(maxKeys, 1000000LL), m);
+    InMemoryBenchmark(min(maxKeys, 10000000LL), m);
+    VersionBenchmark(min(maxKeys, 1000000LL), m);
+    BatchBenchmark(min(maxKeys, 1000000LL), m);
+    BufferedInsertBenchmark(min(maxKeys, 1000000LL), m);
+    VarKeyBenchmark(min(maxKeys, 1000000LL));
+
+    remove(BenchFileName);
+    return failedChecks == 0 ? 0 : 1;
+}
@@ -0,0 +1,513 @@
+#include "BTreeIndex.h"
+#include "BTreeIndex.cpp"
+#include "BufferPool.cpp"
+#include "StorageBackend.cpp"
+#include "WriteAheadLog.cpp"
+#include "Metrics.cpp"
+#include <chrono>
+#include <random>
+#include <iomanip>
+#include <sstream>
+#include <map>
+#include <cmath>
+#include <sys/resource.h>
+#include <sys/stat.h>
+using namespace std;
+
+// Build with:  g++ -O2 -std=c++17 -pthread benchsuite.cpp -o benchsuite
+// Usage:       ./benchsuite [--keys N] [--m M] [--ops N] [--frames N] [--range N] [--mix R,R,...] [--seed N]
+//                           [--wal] [--workloads name,name,...] [--format table|csv|json]
+//                           [--baseline results.csv] [--tolerance 0.10]
+//
+// Runs a fixed set of workloads against BTreeIndex and prints one row per workload: throughput,
+// p50/p99/p99.9 latency, file bytes read and written, and the peak RSS of the process so far.
+// Every workload starts from a fresh index built outside the timed part, and the same seed gives
+// the same keys, so two runs on one machine are comparable. With --baseline the run is compared to
+// an earlier CSV run and exits with status 1 if any workload lost more than --tolerance of its ops/sec.
+
+static const char *SuiteFileName = "BTreeSuite.bin";
+
+struct Options {
+    long long keys = 100000;
+    int m = 32;
+    long long ops = 100000;
+    size_t frames = BufferPool::DefaultCapacity;
+    int range = 100;
+    vector<int> mix = {95, 50};
+    unsigned seed = 42;
+    bool wal = false;
+    string format = "table";
+    vector<string> workloads;
+    string baseline;
+    double tolerance = 0.10;
+};
+
+struct Result {
+    string workload;
+    long long ops = 0;
+    double seconds = 0;
+    bool perOperation = true; // false when only the whole run was timed, so there are no percentiles
+    double p50 = 0, p99 = 0, p999 = 0;
+    long long bytesRead = 0;
+    long long bytesWritten = 0;
+    long peakRssKb = 0;
+
+    double opsPerSecond() const { return seconds > 0 ? ops / seconds : 0; }
+};
+
+static long peakRssKb() {
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// Zipfian ranks over [0, items) as in YCSB (Gray et al., "Quickly generating billion-record synthetic
+// databases"), with theta 0.99. Ranks are scattered over the key space by a multiplicative permutation,
+// so the hot keys are not all neighbours in one leaf.
+class ZipfianKeys {
+public:
+    ZipfianKeys(long long items, unsigned seed, double theta = 0.99)
+            : items(items), theta(theta), rng(seed) {
+        double zeta2 = zeta(2);
+        zetaN = zeta(items);
+        alpha = 1 / (1 - theta);
+        eta = (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta2 / zetaN);
+    }
+
+    long long next() {
+        double u = uniform(rng);
+        double uz = u * zetaN;
+        long long rank;
+        if (uz < 1) {
+            rank = 0;
+        } else if (uz < 1 + pow(0.5, theta)) {
+            rank = 1;
+        } else {
+            rank = min(items - 1, (long long) (items * pow(eta * u - eta + 1, alpha)));
+        }
+        return (long long) ((unsigned long long) rank * 2654435761ULL % (unsigned long long) items);
+    }
+
+private:
+    long long items;
+    double theta, zetaN, alpha, eta;
+    mt19937_64 rng;
+    uniform_real_distribution<double> uniform{0.0, 1.0};
+
+    double zeta(long long n) const {
+        double sum = 0;
+        for (long long i = 1; i <= n; ++i) {
+            sum += 1 / pow((double) i, theta);
+        }
+        return sum;
+    }
+};
+
+////////////////////////////////////////////Measurement////////////////////////////////////////////
+
+// I/O counters of an open index: page traffic through the buffer pool plus the write-ahead log.
+struct IoSnapshot {
+    long long read = 0;
+    long long written = 0;
+
+    static IoSnapshot of(const BTreeIndex &index) {
+        BufferPool::Stats pool = index.BufferStats();
+        return {pool.bytesRead, pool.bytesWritten + index.LogStats().bytes};
+    }
+};
+
+static double percentile(const vector<long long> &sorted, double q) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    // nearest rank: the smallest sample with at least q of all samples at or below it
+    size_t rank = (size_t) ceil(q * sorted.size());
+    return (double) sorted[min(sorted.size(), max(rank, (size_t) 1)) - 1];
+}
+
+// Times every call of op(i) for i in [0, ops). Dirty pages are flushed after the timed loop so the
+// bytes a workload writes are counted even when they were still cached when it finished.
+template<class Operation>
+static Result measure(const string &workload, BTreeIndex &index, long long ops, Operation op) {
+    Result result;
+    result.workload = workload;
+    result.ops = ops;
+    vector<long long> latencies;
+    latencies.reserve(ops);
+    IoSnapshot before = IoSnapshot::of(index);
+    auto start = chrono::steady_clock::now();
+    for (long long i = 0; i < ops; ++i) {
+        auto begin = chrono::steady_clock::now();
+        op(i);
+        latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count());
+    }
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    index.Flush();
+    IoSnapshot after = IoSnapshot::of(index);
+    sort(latencies.begin(), latencies.end());
+    result.p50 = percentile(latencies, 0.50);
+    result.p99 = percentile(latencies, 0.99);
+    result.p999 = percentile(latencies, 0.999);
+    result.bytesRead = after.read - before.read;
+    result.bytesWritten = after.written - before.written;
+    result.peakRssKb = peakRssKb();
+    return result;
+}
+
+static void openEmpty(BTreeIndex &index, const Options &options) {
+    index.ConfigureBufferPool(options.frames);
+    if (options.wal) {
+        index.EnableWriteAheadLog();
+    }
+    // two places only: inserts grow the file by extents as they go, as they would in production
+    index.CreateIndexFile(SuiteFileName, 2, options.m);
+}
+
+// The base index of the read, delete and mixed workloads holds the odd RecordIDs 1, 3, ..., 2 keys - 1,
+// so even RecordIDs below 2 keys are known misses and free for inserts.
+static void openBase(BTreeIndex &index, const Options &options) {
+    vector<pair<int, int>> records(options.keys);
+    for (long long i = 0; i < options.keys; ++i) {
+        records[i] = make_pair((int) (2 * i + 1), (int) i);
+    }
+    index.ConfigureBufferPool(options.frames);
+    if (options.wal) {
+        index.EnableWriteAheadLog();
+    }
+    index.BulkLoad(SuiteFileName, records.begin(), records.end(), options.m);
+}
+
+static vector<int> shuffled(long long count, long long first, long long step, mt19937 &rng) {
+    vector<int> keys(count);
+    for (long long i = 0; i < count; ++i) {
+        keys[i] = (int) (first + i * step);
+    }
+    shuffle(keys.begin(), keys.end(), rng);
+    return keys;
+}
+
+/////////////////////////////////////////////Workloads/////////////////////////////////////////////
+
+static Result InsertWorkload(const Options &options, const string &order) {
+    mt19937 rng(options.seed);
+    vector<int> keys;
+    if (order == "seq") {
+        keys = shuffled(options.keys, 1, 1, rng);
+        sort(keys.begin(), keys.end());
+    } else if (order == "random") {
+        keys = shuffled(options.keys, 1, 1, rng);
+    } else {
+        // repeated RecordIDs are part of the workload: the index has to reject them
+        ZipfianKeys zipf(options.keys, options.seed);
+        keys.resize(options.keys);
+        for (int &key: keys) {
+            key = (int) zipf.next() + 1;
+        }
+    }
+    BTreeIndex index;
+    openEmpty(index, options);
+    return measure("insert_" + order, index, (long long) keys.size(), [&](long long i) {
+        index.InsertNewRecordAtIndex(keys[i], keys[i]);
+    });
+}
+
+static Result SearchWorkload(const Options &options, bool hit) {
+    BTreeIndex index;
+    openBase(index, options);
+    mt19937 rng(options.seed);
+    uniform_int_distribution<long long> pick(0, options.keys - 1);
+    vector<int> probes(options.ops);
+    for (int &probe: probes) {
+        probe = (int) (2 * pick(rng) + (hit ? 1 : 2));
+    }
+    long long found = 0;
+    Result result = measure(hit ? "search_hit" : "search_miss", index, options.ops, [&](long long i) {
+        found += index.SearchARecord(SuiteFileName, probes[i]) != -1;
+    });
+    if (found != (hit ? options.ops : 0)) {
+        cerr << result.workload << ": found " << found << " of " << options.ops << " probes\n";
+    }
+    return result;
+}
+
+static Result RangeScanWorkload(const Options &options) {
+    BTreeIndex index;
+    openBase(index, options);
+    mt19937 rng(options.seed);
+    uniform_int_distribution<long long> pick(0, options.keys - 1);
+    long long scans = max(1LL, options.ops / 10), entries = 0;
+    vector<int> starts(scans);
+    for (int &start: starts) {
+        start = (int) (2 * pick(rng) + 1);
+    }
+    // a scan of `range` records spans 2 * range RecordIDs of the odd-only base index
+    Result result = measure("range_scan", index, scans, [&](long long i) {
+        for (auto it = index.RangeScan(SuiteFileName, starts[i], starts[i] + 2 * options.range - 1);
+             it != BTreeIndex::RangeIterator(); ++it) {
+            entries++;
+        }
+    });
+    if (entries < scans) {
+        cerr << "range_scan: " << entries << " records in " << scans << " scans\n";
+    }
+    return result;
+}
+
+static Result DeleteWorkload(const Options &options) {
+    BTreeIndex index;
+    openBase(index, options);
+    mt19937 rng(options.seed);
+    vector<int> keys = shuffled(options.keys, 1, 2, rng);
+    keys.resize(min(options.ops, options.keys));
+    return measure("delete", index, (long long) keys.size(), [&](long long i) {
+        index.DeleteRecordFromIndex(SuiteFileName, keys[i], options.m);
+    });
+}
+
+static Result MixedWorkload(const Options &options, int readPercent) {
+    BTreeIndex index;
+    openBase(index, options);
+    mt19937 rng(options.seed);
+    uniform_int_distribution<long long> pick(0, options.keys - 1);
+    vector<int> inserts = shuffled(options.keys, 2, 2, rng);
+    vector<int> probes(options.ops);
+    size_t next = 0;
+    for (int &probe: probes) {
+        // a negative probe is an insert of a RecordID the index does not have yet
+        if ((int) (rng() % 100) < readPercent || next == inserts.size()) {
+            probe = (int) (2 * pick(rng) + 1);
+        } else {
+            probe = -inserts[next++];
+        }
+    }
+    return measure("mixed_r" + to_string(readPercent), index, options.ops, [&](long long i) {
+        if (probes[i] > 0) {
+            index.SearchARecord(SuiteFileName, probes[i]);
+        } else {
+            index.InsertNewRecordAtIndex(-probes[i], -probes[i]);
+        }
+    });
+}
+
+static Result BulkLoadWorkload(const Options &options) {
+    mt19937 rng(options.seed);
+    vector<int> keys = shuffled(options.keys, 1, 1, rng);
+    vector<pair<int, int>> records(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        records[i] = make_pair(keys[i], keys[i]);
+    }
+    BTreeIndex index;
+    index.ConfigureBufferPool(options.frames);
+    // one BulkLoad call covers every record, so only its throughput is reported
+    Result result = measure("bulk_load", index, 1, [&](long long) {
+        index.BulkLoad(SuiteFileName, records.begin(), records.end(), options.m);
+    });
+    result.ops = options.keys;
+    result.perOperation = false;
+    struct stat file{};
+    if (stat(SuiteFileName, &file) == 0) {
+        result.bytesWritten = file.st_size; // bulk loading writes the file directly, not through the pool
+    }
+    return result;
+}
+
+/////////////////////////////////////////////Reporting/////////////////////////////////////////////
+
+static const char *Columns[] = {"workload", "keys", "m", "ops", "seconds", "ops_per_sec", "p50_ns", "p99_ns",
+                                "p999_ns", "bytes_read", "bytes_written", "peak_rss_kb"};
+
+static vector<string> fields(const Result &result, const Options &options, const string &missing) {
+    auto number = [](double value, int precision) {
+        ostringstream out;
+        out << fixed << setprecision(precision) << value;
+        return out.str();
+    };
+    return {result.workload, to_string(options.keys), to_string(options.m), to_string(result.ops),
+            number(result.seconds, 6), number(result.opsPerSecond(), 1),
+            result.perOperation ? number(result.p50, 0) : missing,
+            result.perOperation ? number(result.p99, 0) : missing,
+            result.perOperation ? number(result.p999, 0) : missing,
+            to_string(result.bytesRead), to_string(result.bytesWritten), to_string(result.peakRssKb)};
+}
+
+static void report(const vector<Result> &results, const Options &options, ostream &out) {
+    const int columns = sizeof(Columns) / sizeof(Columns[0]);
+    if (options.format == "csv") {
+        for (int c = 0; c < columns; ++c) {
+            out << (c ? "," : "") << Columns[c];
+        }
+        out << "\n";
+        for (const Result &result: results) {
+            vector<string> row = fields(result, options, "");
+            for (int c = 0; c < columns; ++c) {
+                out << (c ? "," : "") << row[c];
+            }
+            out << "\n";
+        }
+    } else if (options.format == "json") {
+        out << "{\"keys\": " << options.keys << ", \"m\": " << options.m << ", \"frames\": " << options.frames
+            << ", \"wal\": " << (options.wal ? "true" : "false") << ", \"seed\": " << options.seed
+            << ", \"results\": [\n";
+        for (size_t r = 0; r < results.size(); ++r) {
+            vector<string> row = fields(results[r], options, "null");
+            out << "  {\"workload\": \"" << row[0] << "\"";
+            for (int c = 3; c < columns; ++c) {
+                out << ", \"" << Columns[c] << "\": " << row[c];
+            }
+            out << "}" << (r + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "]}\n";
+    } else {
+        const int widths[] = {16, 10, 5, 10, 11, 14, 10, 10, 10, 14, 14, 12};
+        out << left << setw(widths[0]) << Columns[0] << right;
+        for (int c = 1; c < columns; ++c) {
+            out << setw(widths[c]) << Columns[c];
+        }
+        out << "\n";
+        for (const Result &result: results) {
+            vector<string> row = fields(result, options, "-");
+            out << left << setw(widths[0]) << row[0] << right;
+            for (int c = 1; c < columns; ++c) {
+                out << setw(widths[c]) << row[c];
+            }
+            out << "\n";
+        }
+    }
+}
+
+// Compares ops/sec against an earlier --format csv run; workloads missing from either side are skipped.
+static bool compareToBaseline(const vector<Result> &results, const Options &options) {
+    ifstream in(options.baseline);
+    if (!in) {
+        cerr << "Cannot read baseline " << options.baseline << "\n";
+        return false;
+    }
+    map<string, double> baseline;
+    string line;
+    getline(in, line);
+    while (getline(in, line)) {
+        vector<string> row;
+        stringstream cells(line);
+        for (string cell; getline(cells, cell, ',');) {
+            row.push_back(cell);
+        }
+        if (row.size() > 5) {
+            baseline[row[0]] = atof(row[5].c_str());
+        }
+    }
+    bool ok = true;
+    for (const Result &result: results) {
+        auto found = baseline.find(result.workload);
+        if (found == baseline.end() || found->second <= 0) {
+            continue;
+        }
+        double change = result.opsPerSecond() / found->second - 1;
+        if (change < -options.tolerance) {
+            ok = false;
+            cerr << "REGRESSION " << result.workload << ": " << fixed << setprecision(1) << result.opsPerSecond()
+                 << " ops/sec against " << found->second << " (" << setprecision(1) << 100 * change << "%)\n";
+        }
+    }
+    return ok;
+}
+
+static bool parseOptions(int argc, char **argv, Options &options) {
+    auto list = [](const string &text) {
+        vector<string> items;
+        stringstream in(text);
+        for (string item; getline(in, item, ',');) {
+            if (!item.empty()) {
+                items.push_back(item);
+            }
+        }
+        return items;
+    };
+    for (int i = 1; i < argc; ++i) {
+        string flag = argv[i];
+        if (flag == "--wal") {
+            options.wal = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            cerr << "Missing value for " << flag << "\n";
+            return false;
+        }
+        string value = argv[++i];
+        if (flag == "--keys") {
+            options.keys = max(1LL, atoll(value.c_str()));
+        } else if (flag == "--m") {
+            options.m = max(3, atoi(value.c_str()));
+        } else if (flag == "--ops") {
+            options.ops = max(1LL, atoll(value.c_str()));
+        } else if (flag == "--frames") {
+            options.frames = (size_t) max(1LL, atoll(value.c_str()));
+        } else if (flag == "--range") {
+            options.range = max(1, atoi(value.c_str()));
+        } else if (flag == "--mix") {
+            options.mix.clear();
+            for (const string &ratio: list(value)) {
+                options.mix.push_back(min(100, max(0, atoi(ratio.c_str()))));
+            }
+        } else if (flag == "--seed") {
+            options.seed = (unsigned) atoll(value.c_str());
+        } else if (flag == "--workloads") {
+            options.workloads = list(value);
+        } else if (flag == "--format") {
+            options.format = value;
+        } else if (flag == "--baseline") {
+            options.baseline = value;
+        } else if (flag == "--tolerance") {
+            options.tolerance = atof(value.c_str());
+        } else {
+            cerr << "Unknown option " << flag << "\n";
+            return false;
+        }
+    }
+    if (options.keys > (1LL << 29)) {
+        cerr << "--keys must stay below 2^29 so every RecordID fits an int\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        return 2;
+    }
+    vector<pair<string, function<Result()>>> suite = {
+            {"insert_seq",    [&] { return InsertWorkload(options, "seq"); }},
+            {"insert_random", [&] { return InsertWorkload(options, "random"); }},
+            {"insert_zipf",   [&] { return InsertWorkload(options, "zipf"); }},
+            {"search_hit",    [&] { return SearchWorkload(options, true); }},
+            {"search_miss",   [&] { return SearchWorkload(options, false); }},
+            {"range_scan",    [&] { return RangeScanWorkload(options); }},
+            {"delete",        [&] { return DeleteWorkload(options); }},
+            {"bulk_load",     [&] { return BulkLoadWorkload(options); }},
+    };
+    for (int readPercent: options.mix) {
+        suite.emplace_back("mixed_r" + to_string(readPercent), [&options, readPercent] {
+            return MixedWorkload(options, readPercent);
+        });
+    }
+
+    vector<Result> results;
+    for (auto &workload: suite) {
+        if (!options.workloads.empty() &&
+            find(options.workloads.begin(), options.workloads.end(), workload.first) == options.workloads.end()) {
+            continue;
+        }
+        results.push_back(workload.second());
+        remove(SuiteFileName);
+        remove((string(SuiteFileName) + ".wal").c_str());
+    }
+    report(results, options, cout);
+    if (!options.baseline.empty() && !compareToBaseline(results, options)) {
+        return 1;
+    }
+    return 0;
+}
@@ -1,85 +1,211 @@
-#include "BTreeIndex.h"
-#include "BTreeIndex.cpp"
-#include <iomanip>
-using namespace std;
-
-void Test1(){
-    const int initialRecords = 10;
-    const int m = 5;
-
-    try {
-        BTreeIndex index;
-
-        index.CreateIndexFile("BTreeIndex.txt", initialRecords, m);
-        cout << "=== Initial File Created ===" << endl;
-        index.DisplayIndexFileContent("BTreeIndex.txt");
-
-        vector<pair<int, int>> insertions = {
-                {3, 12}, {7, 24}, {10, 48}, {24, 60}, {14, 72},
-                {19, 84}, {30, 96}, {15, 108}, {1, 120}, {5, 132},
-                {2, 144}, {8, 156}, {9, 168}, {6, 180}, {11, 192},
-                {12, 204}, {17, 216}, {18, 228}, {32, 240}
-        };
-
-        cout << "\n=== Performing Insertions ===" << endl;
-        for (const auto& [id, ref] : insertions) {
-            cout << "\nInserting Record ID: " << id << " with Reference: " << ref << endl;
-            index.InsertNewRecordAtIndex(id, ref);
-            cout << "Current tree state after insertion:" << endl;
-            index.DisplayIndexFileContent("BTreeIndex.txt");
-        }
-
-        cout << "\n=== Testing Searches ===" << endl;
-        vector<int> searchTests = {3, 10, 15, 99};
-        for (int id : searchTests) {
-            int ref = index.SearchARecord("BTreeIndex.txt", id);
-            cout << "Search for " << id << ": "
-                 << (ref != -1 ? "Found (Ref: " + to_string(ref) + ")" : "Not found")
-                 << endl;
-        }
-
-        vector<int> deletions = {10, 9, 8};
-        cout << "\n=== Performing Deletions ===" << endl;
-        for (int id : deletions) {
-            index.DeleteRecordFromIndex("BTreeIndex.txt", id, m);
-            cout << "After deleting " << id << ":" << endl;
-            index.DisplayIndexFileContent("BTreeIndex.txt");
-        }
-
-        cout << "\n=== Final State ===" << endl;
-        index.DisplayIndexFileContent("BTreeIndex.txt");
-
-    } catch (const exception& e) {
-        cerr << "Error: " << e.what() << endl;
-        return;
-    }
-}
-
-int main() {
-    cout << "============================================\n";
-    cout << "       B-Tree Index Management System       \n";
-    cout << "============================================\n";
-    cout << "Run assignment example? (y/n): ";
-    char ans;
-    cin >> ans;
-
-    if (ans == 'y' || ans == 'Y') {
-        cout << "\nRunning Assignment Example...\n";
-        Test1();
-    } else {
-        BTreeIndex bTreeIndex;
-        int M;
-
-        cout << "\n=== Create Index File ===\n";
-        cout << "Enter the value of m (order of B-Tree): ";
-        cin >> M;
-
-        bTreeIndex.CreateIndexFile("BTreeIndex.txt", M * 2, M);
-        cout << "\n✔ Index file created successfully with " << M * 2 << " records and m = " << M << ".\n";
-
-        bTreeIndex.run();
-    }
-
-    cout << "\nThank you for using the B-Tree Index Management System!\n";
-    return 0;
+#include "BTreeIndex.h"
+#include "BTreeIndex.cpp"
+#include "BufferPool.cpp"
+#include "StorageBackend.cpp"
+#include "WriteAheadLog.cpp"
+#include "Metrics.cpp"
+#include <iomanip>
+#include <map>
+#include <random>
+#include <climits>
+using namespace std;
+
+void Test1(){
+    const int initialRecords = 10;
+    const int m = 5;
+
+    try {
+        BTreeIndex index;
+
+        index.CreateIndexFile("BTreeIndex.bin", initialRecords, m);
+        cout << "=== Initial File Created ===" << endl;
+        index.DisplayIndexFileContent("BTreeIndex.bin");
+
+        vector<pair<int, int>> insertions = {
+                {3, 12}, {7, 24}, {10, 48}, {24, 60}, {14, 72},
+                {19, 84}, {30, 96}, {15, 108}, {1, 120}, {5, 132},
+                {2, 144}, {8, 156}, {9, 168}, {6, 180}, {11, 192},
+                {12, 204}, {17, 216}, {18, 228}, {32, 240}
+        };
+
+        cout << "\n=== Performing Insertions ===" << endl;
+        for (const auto& [id, ref] : insertions) {
+            cout << "\nInserting Record ID: " << id << " with Reference: " << ref << endl;
+            index.InsertNewRecordAtIndex(id, ref);
+            cout << "Current tree state after insertion:" << endl;
+            index.DisplayIndexFileContent("BTreeIndex.bin");
+        }
+
+        cout << "\n=== Testing Searches ===" << endl;
+        vector<int> searchTests = {3, 10, 15, 99};
+        for (int id : searchTests) {
+            int ref = index.SearchARecord("BTreeIndex.bin", id);
+            cout << "Search for " << id << ": "
+                 << (ref != -1 ? "Found (Ref: " + to_string(ref) + ")" : "Not found")
+                 << endl;
+        }
+
+        vector<int> deletions = {10, 9, 8};
+        cout << "\n=== Performing Deletions ===" << endl;
+        for (int id : deletions) {
+            index.DeleteRecordFromIndex("BTreeIndex.bin", id, m);
+            cout << "After deleting " << id << ":" << endl;
+            index.DisplayIndexFileContent("BTreeIndex.bin");
+        }
+
+        cout << "\n=== Final State ===" << endl;
+        index.DisplayIndexFileContent("BTreeIndex.bin");
+
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << endl;
+        return;
+    }
+}
+
+// Random inserts and deletes on a tree of order m. After every step the tree must pass Verify and hold
+// exactly the records of a std::map given the same steps. The first half of the steps mostly inserts and
+// the second half mostly deletes, so nodes split on the way up and borrow and merge on the way down; at the
+// end every record left is deleted, so the tree is checked empty too. With copyOnWrite the mode is turned on
+// while the file is still empty.
+bool RandomizedCheck(int m, int steps, unsigned seed, bool copyOnWrite) {
+    const char *filename = "BTreeCheck.bin";
+    BTreeIndex index;
+    index.SetWorkerThreads(1);
+    index.CreateIndexFile(filename, 10, m);
+    mt19937 rng(seed);
+    map<int, int> expected;
+    auto failure = [&]() -> string {
+        BTreeIndex::VerifyReport report = index.Verify();
+        if (!report.ok) {
+            return report.problems.empty() ? "Verify failed" : report.problems[0];
+        }
+        if (report.records != (long long) expected.size()) {
+            return "the tree holds " + to_string(report.records) + " records, the map " + to_string(expected.size());
+        }
+        auto want = expected.begin();
+        BTreeIndex::RangeIterator end;
+        for (auto it = index.RangeScan(filename, INT_MIN, INT_MAX); it != end; ++it, ++want) {
+            if (want == expected.end() || it->first != want->first || it->second != want->second) {
+                return "the scan returns (" + to_string(it->first) + ", " + to_string(it->second) +
+                       ") out of step with the map";
+            }
+        }
+        return want == expected.end() ? "" : "the scan stops before " + to_string(want->first);
+    };
+    auto report = [&](const string &step, const string &problem) {
+        cerr << "m = " << m << ", seed " << seed << (copyOnWrite ? ", copy-on-write" : "") << ", " << step << ": "
+             << problem << endl;
+        remove(filename);
+        return false;
+    };
+
+    if (copyOnWrite) {
+        string problem = index.EnableCopyOnWrite() ? failure() : "copy-on-write cannot be turned on";
+        if (!problem.empty()) {
+            return report("empty file", problem);
+        }
+    }
+    int keyRange = max(16, steps / 2);
+    for (int step = 0; step < steps; ++step) {
+        int RecordID = (int) (rng() % keyRange);
+        bool insert = (int) (rng() % 10) < (step < steps / 2 ? 7 : 3);
+        if (insert) {
+            int Reference = (int) (rng() % 1000000);
+            index.InsertNewRecordAtIndex(RecordID, Reference);
+            expected.emplace(RecordID, Reference);
+        } else {
+            index.DeleteRecordFromIndex(filename, RecordID, m);
+            expected.erase(RecordID);
+        }
+        string problem = failure();
+        if (!problem.empty()) {
+            return report("step " + to_string(step) + " (" + (insert ? "insert " : "delete ") + to_string(RecordID) +
+                          ")", problem);
+        }
+    }
+    while (!expected.empty()) {
+        int RecordID = expected.begin()->first;
+        index.DeleteRecordFromIndex(filename, RecordID, m);
+        expected.erase(RecordID);
+        string problem = failure();
+        if (!problem.empty()) {
+            return report("emptying the tree (delete " + to_string(RecordID) + ")", problem);
+        }
+    }
+    remove(filename);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 2 && string(argv[1]) == "--check") {
+        int steps = argc > 2 ? atoi(argv[2]) : 2000;
+        int failed = 0;
+        for (int m: {3, 4, 5, 8, 32}) {
+            for (bool copyOnWrite: {false, true}) {
+                for (unsigned seed = 1; seed <= 3; ++seed) {
+                    failed += RandomizedCheck(m, steps, seed, copyOnWrite) ? 0 : 1;
+                }
+            }
+            cout << "m = " << m << ": " << steps << " random inserts and deletes per seed, in place and copy-on-write"
+                 << endl;
+        }
+        cout << (failed == 0 ? "OK" : to_string(failed) + " runs FAILED") << endl;
+        return failed == 0 ? 0 : 1;
+    }
+    if (argc == 4 && string(argv[1]) == "--convert") {
+        BTreeIndex index;
+        if (!index.ConvertTextIndexFile(argv[2], argv[3])) {
+            cerr << "Could not convert " << argv[2] << endl;
+            return 1;
+        }
+        cout << "Converted " << argv[2] << " to binary index " << argv[3] << endl;
+        index.DisplayIndexFileContent(argv[3]);
+        return 0;
+    }
+    if (argc == 3 && string(argv[1]) == "--verify") {
+        BTreeIndex index;
+        if (!index.OpenIndexFileReadOnly(argv[2])) {
+            cerr << "Could not open " << argv[2] << endl;
+            return 1;
+        }
+        BTreeIndex::VerifyReport report = index.Verify();
+        cout << argv[2] << ": height " << report.height << ", " << report.nodes << " nodes ("
+             << report.leaves << " leaves), " << report.records << " records, " << report.freePages
+             << " free pages" << endl;
+        for (const string &problem: report.problems) {
+            cout << "  " << problem << endl;
+        }
+        if (report.problemCount > (long long) report.problems.size()) {
+            cout << "  ... and " << report.problemCount - (long long) report.problems.size() << " more" << endl;
+        }
+        cout << (report.ok ? "OK" : "CORRUPT") << endl;
+        return report.ok ? 0 : 2;
+    }
+
+    cout << "============================================\n";
+    cout << "       B-Tree Index Management System       \n";
+    cout << "============================================\n";
+    cout << "Run assignment example? (y/n): ";
+    char ans;
+    cin >> ans;
+
+    if (ans == 'y' || ans == 'Y') {
+        cout << "\nRunning Assignment Example...\n";
+        Test1();
+    } else {
+        BTreeIndex bTreeIndex;
+        int M;
+
+        cout << "\n=== Create Index File ===\n";
+        cout << "Enter the value of m (order of B-Tree): ";
+        cin >> M;
+
+        bTreeIndex.CreateIndexFile("BTreeIndex.bin", M * 2, M);
+        cout << "\n✔ Index file created successfully with " << M * 2 << " records and m = " << M << ".\n";
+
+        bTreeIndex.run();
+    }
+
+    cout << "\nThank you for using the B-Tree Index Management System!\n";
+    return 0;
 }
\ No newline at end of file